@@ -0,0 +1,127 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+// Attribute encoding of --bvh-compressed. Normals are octahedral, two signed
+// 16 bit values per unit vector. Positions are 16 bit steps above the origin
+// of their block of COMPRESSED_BLOCK_SIZE triangles. Blocks follow the leaf
+// order, so one covers a few neighbouring leaves whatever the node layout.
+//
+// Every block has its own step per axis, the smallest power of two its
+// corners fit into with 16 bits, and an origin that is a multiple of it. The
+// precision follows the block, not the scene: a block of a small mesh gets
+// fine steps even next to a block of a wall. A corner shared with a block of
+// coarser steps is rounded to those, which lie on the grid of every finer
+// block too, so it decodes to the same float on both sides of a block
+// border and there are no cracks.
+//
+// A block is COMPRESSED_BLOCK_WORDS 32 bit words: the origin and the step size
+// as six floats, then five words per triangle holding the nine coordinates,
+// two per word, low half first.
+
+const int COMPRESSED_BLOCK_SIZE = 32;
+const int COMPRESSED_HEADER_WORDS = 6;
+const int COMPRESSED_TRIANGLE_WORDS = 5;
+const int COMPRESSED_BLOCK_WORDS = COMPRESSED_HEADER_WORDS + COMPRESSED_TRIANGLE_WORDS * COMPRESSED_BLOCK_SIZE;
+const float COMPRESSED_POSITION_STEPS = 65535.0f;
+// Widest block in steps, rounding the origin down and the corners to the
+// nearest step adds up to two more
+const float COMPRESSED_BLOCK_STEPS = COMPRESSED_POSITION_STEPS - 2.0f;
+
+// Smallest power of two not below pValue
+inline float powerOfTwoAbove(float pValue) {
+	int exponent;
+	float mantissa = std::frexp(std::max(pValue, std::numeric_limits<float>::min()), &exponent);
+	return std::ldexp(1.0f, mantissa == 0.5f ? exponent - 1 : exponent);
+}
+
+// Folds the lower hemisphere of the octahedron over the upper one. Zero
+// vectors map to +z.
+inline uint32_t encodeOctahedral(const glm::vec3& pNormal) {
+	float length = std::abs(pNormal.x) + std::abs(pNormal.y) + std::abs(pNormal.z);
+	if (length == 0.0f) return 0;
+
+	glm::vec3 normal = pNormal / length;
+	glm::vec2 encoded(normal.x, normal.y);
+	if (normal.z < 0.0f) {
+		glm::vec2 sign(normal.x >= 0.0f ? 1.0f : -1.0f, normal.y >= 0.0f ? 1.0f : -1.0f);
+		encoded = (1.0f - glm::abs(glm::vec2(normal.y, normal.x))) * sign;
+	}
+	return glm::packSnorm2x16(encoded);
+}
+
+inline glm::vec3 decodeOctahedral(uint32_t pEncoded) {
+	glm::vec2 encoded = glm::unpackSnorm2x16(pEncoded);
+	glm::vec3 normal(encoded.x, encoded.y, 1.0f - std::abs(encoded.x) - std::abs(encoded.y));
+	if (normal.z < 0.0f) {
+		glm::vec2 sign(normal.x >= 0.0f ? 1.0f : -1.0f, normal.y >= 0.0f ? 1.0f : -1.0f);
+		glm::vec2 folded = (1.0f - glm::abs(glm::vec2(normal.y, normal.x))) * sign;
+		normal.x = folded.x;
+		normal.y = folded.y;
+	}
+	return glm::normalize(normal);
+}
+
+// Rounds to the nearest step. pMin is a multiple of the power of two pStep,
+// so both quotients are exact and the result only depends on the grid.
+inline uint32_t quantizeCoordinate(float pValue, float pMin, float pStep) {
+	float steps = std::round(pValue / pStep) - pMin / pStep;
+	return (uint32_t)std::clamp(steps, 0.0f, COMPRESSED_POSITION_STEPS);
+}
+
+inline float dequantizeCoordinate(uint32_t pSteps, float pMin, float pStep) {
+	return pMin + (float)pSteps * pStep;
+}
+
+// Smallest power of two step per axis that holds the positions in
+// [pMin, pMax] with 16 bits. Positions also stay below 2^24 steps from 0, so
+// every multiple of the step up to them is an exact float.
+inline glm::vec3 compressedBlockStep(const glm::vec3& pMin, const glm::vec3& pMax) {
+	glm::vec3 step;
+	for (int axis = 0; axis < 3; axis++) {
+		float magnitude = std::max(std::abs(pMin[axis]), std::abs(pMax[axis]));
+		step[axis] = powerOfTwoAbove(std::max((pMax[axis] - pMin[axis]) / COMPRESSED_BLOCK_STEPS, magnitude / 16777216.0f));
+	}
+	return step;
+}
+
+// Writes the block header for the positions in [pMin, pMax], which must be
+// multiples of pStep and fit compressedBlockStep
+inline void writeCompressedHeader(uint32_t* pBlock, const glm::vec3& pMin, const glm::vec3& pStep) {
+	float header[COMPRESSED_HEADER_WORDS];
+	for (int axis = 0; axis < 3; axis++) {
+		header[axis] = std::floor(pMin[axis] / pStep[axis]) * pStep[axis];
+		header[3 + axis] = pStep[axis];
+	}
+	std::memcpy(pBlock, header, sizeof(header));
+}
+
+inline void writeCompressedTriangle(uint32_t* pBlock, int pSlot, const glm::vec3 pCorners[3]) {
+	float header[COMPRESSED_HEADER_WORDS];
+	std::memcpy(header, pBlock, sizeof(header));
+
+	uint32_t steps[10] = {};
+	for (int i = 0; i < 9; i++) {
+		steps[i] = quantizeCoordinate(pCorners[i / 3][i % 3], header[i % 3], header[3 + i % 3]);
+	}
+	uint32_t* words = pBlock + COMPRESSED_HEADER_WORDS + pSlot * COMPRESSED_TRIANGLE_WORDS;
+	for (int i = 0; i < COMPRESSED_TRIANGLE_WORDS; i++) {
+		words[i] = steps[2 * i] | steps[2 * i + 1] << 16;
+	}
+}
+
+inline void readCompressedTriangle(const uint32_t* pBlock, int pSlot, glm::vec3 pCorners[3]) {
+	float header[COMPRESSED_HEADER_WORDS];
+	std::memcpy(header, pBlock, sizeof(header));
+
+	const uint32_t* words = pBlock + COMPRESSED_HEADER_WORDS + pSlot * COMPRESSED_TRIANGLE_WORDS;
+	for (int i = 0; i < 9; i++) {
+		uint32_t steps = (words[i / 2] >> (16 * (i % 2))) & 0xFFFF;
+		pCorners[i / 3][i % 3] = dequantizeCoordinate(steps, header[i % 3], header[3 + i % 3]);
+	}
+}
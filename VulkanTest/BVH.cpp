@@ -0,0 +1,497 @@
+#include "BVH.h"
+#include "BoundsSIMD.h"
+#include "ThreadPool.h"
+#include <chrono>
+#include <algorithm>
+
+// Bins per axis fillBins accumulates without a heap allocation
+static const int MAX_STACK_BINS = 32;
+
+int BVH::numChunks(int pCount) {
+	return (pCount + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+}
+
+void BVH::build(std::vector<Triangle>& pTriangles) {
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	ThreadPool threadPool(settings.numThreads);
+	beginBuild(threadPool);
+
+	BoundingBox bounds;
+	BoundingBox centroidBounds;
+	createRefs(pTriangles, bounds, centroidBounds);
+	buildHierarchy(&pTriangles, bounds, centroidBounds);
+	reorderTriangles(pTriangles);
+	endBuild();
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	stats.buildTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+	stats.sahCost = computeSAHCost();
+	stats.numThreads = threadPool.size();
+}
+
+void BVH::build(const std::vector<BoundingBox>& pBounds, std::vector<int>& pOrder) {
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	ThreadPool threadPool(settings.numThreads);
+	beginBuild(threadPool);
+
+	BoundingBox bounds;
+	BoundingBox centroidBounds;
+	refs.resize(pBounds.size());
+	trackMemory(refs.capacity() * sizeof(PrimitiveRef));
+	for (int i = 0; i < (int)pBounds.size(); i++) {
+		refs[i] = PrimitiveRef{ pBounds[i].boundsMin, i, pBounds[i].boundsMax, (pBounds[i].boundsMin + pBounds[i].boundsMax) * 0.5f };
+		bounds.growToInclude(pBounds[i]);
+		centroidBounds.growToInclude(refs[i].centroid);
+	}
+
+	// Leaves index the boxes in the order given back in pOrder
+	buildHierarchy(nullptr, bounds, centroidBounds);
+	pOrder.resize(refs.size());
+	for (int i = 0; i < (int)refs.size(); i++) {
+		pOrder[i] = refs[i].index;
+	}
+	endBuild();
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	stats.buildTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+	stats.sahCost = computeSAHCost();
+	stats.numThreads = threadPool.size();
+}
+
+void BVH::beginBuild(ThreadPool& pPool) {
+	this->pool = &pPool;
+
+	memoryBytes = 0;
+	stats.peakMemoryBytes = 0;
+	stats.duplicatedReferences = 0;
+	stats.treeletTimeMs = 0.0;
+
+	editParents.clear();
+	freePairs.clear();
+	freeTriangleRanges.clear();
+	lazy.reset();
+	lazySubtreeSize = 0;
+}
+
+void BVH::buildHierarchy(const std::vector<Triangle>* pTriangles, const BoundingBox& pBounds, const BoundingBox& pCentroidBounds) {
+	// Spatial splits clip triangles, so boxes fall back to the binned builder
+	if (settings.builder == BVHBuilderType::SpatialSAH && pTriangles) {
+		buildSpatial(*pTriangles, pBounds, pCentroidBounds);
+	}
+	else if (settings.builder == BVHBuilderType::Linear) {
+		buildLinear(pCentroidBounds);
+	}
+	else {
+		buildBinned(pBounds, pCentroidBounds);
+	}
+
+	if (settings.treeletLeaves > 0) {
+		optimizeTreelets();
+	}
+}
+
+void BVH::endBuild() {
+	trackMemory(-(long long)(refs.capacity() * sizeof(PrimitiveRef)));
+	refs.clear();
+	refs.shrink_to_fit();
+	this->pool = nullptr;
+
+	if (settings.layout != BVHNodeLayout::BuildOrder) {
+		reorderNodes(settings.layout);
+	}
+	collapse();
+}
+
+void BVH::buildBinned(const BoundingBox& pBounds, const BoundingBox& pCentroidBounds) {
+	int triangleCount = (int)refs.size();
+	createNodeArena(std::max(1, 2 * triangleCount - 1));
+
+	scratch.resize(refs.size());
+	trackMemory(scratch.capacity() * sizeof(PrimitiveRef));
+
+	nodes[0] = Node{ pBounds, 0, triangleCount, 0 };
+	split(0, pCentroidBounds, 0, 1);
+	compactNodes();
+
+	trackMemory(-(long long)(scratch.capacity() * sizeof(PrimitiveRef)));
+	scratch.clear();
+	scratch.shrink_to_fit();
+}
+
+void BVH::createRefs(const std::vector<Triangle>& pTriangles, BoundingBox& pBounds, BoundingBox& pCentroidBounds) {
+	int triangleCount = (int)pTriangles.size();
+	refs.resize(pTriangles.size());
+	trackMemory(refs.capacity() * sizeof(PrimitiveRef));
+
+	int chunks = numChunks(triangleCount);
+	std::vector<SIMDBox> chunkBounds(chunks), chunkCentroidBounds(chunks);
+
+	pool->parallelFor(chunks, [&](int pChunk) {
+		int first = pChunk * PARALLEL_CHUNK_SIZE;
+		int end = std::min(first + PARALLEL_CHUNK_SIZE, triangleCount);
+
+		for (int i = first; i < end; i++) {
+			const Triangle& tri = pTriangles[i];
+			SIMDVector centroid = triangleCentroidSIMD(tri);
+			refs[i] = PrimitiveRef{ glm::vec3(tri.min), i, glm::vec3(tri.max), storeVector3(centroid) };
+			chunkBounds[pChunk].growToInclude(loadVector4(tri.min), loadVector4(tri.max));
+			chunkCentroidBounds[pChunk].growToInclude(centroid);
+		}
+	});
+
+	for (int chunk = 0; chunk < chunks; chunk++) {
+		pBounds.growToInclude(chunkBounds[chunk].toBoundingBox());
+		pCentroidBounds.growToInclude(chunkCentroidBounds[chunk].toBoundingBox());
+	}
+}
+
+void BVH::reorderTriangles(std::vector<Triangle>& pTriangles) {
+	// The only pass over the full triangle records: gather them into leaf order
+	std::vector<Triangle> ordered(refs.size());
+	trackMemory(ordered.capacity() * sizeof(Triangle));
+
+	pool->parallelFor(numChunks((int)refs.size()), [&](int pChunk) {
+		int first = pChunk * PARALLEL_CHUNK_SIZE;
+		int end = std::min(first + PARALLEL_CHUNK_SIZE, (int)refs.size());
+		for (int i = first; i < end; i++) {
+			ordered[i] = pTriangles[refs[i].index];
+		}
+	});
+
+	// The caller's array is released when the old contents leave with ordered
+	trackMemory(-(long long)(pTriangles.capacity() * sizeof(Triangle)));
+	pTriangles.swap(ordered);
+}
+
+void BVH::split(int pNodeIndex, const BoundingBox& pCentroidBounds, int pDepth, int pChildrenIndex) {
+	Node* parent = &nodes[pNodeIndex];
+	if (pDepth == settings.maxDepth || parent->triangleCount <= 1) return;
+
+	// Lazy builds keep the reserved children index of the subtrees left for
+	// later, their slots still unused
+	if (parent->triangleCount <= lazySubtreeSize) {
+		parent->childIndex = pChildrenIndex;
+		return;
+	}
+
+	Split best = chooseSplit(&refs[parent->triangleIndex], parent->triangleCount, pCentroidBounds);
+	if (best.axis < 0 || !shouldSplit(parent->bounds, parent->triangleCount, best.cost))
+		return;
+
+	PartitionResult result = partition(parent, pCentroidBounds, best);
+	int countB = parent->triangleCount - result.countA;
+
+	parent->childIndex = pChildrenIndex;
+	nodes[pChildrenIndex] = Node{ result.boundsA, parent->triangleIndex, result.countA, 0 };
+	nodes[pChildrenIndex + 1] = Node{ result.boundsB, parent->triangleIndex + result.countA, countB, 0 };
+
+	// Child A's subtree takes the next 2 * countA - 2 slots, child B's follow
+	int childrenIndexA = pChildrenIndex + 2;
+	int childrenIndexB = pChildrenIndex + 2 * result.countA;
+
+	if (std::min(result.countA, countB) >= PARALLEL_SUBTREE_SIZE && pool->size() > 1) {
+		TaskGroup group;
+		pool->run(group, [&]() { split(pChildrenIndex, result.centroidBoundsA, pDepth + 1, childrenIndexA); });
+		split(pChildrenIndex + 1, result.centroidBoundsB, pDepth + 1, childrenIndexB);
+		pool->wait(group);
+	}
+	else {
+		split(pChildrenIndex, result.centroidBoundsA, pDepth + 1, childrenIndexA);
+		split(pChildrenIndex + 1, result.centroidBoundsB, pDepth + 1, childrenIndexB);
+	}
+}
+
+BVH::Split BVH::chooseSplit(const PrimitiveRef* pRefs, int pCount, const BoundingBox& pCentroidBounds) {
+	const int numBins = settings.numBins;
+	std::vector<Bin> bins(3 * numBins);
+
+	if (pCount < 2 * PARALLEL_CHUNK_SIZE) {
+		fillBins(pRefs, pCount, pCentroidBounds, bins.data());
+	}
+	else {
+		int chunks = numChunks(pCount);
+		std::vector<Bin> chunkBins(chunks * 3 * numBins);
+		pool->parallelFor(chunks, [&](int pChunk) {
+			int first = pChunk * PARALLEL_CHUNK_SIZE;
+			int count = std::min(PARALLEL_CHUNK_SIZE, pCount - first);
+			fillBins(pRefs + first, count, pCentroidBounds, &chunkBins[pChunk * 3 * numBins]);
+		});
+
+		for (int chunk = 0; chunk < chunks; chunk++) {
+			for (int i = 0; i < 3 * numBins; i++) {
+				bins[i].bounds.growToInclude(chunkBins[chunk * 3 * numBins + i].bounds);
+				bins[i].triangleCount += chunkBins[chunk * 3 * numBins + i].triangleCount;
+			}
+		}
+	}
+
+	// Candidate i splits after bin i, its left box is box i and its right box
+	// box candidates + i
+	Split best;
+	int candidates = numBins - 1;
+	BoxesSoA boxes;
+	boxes.resize(2 * candidates);
+	std::vector<int> counts(2 * candidates);
+
+	for (int axis = 0; axis < 3; axis++) {
+		if (pCentroidBounds.boundsMax[axis] <= pCentroidBounds.boundsMin[axis]) continue;
+		const Bin* axisBins = &bins[axis * numBins];
+
+		// Prefix and suffix sweeps: a split after bin i puts bins [0, i] on the
+		// left and the rest on the right. The costs of all boxes are then
+		// evaluated together.
+		SIMDBox left, right;
+		int leftCount = 0;
+		int rightCount = 0;
+		for (int i = 0; i < candidates; i++) {
+			left.growToInclude(loadVector3(axisBins[i].bounds.boundsMin), loadVector3(axisBins[i].bounds.boundsMax));
+			leftCount += axisBins[i].triangleCount;
+			boxes.set(i, left);
+			counts[i] = leftCount;
+
+			const Bin& rightBin = axisBins[numBins - 1 - i];
+			right.growToInclude(loadVector3(rightBin.bounds.boundsMin), loadVector3(rightBin.bounds.boundsMax));
+			rightCount += rightBin.triangleCount;
+			boxes.set(2 * candidates - 1 - i, right);
+			counts[2 * candidates - 1 - i] = rightCount;
+		}
+		boxes.nodeCosts(counts.data(), 2 * candidates);
+
+		for (int i = 0; i < candidates; i++) {
+			if (counts[i] == 0 || counts[i] == pCount) continue;
+
+			float cost = boxes.cost(i) + boxes.cost(candidates + i);
+			if (cost < best.cost) {
+				best.cost = cost;
+				best.axis = axis;
+				best.bin = i;
+				best.boundsA = boxes.get(i);
+				best.boundsB = boxes.get(candidates + i);
+			}
+		}
+	}
+
+	return best;
+}
+
+void BVH::fillBins(const PrimitiveRef* pRefs, int pCount, const BoundingBox& pCentroidBounds, Bin* pBins) const {
+	const int numBins = settings.numBins;
+	SIMDBinMapping mapping(pCentroidBounds, numBins);
+
+	// Most ranges are small, so the boxes stay on the stack unless there are
+	// more bins than usual
+	SIMDBox stackBounds[3 * MAX_STACK_BINS];
+	std::vector<SIMDBox> heapBounds;
+	SIMDBox* binBounds = stackBounds;
+	if (numBins > MAX_STACK_BINS) {
+		heapBounds.resize(3 * numBins);
+		binBounds = heapBounds.data();
+	}
+
+	// One pass over the range fills the bins of all three axes
+	for (int i = 0; i < pCount; i++) {
+		SIMDVector boundsMin = refBoundsMin(pRefs[i]);
+		SIMDVector boundsMax = refBoundsMax(pRefs[i]);
+		int binIndices[3];
+		mapping.binIndices(refCentroid(pRefs[i]), binIndices);
+
+		for (int axis = 0; axis < 3; axis++) {
+			int bin = axis * numBins + binIndices[axis];
+			binBounds[bin].growToInclude(boundsMin, boundsMax);
+			pBins[bin].triangleCount++;
+		}
+	}
+
+	for (int bin = 0; bin < 3 * numBins; bin++) {
+		pBins[bin].bounds.growToInclude(binBounds[bin].toBoundingBox());
+	}
+}
+
+BVH::PartitionResult BVH::partition(const Node* pNode, const BoundingBox& pCentroidBounds, const Split& pSplit) {
+	int first = pNode->triangleIndex;
+	int end = pNode->triangleIndex + pNode->triangleCount;
+	PartitionResult result;
+
+	if (pNode->triangleCount < 2 * PARALLEL_CHUNK_SIZE) {
+		partitionRange(first, end, pCentroidBounds, pSplit, result);
+		return result;
+	}
+
+	// Stable partition through the scratch buffer: count per chunk, then
+	// scatter every chunk to its offset and copy the range back
+	int chunks = numChunks(pNode->triangleCount);
+	std::vector<PartitionResult> chunkResults(chunks);
+	std::vector<int> offsetsA(chunks), offsetsB(chunks);
+
+	pool->parallelFor(chunks, [&](int pChunk) {
+		int chunkFirst = first + pChunk * PARALLEL_CHUNK_SIZE;
+		int chunkEnd = std::min(chunkFirst + PARALLEL_CHUNK_SIZE, end);
+		PartitionResult& chunkResult = chunkResults[pChunk];
+		SIMDBox boundsA, boundsB, centroidBoundsA, centroidBoundsB;
+
+		for (int i = chunkFirst; i < chunkEnd; i++) {
+			const PrimitiveRef& ref = refs[i];
+			if (binIndex(pCentroidBounds, pSplit.axis, ref.centroid[pSplit.axis]) <= pSplit.bin) {
+				boundsA.growToInclude(refBoundsMin(ref), refBoundsMax(ref));
+				centroidBoundsA.growToInclude(refCentroid(ref));
+				chunkResult.countA++;
+			}
+			else {
+				boundsB.growToInclude(refBoundsMin(ref), refBoundsMax(ref));
+				centroidBoundsB.growToInclude(refCentroid(ref));
+			}
+		}
+
+		chunkResult.boundsA = boundsA.toBoundingBox();
+		chunkResult.boundsB = boundsB.toBoundingBox();
+		chunkResult.centroidBoundsA = centroidBoundsA.toBoundingBox();
+		chunkResult.centroidBoundsB = centroidBoundsB.toBoundingBox();
+	});
+
+	for (int chunk = 0; chunk < chunks; chunk++) {
+		offsetsA[chunk] = first + result.countA;
+		result.countA += chunkResults[chunk].countA;
+		result.boundsA.growToInclude(chunkResults[chunk].boundsA);
+		result.boundsB.growToInclude(chunkResults[chunk].boundsB);
+		result.centroidBoundsA.growToInclude(chunkResults[chunk].centroidBoundsA);
+		result.centroidBoundsB.growToInclude(chunkResults[chunk].centroidBoundsB);
+	}
+	for (int chunk = 0, countB = 0; chunk < chunks; chunk++) {
+		offsetsB[chunk] = first + result.countA + countB;
+		countB += std::min(PARALLEL_CHUNK_SIZE, end - first - chunk * PARALLEL_CHUNK_SIZE) - chunkResults[chunk].countA;
+	}
+
+	pool->parallelFor(chunks, [&](int pChunk) {
+		int chunkFirst = first + pChunk * PARALLEL_CHUNK_SIZE;
+		int chunkEnd = std::min(chunkFirst + PARALLEL_CHUNK_SIZE, end);
+		int indexA = offsetsA[pChunk];
+		int indexB = offsetsB[pChunk];
+
+		for (int i = chunkFirst; i < chunkEnd; i++) {
+			bool inA = binIndex(pCentroidBounds, pSplit.axis, refs[i].centroid[pSplit.axis]) <= pSplit.bin;
+			scratch[inA ? indexA++ : indexB++] = refs[i];
+		}
+	});
+
+	pool->parallelFor(chunks, [&](int pChunk) {
+		int chunkFirst = first + pChunk * PARALLEL_CHUNK_SIZE;
+		int chunkEnd = std::min(chunkFirst + PARALLEL_CHUNK_SIZE, end);
+		std::copy(scratch.begin() + chunkFirst, scratch.begin() + chunkEnd, refs.begin() + chunkFirst);
+	});
+
+	return result;
+}
+
+void BVH::partitionRange(int pFirst, int pEnd, const BoundingBox& pCentroidBounds, const Split& pSplit, PartitionResult& pResult) {
+	SIMDBox boundsA, boundsB, centroidBoundsA, centroidBoundsB;
+
+	for (int i = pFirst; i < pEnd; i++) {
+		const PrimitiveRef& ref = refs[i];
+
+		if (binIndex(pCentroidBounds, pSplit.axis, ref.centroid[pSplit.axis]) <= pSplit.bin) {
+			boundsA.growToInclude(refBoundsMin(ref), refBoundsMax(ref));
+			centroidBoundsA.growToInclude(refCentroid(ref));
+			std::swap(refs[i], refs[pFirst + pResult.countA]);
+			pResult.countA++;
+		}
+		else {
+			boundsB.growToInclude(refBoundsMin(ref), refBoundsMax(ref));
+			centroidBoundsB.growToInclude(refCentroid(ref));
+		}
+	}
+
+	pResult.boundsA.growToInclude(boundsA.toBoundingBox());
+	pResult.boundsB.growToInclude(boundsB.toBoundingBox());
+	pResult.centroidBoundsA.growToInclude(centroidBoundsA.toBoundingBox());
+	pResult.centroidBoundsB.growToInclude(centroidBoundsB.toBoundingBox());
+}
+
+void BVH::collectLevels(std::vector<std::vector<int>>& pLevels) const {
+	pLevels.assign(1, std::vector<int>(1, 0));
+	for (int depth = 0; depth < (int)pLevels.size(); depth++) {
+		std::vector<int> nextLevel;
+		for (int nodeIndex : pLevels[depth]) {
+			if (nodes[nodeIndex].childIndex != 0) {
+				nextLevel.push_back(nodes[nodeIndex].childIndex);
+				nextLevel.push_back(nodes[nodeIndex].childIndex + 1);
+			}
+		}
+		if (!nextLevel.empty()) pLevels.push_back(std::move(nextLevel));
+	}
+}
+
+void BVH::createNodeArena(int pMaxNodes) {
+	// A subtree over n triangles never needs more than 2n - 1 nodes, so the
+	// arena is allocated once and every subtree gets a fixed slot range in it.
+	// Slots that are never used keep a triangle count of -1.
+	nodes.clear();
+	nodes.shrink_to_fit();
+	nodes.assign(pMaxNodes, Node{ {}, 0, -1, 0 });
+	trackMemory(nodes.capacity() * sizeof(Node));
+}
+
+void BVH::compactNodes() {
+	// Drop the slots reserved for subtrees that ended early in a leaf. Sibling
+	// pairs stay adjacent because both children are always allocated together,
+	// and a node never moves to a higher index, so this can run in place.
+	std::vector<int> remap(nodes.size(), -1);
+	trackMemory(remap.capacity() * sizeof(int));
+
+	int count = 0;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		if (nodes[i].triangleCount >= 0) {
+			remap[i] = count;
+			nodes[count++] = nodes[i];
+		}
+	}
+	nodes.resize(count);
+
+	for (Node& node : nodes) {
+		if (node.childIndex != 0) {
+			node.childIndex = remap[node.childIndex];
+		}
+	}
+
+	trackMemory(-(long long)(remap.capacity() * sizeof(int)));
+}
+
+void BVH::trackMemory(long long pBytes) {
+	memoryBytes += pBytes;
+	stats.peakMemoryBytes = std::max(stats.peakMemoryBytes, memoryBytes);
+}
+
+int BVH::binIndex(const BoundingBox& pCentroidBounds, int pAxis, float pCentroid) const {
+	float extent = pCentroidBounds.boundsMax[pAxis] - pCentroidBounds.boundsMin[pAxis];
+	if (extent <= 0.0f) return 0;
+
+	int index = (int)((pCentroid - pCentroidBounds.boundsMin[pAxis]) / extent * settings.numBins);
+	return std::clamp(index, 0, settings.numBins - 1);
+}
+
+float BVH::nodeCost(const BoundingBox& pBounds, int pNumTriangles) const {
+	return pBounds.halfArea() * pNumTriangles;
+}
+
+// pSplitCost is the summed nodeCost of the children, the visit of the node
+// itself costs settings.traversalCost per triangle test
+bool BVH::shouldSplit(const BoundingBox& pBounds, int pNumTriangles, float pSplitCost) const {
+	if (pSplitCost == std::numeric_limits<float>::max()) return false;
+	if (settings.maxLeafSize > 0 && pNumTriangles > settings.maxLeafSize) return true;
+	return pSplitCost + settings.traversalCost * pBounds.halfArea() < nodeCost(pBounds, pNumTriangles);
+}
+
+float BVH::computeSAHCost(float pTraversalCost) const {
+	if (nodes.empty()) return 0.0f;
+
+	// Expected cost of a random ray in triangle tests, a node visit costing
+	// pTraversalCost of them
+	float rootArea = std::max(nodes[0].bounds.halfArea(), std::numeric_limits<float>::min());
+	float cost = 0.0f;
+	for (const Node& node : nodes) {
+		float area = node.bounds.halfArea() / rootArea;
+		cost += node.childIndex == 0 ? area * node.triangleCount : area * pTraversalCost;
+	}
+	return cost;
+}
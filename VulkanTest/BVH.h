@@ -0,0 +1,297 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <memory>
+#include <limits>
+#include "Shapes.h"
+#include "BoundingBox.h"
+#include "Node.h"
+
+class ThreadPool;
+
+const int MAX_DEPTH = 32;
+
+enum class BVHBuilderType {
+	BinnedSAH,
+	SpatialSAH,
+	Linear
+};
+
+// Order of the binary nodes in memory. Siblings always stay adjacent, the
+// layouts differ in where each sibling pair goes.
+enum class BVHNodeLayout {
+	BuildOrder,      // as the builder emitted them
+	DepthFirst,      // the children of the first child right after their parent's pair
+	BreadthFirstTop, // the top levels breadth-first, the subtrees below depth-first
+	VanEmdeBoas,     // cache-oblivious recursive split of the tree by height
+	Treelet          // blocks filled with the subtree nodes most likely to be visited
+};
+
+// What the builder moves around instead of the full Triangle record
+struct PrimitiveRef {
+	glm::vec3 boundsMin;
+	int index;
+	glm::vec3 boundsMax;
+	glm::vec3 centroid;
+};
+
+struct BVHSettings {
+	BVHBuilderType builder = BVHBuilderType::BinnedSAH;
+	int numBins = 16;
+	int maxDepth = MAX_DEPTH;
+	int numThreads = 1; // 0 uses every hardware thread
+
+	// Cost of a node visit relative to a triangle test, added per split, and
+	// the largest leaf the builder keeps when a split is possible (0 for no
+	// limit). See BVHCalibration.h for measured values.
+	float traversalCost = 0.0f;
+	int maxLeafSize = 0;
+
+	// Spatial splits may add at most this fraction of the triangle count as
+	// duplicated references, and are only tried where the children of the
+	// best object split overlap by more than this fraction of the root area
+	float spatialSplitBudget = 0.3f;
+	float spatialSplitOverlap = 1e-5f;
+
+	// Morton code length of the linear builder, 30 or 63 bits
+	int mortonBits = 30;
+
+	// Leaves per treelet of the optimization pass run after the build, up to 8.
+	// 0 skips the pass.
+	int treeletLeaves = 0;
+	int treeletIterations = 1;
+
+	// Children per node of the collapsed tree in wideNodes, 4 or 8. 2 keeps
+	// the binary tree only.
+	int width = 2;
+
+	// Also encode the collapsed tree in quantizedNodes, with child bounds
+	// stored as 8 bit offsets from the parent box
+	bool quantized = false;
+
+	// With a width of 2, also export the binary tree in wideNodes, every node
+	// holding the boxes of both children so one fetch decides the traversal order
+	bool childBounds = false;
+
+	// needsRebuild() reports true once refits have grown the SAH cost by
+	// more than this factor over the cost of the last build
+	float rebuildThreshold = 1.5f;
+
+	// Node order applied after the build, see BVHNodeLayout
+	BVHNodeLayout layout = BVHNodeLayout::BuildOrder;
+
+	// buildLazy leaves the subtrees of at most this many triangles unbuilt
+	// until a ray reaches them. Lazy builds always use the binned SAH builder.
+	int lazySubtreeSize = 4096;
+};
+
+struct BVHBuildStats {
+	double buildTimeMs = 0.0;
+	float sahCost = 0.0f;
+	int numThreads = 1;
+	size_t peakMemoryBytes = 0;
+	int duplicatedReferences = 0;
+	double treeletTimeMs = 0.0;
+	float unoptimizedSahCost = 0.0f;
+	int wideDepth = 0;
+	double refitTimeMs = 0.0;
+	float refitSahCost = 0.0f;
+	double editTimeMs = 0.0;
+	int lazySubtrees = 0;
+	int lazyExpandedSubtrees = 0;
+	int lazyRays = 0;
+	int lazyRayHits = 0;
+	double lazyRayTimeMs = 0.0;
+	double lazyCompleteTimeMs = 0.0;
+};
+
+// Quality of a built tree, see BVH::computeQualityStats
+struct BVHQualityStats {
+	float sahCost = 0.0f;
+	int nodeCount = 0;
+	int leafCount = 0;
+	int maxLeafDepth = 0;
+	std::vector<int> leafDepthHistogram; // leaves per depth
+	std::vector<int> leafSizeHistogram; // leaves per triangle count
+
+	// Effective parallel overlap: SAH weighted area of the triangles outside
+	// of a node's subtree that still lie inside its box, over the scene area
+	float epo = 0.0f;
+	// Area of the overlap of sibling boxes over the root area, summed over the
+	// inner nodes, and the mean overlap relative to the parent area
+	float childOverlap = 0.0f;
+	float meanRelativeOverlap = 0.0f;
+
+	size_t nodeBytes = 0;
+	size_t wideNodeBytes = 0;
+	size_t quantizedNodeBytes = 0;
+
+	// Sampled CPU ray cast through the binary tree, as the shader walks it,
+	// and through the wide tree when there is one
+	int sampledRays = 0;
+	float nodesPerRay = 0.0f;
+	float trianglesPerRay = 0.0f;
+	float wideNodesPerRay = 0.0f;
+	float wideTrianglesPerRay = 0.0f;
+	double rayCastTimeMs = 0.0;
+	double wideRayCastTimeMs = 0.0;
+};
+
+struct BVHRange {
+	int first = 0;
+	int count = 0;
+};
+
+class BVH {
+public:
+	BVHSettings settings;
+	BVHBuildStats stats;
+	std::vector<Node> nodes;
+	std::vector<WideChild> wideNodes;
+	std::vector<uint32_t> quantizedNodes;
+
+	// Entries of nodes and wide nodes (not child slots) whose bounds changed
+	// in the last refit
+	std::vector<BVHRange> refitNodes;
+	std::vector<BVHRange> refitWideNodes;
+
+	// Entries of nodes and of the triangles changed by the last insert or remove
+	std::vector<BVHRange> editedNodes;
+	std::vector<BVHRange> editedTriangles;
+
+	void build(std::vector<Triangle>& pTriangles);
+	void build(const std::vector<BoundingBox>& pBounds, std::vector<int>& pOrder);
+	void buildLazy(std::vector<Triangle>& pTriangles);
+	bool intersectLazy(const std::vector<Triangle>& pTriangles, const glm::vec3& pOrigin, const glm::vec3& pDir, float& pDst, int& pTriangleIndex);
+	int pendingSubtrees() const;
+	void castLazyRays(const std::vector<Triangle>& pTriangles, int pRayCount);
+	void completeLazy(std::vector<Triangle>& pTriangles);
+	void refit(const std::vector<Triangle>& pTriangles);
+	bool needsRebuild() const;
+	void getRefitOrder(std::vector<int>& pOrder, std::vector<int>& pLevelOffsets) const;
+	BVHRange insertTriangles(std::vector<Triangle>& pTriangles, const std::vector<Triangle>& pNewTriangles, int pMaxNodes = std::numeric_limits<int>::max(), int pMaxTriangles = std::numeric_limits<int>::max());
+	void removeTriangles(const BVHRange& pRange);
+	void collapse();
+	void reorderNodes(BVHNodeLayout pLayout);
+	void compactNodes();
+	float computeSAHCost(float pTraversalCost = 1.0f) const;
+	BVHQualityStats computeQualityStats(const std::vector<Triangle>& pTriangles, int pSampleRays) const;
+	void castSampleRays(const std::vector<Triangle>& pTriangles, int pSampleRays, BVHQualityStats& pQuality) const;
+	int wideWidth() const;
+	int wideStackSize() const;
+
+private:
+	// Nodes at least this large are binned and partitioned in fixed-size chunks,
+	// and subtrees at least this large are handed to the thread pool. Both only
+	// depend on the node size, so the tree comes out the same for any thread count.
+	static constexpr int PARALLEL_CHUNK_SIZE = 16384;
+	static constexpr int PARALLEL_SUBTREE_SIZE = 4096;
+
+	struct Bin {
+		BoundingBox bounds;
+		int triangleCount = 0;
+	};
+
+	struct Split {
+		int axis = -1;
+		int bin = 0;
+		float cost = std::numeric_limits<float>::max();
+		BoundingBox boundsA, boundsB;
+	};
+
+	struct SpatialBin {
+		BoundingBox bounds;
+		int entries = 0;
+		int exits = 0;
+	};
+
+	struct SpatialSplit {
+		int axis = -1;
+		float position = 0.0f;
+		float cost = std::numeric_limits<float>::max();
+	};
+
+	struct PartitionResult {
+		BoundingBox boundsA, boundsB;
+		BoundingBox centroidBoundsA, centroidBoundsB;
+		int countA = 0;
+	};
+
+	std::vector<PrimitiveRef> refs;
+	std::vector<PrimitiveRef> scratch;
+	ThreadPool* pool = nullptr;
+	size_t memoryBytes = 0;
+	std::vector<int> wideLevelOffsets;
+
+	// Incremental edit state, set up by the first edit after a build: the
+	// parent and height of every slot, the leaf of every triangle and the
+	// slots freed by removals
+	std::vector<int> editParents;
+	std::vector<int> editHeights;
+	std::vector<int> editLeaves;
+	std::vector<int> freePairs;
+	std::vector<BVHRange> freeTriangleRanges;
+	std::vector<int> changedNodes;
+
+	// Lazy build state, shared by the threads casting rays until completeLazy.
+	// Subtrees up to lazySubtreeSize stop the eager split.
+	struct LazyState;
+	std::shared_ptr<LazyState> lazy;
+	int lazySubtreeSize = 0;
+
+	const std::vector<Triangle>* spatialTriangles = nullptr;
+	std::vector<PrimitiveRef> spatialOutput;
+	int maxSpatialRefs = 0;
+	int spatialRefCount = 0;
+	float spatialRootArea = 0.0f;
+
+	void beginBuild(ThreadPool& pPool);
+	void buildHierarchy(const std::vector<Triangle>* pTriangles, const BoundingBox& pBounds, const BoundingBox& pCentroidBounds);
+	void endBuild();
+
+	void buildBinned(const BoundingBox& pBounds, const BoundingBox& pCentroidBounds);
+	void split(int pNodeIndex, const BoundingBox& pCentroidBounds, int pDepth, int pChildrenIndex);
+	Split chooseSplit(const PrimitiveRef* pRefs, int pCount, const BoundingBox& pCentroidBounds);
+	void fillBins(const PrimitiveRef* pRefs, int pCount, const BoundingBox& pCentroidBounds, Bin* pBins) const;
+	PartitionResult partition(const Node* pNode, const BoundingBox& pCentroidBounds, const Split& pSplit);
+	void partitionRange(int pFirst, int pEnd, const BoundingBox& pCentroidBounds, const Split& pSplit, PartitionResult& pResult);
+	void buildSpatial(const std::vector<Triangle>& pTriangles, const BoundingBox& pBounds, const BoundingBox& pCentroidBounds);
+	void splitSpatial(int pNodeIndex, std::vector<PrimitiveRef>& pRefs, const BoundingBox& pCentroidBounds, int pDepth);
+	SpatialSplit chooseSpatialSplit(const std::vector<PrimitiveRef>& pRefs, const BoundingBox& pBounds);
+	void partitionSpatial(std::vector<PrimitiveRef>& pRefs, const SpatialSplit& pSplit, std::vector<PrimitiveRef>& pRefsA, std::vector<PrimitiveRef>& pRefsB, PartitionResult& pResult);
+	BoundingBox clipReference(const PrimitiveRef& pRef, int pAxis, float pMin, float pMax) const;
+
+	void expandLazy(int pNodeIndex, int pState);
+
+	void buildLinear(const BoundingBox& pCentroidBounds);
+	void sortMortonCodes(std::vector<uint64_t>& pCodes, std::vector<uint32_t>& pOrder);
+	BoundingBox emitLinear(int pNodeIndex, const std::vector<uint64_t>& pCodes, int pFirst, int pCount, int pDepth, int pChildrenIndex);
+
+	void optimizeTreelets();
+	void optimizeTreelet(int pRoot, int pDepth, std::vector<float>& pCosts, std::vector<int>& pHeights);
+
+	void quantize();
+	void refitWide(const std::vector<Triangle>& pTriangles);
+	static void mergeRanges(std::vector<int>& pChanged, std::vector<BVHRange>& pRanges);
+
+	void prepareEdits(int pTriangleCount);
+	int allocatePair();
+	int allocateTriangles(std::vector<Triangle>& pTriangles, int pCount);
+	void setNode(int pSlot, const Node& pNode, int pHeight);
+	void updateInnerNode(int pSlot);
+	int findSibling(const BoundingBox& pBounds, int pHeight) const;
+	void insertSubtree(const Node& pNode, int pHeight);
+	void removeLeaf(int pSlot);
+	void updateAncestors(int pSlot);
+	void rotate(int pSlot, int pDepth);
+
+	void createRefs(const std::vector<Triangle>& pTriangles, BoundingBox& pBounds, BoundingBox& pCentroidBounds);
+	void reorderTriangles(std::vector<Triangle>& pTriangles);
+	void collectLevels(std::vector<std::vector<int>>& pLevels) const;
+	void createNodeArena(int pMaxNodes);
+	void trackMemory(long long pBytes);
+	static int numChunks(int pCount);
+	int binIndex(const BoundingBox& pCentroidBounds, int pAxis, float pCentroid) const;
+	float nodeCost(const BoundingBox& pBounds, int pNumTriangles) const;
+	bool shouldSplit(const BoundingBox& pBounds, int pNumTriangles, float pSplitCost) const;
+};
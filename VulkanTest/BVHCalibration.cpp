@@ -0,0 +1,200 @@
+#include "BVHCalibration.h"
+#include "RayTests.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+// Calibration of the SAH constants. The tests run over arrays of scattered
+// primitives, most of them missing, as in a traversal past the top levels.
+
+static const int CALIBRATION_PRIMITIVES = 4096;
+static const int CALIBRATION_RAYS = 256;
+static const int CALIBRATION_ROUNDS = 3;
+static const float CALIBRATION_TRIANGLE_SIZE = 0.05f;
+static const int LEAF_SIZE_CANDIDATES[] = { 1, 2, 4, 8, 16, 0 };
+
+void measureCPUCosts(BVHCostProfile& pProfile) {
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	auto randomPoint = [&]() { return glm::vec3(unit(rng), unit(rng), unit(rng)); };
+
+	std::vector<Triangle> triangles(CALIBRATION_PRIMITIVES);
+	std::vector<WoopTriangle> woopTriangles(CALIBRATION_PRIMITIVES);
+	std::vector<Node> nodes(CALIBRATION_PRIMITIVES);
+	for (int i = 0; i < CALIBRATION_PRIMITIVES; i++) {
+		glm::vec3 center = randomPoint();
+		Triangle& tri = triangles[i];
+		tri.posA = glm::vec4(center + CALIBRATION_TRIANGLE_SIZE * (randomPoint() - 0.5f), 0.0f);
+		tri.posB = glm::vec4(center + CALIBRATION_TRIANGLE_SIZE * (randomPoint() - 0.5f), 0.0f);
+		tri.posC = glm::vec4(center + CALIBRATION_TRIANGLE_SIZE * (randomPoint() - 0.5f), 0.0f);
+		woopTriangles[i] = WoopTriangle::fromPositions(tri.posA, tri.posB, tri.posC);
+
+		nodes[i] = Node{ {}, i, 1, 0 };
+		nodes[i].bounds.growToInclude(&tri);
+	}
+
+	std::vector<glm::vec3> origins(CALIBRATION_RAYS), dirs(CALIBRATION_RAYS);
+	for (int ray = 0; ray < CALIBRATION_RAYS; ray++) {
+		origins[ray] = randomPoint();
+		dirs[ray] = glm::normalize(randomPoint() - 0.5f);
+	}
+
+	// The hit counts go to a volatile so the tests can not be dropped, and
+	// the fastest round is kept to leave out warm up and interruptions
+	volatile int sink = 0;
+	double tests = (double)CALIBRATION_RAYS * CALIBRATION_PRIMITIVES;
+	double boxTimeMs = std::numeric_limits<double>::max();
+	double triangleTimeMs = std::numeric_limits<double>::max();
+	double woopTimeMs = std::numeric_limits<double>::max();
+
+	for (int round = 0; round < CALIBRATION_ROUNDS; round++) {
+		auto startTime = std::chrono::high_resolution_clock::now();
+		int hits = 0;
+		for (int ray = 0; ray < CALIBRATION_RAYS; ray++) {
+			glm::vec3 invDir = 1.0f / dirs[ray];
+			for (const Node& node : nodes) {
+				if (rayBoxDst(origins[ray], invDir, node.bounds.boundsMin, node.bounds.boundsMax) < std::numeric_limits<float>::infinity()) hits++;
+			}
+		}
+		sink = sink + hits;
+		auto boxEndTime = std::chrono::high_resolution_clock::now();
+
+		hits = 0;
+		for (int ray = 0; ray < CALIBRATION_RAYS; ray++) {
+			for (const Triangle& tri : triangles) {
+				float dst;
+				if (rayTriangleDst(origins[ray], dirs[ray], tri, dst)) hits++;
+			}
+		}
+		sink = sink + hits;
+		auto triangleEndTime = std::chrono::high_resolution_clock::now();
+
+		hits = 0;
+		for (int ray = 0; ray < CALIBRATION_RAYS; ray++) {
+			for (const WoopTriangle& tri : woopTriangles) {
+				float dst;
+				if (rayWoopTriangleDst(origins[ray], dirs[ray], tri, dst)) hits++;
+			}
+		}
+		sink = sink + hits;
+		auto woopEndTime = std::chrono::high_resolution_clock::now();
+
+		boxTimeMs = std::min(boxTimeMs, std::chrono::duration<double, std::milli>(boxEndTime - startTime).count());
+		triangleTimeMs = std::min(triangleTimeMs, std::chrono::duration<double, std::milli>(triangleEndTime - boxEndTime).count());
+		woopTimeMs = std::min(woopTimeMs, std::chrono::duration<double, std::milli>(woopEndTime - triangleEndTime).count());
+	}
+
+	pProfile.boxTestNs = boxTimeMs * 1e6 / tests;
+	pProfile.triangleTestNs = triangleTimeMs * 1e6 / tests;
+	pProfile.woopTriangleTestNs = woopTimeMs * 1e6 / tests;
+	pProfile.traversalCost = traversalCostFromTimings(pProfile.boxTestNs, pProfile.triangleTestNs);
+}
+
+float traversalCostFromTimings(double pBoxTestNs, double pTriangleTestNs) {
+	if (pTriangleTestNs <= 0.0) return 0.0f;
+	return (float)(2.0 * pBoxTestNs / pTriangleTestNs);
+}
+
+int chooseMaxLeafSize(const std::vector<Triangle>& pTriangles, const BVHSettings& pSettings, float pTraversalCost) {
+	// Only the binary tree is compared, the later passes do not change its leaves
+	BVHSettings settings = pSettings;
+	settings.traversalCost = pTraversalCost;
+	settings.treeletLeaves = 0;
+	settings.width = 2;
+	settings.quantized = false;
+	settings.childBounds = false;
+	settings.layout = BVHNodeLayout::BuildOrder;
+
+	int bestLeafSize = 0;
+	float bestCost = std::numeric_limits<float>::max();
+	for (int leafSize : LEAF_SIZE_CANDIDATES) {
+		BVH candidate;
+		candidate.settings = settings;
+		candidate.settings.maxLeafSize = leafSize;
+
+		std::vector<Triangle> triangles = pTriangles;
+		candidate.build(triangles);
+		float cost = candidate.computeSAHCost(pTraversalCost);
+		if (cost < bestCost) {
+			bestCost = cost;
+			bestLeafSize = leafSize;
+		}
+	}
+	return bestLeafSize;
+}
+
+std::string cpuDeviceName() {
+	char brand[49] = {};
+#if defined(_MSC_VER)
+	int registers[4];
+	__cpuid(registers, 0x80000000);
+	if ((unsigned)registers[0] >= 0x80000004) {
+		for (int leaf = 0; leaf < 3; leaf++) {
+			__cpuid(registers, 0x80000002 + leaf);
+			std::memcpy(brand + 16 * leaf, registers, sizeof(registers));
+		}
+	}
+#elif defined(__x86_64__) || defined(__i386__)
+	unsigned int registers[4];
+	if (__get_cpuid_max(0x80000000, nullptr) >= 0x80000004) {
+		for (int leaf = 0; leaf < 3; leaf++) {
+			__get_cpuid(0x80000002 + leaf, &registers[0], &registers[1], &registers[2], &registers[3]);
+			std::memcpy(brand + 16 * leaf, registers, sizeof(registers));
+		}
+	}
+#endif
+	std::string name(brand);
+	name.erase(0, name.find_first_not_of(' '));
+	name.erase(name.find_last_not_of(' ') + 1);
+	return "CPU " + (name.empty() ? std::string("unknown") : name);
+}
+
+// Lines are the device name, a tab, then the measured and derived values
+bool loadCostProfile(const std::string& pPath, const std::string& pDevice, BVHCostProfile& pProfile) {
+	std::ifstream file(pPath);
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.compare(0, pDevice.size() + 1, pDevice + '\t') != 0) continue;
+
+		BVHCostProfile profile;
+		profile.device = pDevice;
+		std::istringstream values(line.substr(pDevice.size() + 1));
+		if (values >> profile.boxTestNs >> profile.triangleTestNs >> profile.traversalCost >> profile.maxLeafSize) {
+			pProfile = profile;
+			return true;
+		}
+	}
+	return false;
+}
+
+void saveCostProfile(const std::string& pPath, const BVHCostProfile& pProfile) {
+	// Keeps the profiles of the other devices
+	std::vector<std::string> lines;
+	std::ifstream input(pPath);
+	std::string line;
+	while (std::getline(input, line)) {
+		if (line.compare(0, pProfile.device.size() + 1, pProfile.device + '\t') != 0) lines.push_back(line);
+	}
+	input.close();
+
+	std::ostringstream profileLine;
+	profileLine << pProfile.device << '\t' << pProfile.boxTestNs << ' ' << pProfile.triangleTestNs << ' ' << pProfile.traversalCost << ' ' << pProfile.maxLeafSize;
+	lines.push_back(profileLine.str());
+
+	std::ofstream output(pPath, std::ios::trunc);
+	if (!output) {
+		throw std::runtime_error("failed to write BVH cost profile " + pPath + "!");
+	}
+	for (const std::string& profile : lines) {
+		output << profile << '\n';
+	}
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "BVH.h"
+
+// Measured costs of the traversal on one device, and the builder settings
+// derived from them
+struct BVHCostProfile {
+	std::string device;
+	double boxTestNs = 0.0;
+	double triangleTestNs = 0.0;
+	double woopTriangleTestNs = 0.0; // measured for comparison, not saved
+	float traversalCost = 0.0f;
+	int maxLeafSize = 0;
+};
+
+// Times the ray tests of RayTests.h on this CPU and fills the test costs,
+// the triangle test on the positions and on the Woop records
+void measureCPUCosts(BVHCostProfile& pProfile);
+
+// Node visit cost relative to a triangle test. A binary node visit tests the
+// boxes of both children.
+float traversalCostFromTimings(double pBoxTestNs, double pTriangleTestNs);
+
+// Builds the scene with every candidate leaf size limit and returns the one
+// with the lowest SAH cost under pTraversalCost, 0 when no limit wins
+int chooseMaxLeafSize(const std::vector<Triangle>& pTriangles, const BVHSettings& pSettings, float pTraversalCost);
+
+std::string cpuDeviceName();
+
+// Profiles are kept one per line in a text file shared by all devices
+bool loadCostProfile(const std::string& pPath, const std::string& pDevice, BVHCostProfile& pProfile);
+void saveCostProfile(const std::string& pPath, const BVHCostProfile& pProfile);
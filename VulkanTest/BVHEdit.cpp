@@ -0,0 +1,353 @@
+#include "BVH.h"
+#include <chrono>
+#include <algorithm>
+#include <queue>
+#include <stdexcept>
+
+// Incremental edits of the binary tree. An inserted mesh gets a BVH of its
+// own, whose root is attached next to the node where it adds the least SAH
+// cost. Removing collapses every leaf of the mesh into its sibling. Both walk
+// up to the root once per changed node, refitting and applying tree rotations
+// on the way, so the work depends on the edit and the tree depth only.
+
+static const Node EMPTY_NODE = Node{ {}, 0, 0, 0 };
+
+static BoundingBox unionBounds(const BoundingBox& pA, const BoundingBox& pB) {
+	BoundingBox bounds = pA;
+	bounds.growToInclude(pB);
+	return bounds;
+}
+
+void BVH::prepareEdits(int pTriangleCount) {
+	if (lazy) {
+		throw std::runtime_error("a lazy BVH has to be completed before it is edited!");
+	}
+	if (editParents.size() == nodes.size() && (int)editLeaves.size() >= pTriangleCount) return;
+
+	editParents.assign(nodes.size(), -1);
+	editHeights.assign(nodes.size(), 0);
+	editLeaves.assign(pTriangleCount, -1);
+
+	std::vector<std::vector<int>> levels;
+	collectLevels(levels);
+	for (int depth = (int)levels.size() - 1; depth >= 0; depth--) {
+		for (int nodeIndex : levels[depth]) {
+			const Node& node = nodes[nodeIndex];
+			if (node.childIndex == 0) {
+				for (int i = node.triangleIndex; i < node.triangleIndex + node.triangleCount; i++) editLeaves[i] = nodeIndex;
+				continue;
+			}
+			editParents[node.childIndex] = nodeIndex;
+			editParents[node.childIndex + 1] = nodeIndex;
+			editHeights[nodeIndex] = 1 + std::max(editHeights[node.childIndex], editHeights[node.childIndex + 1]);
+		}
+	}
+}
+
+int BVH::allocatePair() {
+	if (!freePairs.empty()) {
+		int pair = freePairs.back();
+		freePairs.pop_back();
+		return pair;
+	}
+
+	int pair = (int)nodes.size();
+	nodes.resize(pair + 2, EMPTY_NODE);
+	editParents.resize(pair + 2, -1);
+	editHeights.resize(pair + 2, 0);
+	return pair;
+}
+
+int BVH::allocateTriangles(std::vector<Triangle>& pTriangles, int pCount) {
+	for (size_t i = 0; i < freeTriangleRanges.size(); i++) {
+		BVHRange& range = freeTriangleRanges[i];
+		if (range.count < pCount) continue;
+
+		int first = range.first;
+		range.first += pCount;
+		range.count -= pCount;
+		if (range.count == 0) freeTriangleRanges.erase(freeTriangleRanges.begin() + i);
+		return first;
+	}
+
+	int first = (int)pTriangles.size();
+	pTriangles.resize(first + pCount);
+	editLeaves.resize(first + pCount, -1);
+	return first;
+}
+
+// Writes a node into a slot, pointing its children or triangles back at it
+void BVH::setNode(int pSlot, const Node& pNode, int pHeight) {
+	nodes[pSlot] = pNode;
+	editHeights[pSlot] = pHeight;
+	if (pNode.childIndex != 0) {
+		editParents[pNode.childIndex] = pSlot;
+		editParents[pNode.childIndex + 1] = pSlot;
+	}
+	else {
+		for (int i = pNode.triangleIndex; i < pNode.triangleIndex + pNode.triangleCount; i++) editLeaves[i] = pSlot;
+	}
+	changedNodes.push_back(pSlot);
+}
+
+void BVH::updateInnerNode(int pSlot) {
+	Node& node = nodes[pSlot];
+	const Node& childA = nodes[node.childIndex];
+	const Node& childB = nodes[node.childIndex + 1];
+	node.bounds = unionBounds(childA.bounds, childB.bounds);
+	node.triangleIndex = std::min(childA.triangleIndex, childB.triangleIndex);
+	node.triangleCount = childA.triangleCount + childB.triangleCount;
+	editHeights[pSlot] = 1 + std::max(editHeights[node.childIndex], editHeights[node.childIndex + 1]);
+	changedNodes.push_back(pSlot);
+}
+
+// Branch and bound search for the node whose box grows the SAH cost of the
+// tree the least when the new subtree becomes its sibling. Nodes where the
+// result would be deeper than maxDepth are skipped.
+int BVH::findSibling(const BoundingBox& pBounds, int pHeight) const {
+	struct Candidate {
+		float inheritedCost;
+		int slot;
+		int depth;
+		bool operator<(const Candidate& pOther) const { return inheritedCost > pOther.inheritedCost; }
+	};
+
+	float newArea = pBounds.halfArea();
+	int best = -1;
+	float bestCost = std::numeric_limits<float>::max();
+
+	std::priority_queue<Candidate> candidates;
+	candidates.push(Candidate{ 0.0f, 0, 0 });
+	while (!candidates.empty()) {
+		Candidate candidate = candidates.top();
+		candidates.pop();
+		if (candidate.inheritedCost + newArea >= bestCost) break;
+
+		const Node& node = nodes[candidate.slot];
+		float directCost = unionBounds(node.bounds, pBounds).halfArea();
+		float cost = candidate.inheritedCost + directCost;
+		bool fits = candidate.depth + 1 + std::max(editHeights[candidate.slot], pHeight) <= settings.maxDepth;
+		if (fits && cost < bestCost) {
+			best = candidate.slot;
+			bestCost = cost;
+		}
+
+		// Below this node, its own box grows by the same amount for any sibling
+		float childInheritedCost = candidate.inheritedCost + directCost - node.bounds.halfArea();
+		if (node.childIndex != 0 && childInheritedCost + newArea < bestCost) {
+			candidates.push(Candidate{ childInheritedCost, node.childIndex, candidate.depth + 1 });
+			candidates.push(Candidate{ childInheritedCost, node.childIndex + 1, candidate.depth + 1 });
+		}
+	}
+
+	if (best < 0) {
+		throw std::runtime_error("inserted triangles do not fit in the BVH without exceeding its maximum depth!");
+	}
+	return best;
+}
+
+void BVH::insertSubtree(const Node& pNode, int pHeight) {
+	// An empty tree is replaced
+	if (nodes[0].childIndex == 0 && nodes[0].triangleCount == 0) {
+		setNode(0, pNode, pHeight);
+		return;
+	}
+
+	// The sibling moves into a new pair together with the subtree, and its slot
+	// becomes their parent
+	int sibling = findSibling(pNode.bounds, pHeight);
+	int pair = allocatePair();
+	setNode(pair, nodes[sibling], editHeights[sibling]);
+	setNode(pair + 1, pNode, pHeight);
+	setNode(sibling, Node{ {}, 0, 0, pair }, 0);
+	updateInnerNode(sibling);
+
+	updateAncestors(editParents[sibling]);
+}
+
+void BVH::removeLeaf(int pSlot) {
+	for (int i = nodes[pSlot].triangleIndex; i < nodes[pSlot].triangleIndex + nodes[pSlot].triangleCount; i++) editLeaves[i] = -1;
+
+	if (pSlot == 0) {
+		setNode(0, EMPTY_NODE, 0);
+		return;
+	}
+
+	// The sibling takes the place of the parent, freeing the pair
+	int parent = editParents[pSlot];
+	int pair = nodes[parent].childIndex;
+	int sibling = pSlot == pair ? pair + 1 : pair;
+	setNode(parent, nodes[sibling], editHeights[sibling]);
+
+	nodes[pair] = EMPTY_NODE;
+	nodes[pair + 1] = EMPTY_NODE;
+	editParents[pair] = editParents[pair + 1] = -1;
+	changedNodes.push_back(pair);
+	changedNodes.push_back(pair + 1);
+	freePairs.push_back(pair);
+
+	updateAncestors(editParents[parent]);
+}
+
+void BVH::updateAncestors(int pSlot) {
+	int depth = 0;
+	for (int slot = pSlot; slot > 0; slot = editParents[slot]) depth++;
+
+	for (int slot = pSlot; slot >= 0; slot = editParents[slot], depth--) {
+		rotate(slot, depth);
+		updateInnerNode(slot);
+	}
+}
+
+// Swaps a child of the node with one of the children of its other child when
+// that shrinks the box of the other child
+void BVH::rotate(int pSlot, int pDepth) {
+	int pair = nodes[pSlot].childIndex;
+	int bestMoved = -1;
+	int bestNephew = -1;
+	float bestGain = 0.0f;
+
+	for (int c = 0; c < 2; c++) {
+		int moved = pair + c;
+		int other = pair + 1 - c;
+		const Node& otherNode = nodes[other];
+		if (otherNode.childIndex == 0) continue;
+
+		// The moved child goes one level down
+		if (pDepth + 2 + editHeights[moved] > settings.maxDepth) continue;
+
+		for (int n = 0; n < 2; n++) {
+			int nephew = otherNode.childIndex + n;
+			int kept = otherNode.childIndex + 1 - n;
+			float gain = otherNode.bounds.halfArea() - unionBounds(nodes[moved].bounds, nodes[kept].bounds).halfArea();
+			if (gain > bestGain) {
+				bestGain = gain;
+				bestMoved = moved;
+				bestNephew = nephew;
+			}
+		}
+	}
+
+	if (bestMoved < 0) return;
+
+	Node moved = nodes[bestMoved];
+	int movedHeight = editHeights[bestMoved];
+	int other = pair + (bestMoved == pair ? 1 : 0);
+	setNode(bestMoved, nodes[bestNephew], editHeights[bestNephew]);
+	setNode(bestNephew, moved, movedHeight);
+	updateInnerNode(other);
+}
+
+// Throws before changing anything when the tree would outgrow pMaxNodes nodes
+// or pMaxTriangles triangles
+BVHRange BVH::insertTriangles(std::vector<Triangle>& pTriangles, const std::vector<Triangle>& pNewTriangles, int pMaxNodes, int pMaxTriangles) {
+	if (!wideNodes.empty()) {
+		throw std::runtime_error("incremental BVH edits need the binary node layout!");
+	}
+
+	auto startTime = std::chrono::high_resolution_clock::now();
+	prepareEdits((int)pTriangles.size());
+	changedNodes.clear();
+
+	BVH meshBVH;
+	meshBVH.settings = settings;
+	meshBVH.settings.width = 2;
+	meshBVH.settings.quantized = false;
+	meshBVH.settings.childBounds = false;
+	meshBVH.settings.layout = BVHNodeLayout::BuildOrder;
+	std::vector<Triangle> meshTriangles = pNewTriangles;
+	meshBVH.build(meshTriangles);
+
+	// One pair per inner node of the mesh BVH, and one for the sibling its root
+	// is attached to
+	std::vector<std::vector<int>> levels;
+	meshBVH.collectLevels(levels);
+	int pairsNeeded = nodes[0].childIndex == 0 && nodes[0].triangleCount == 0 ? 0 : 1;
+	for (const std::vector<int>& level : levels) {
+		for (int nodeIndex : level) {
+			if (meshBVH.nodes[nodeIndex].childIndex != 0) pairsNeeded++;
+		}
+	}
+	int newNodes = 2 * std::max(0, pairsNeeded - (int)freePairs.size());
+	bool rangeFree = std::any_of(freeTriangleRanges.begin(), freeTriangleRanges.end(), [&](const BVHRange& pRange) { return pRange.count >= (int)meshTriangles.size(); });
+	int newTriangles = rangeFree ? 0 : (int)meshTriangles.size();
+	if ((int)nodes.size() + newNodes > pMaxNodes || (int)pTriangles.size() + newTriangles > pMaxTriangles) {
+		throw std::runtime_error("inserted triangles do not fit in the capacity left for the BVH!");
+	}
+
+	int first = allocateTriangles(pTriangles, (int)meshTriangles.size());
+	std::copy(meshTriangles.begin(), meshTriangles.end(), pTriangles.begin() + first);
+
+	// Every pair of the mesh BVH gets a free pair, children before parents so
+	// the heights are known when a parent is written
+	std::vector<int> slots(meshBVH.nodes.size(), -1);
+	std::vector<int> heights(meshBVH.nodes.size(), 0);
+	for (const std::vector<int>& level : levels) {
+		for (int nodeIndex : level) {
+			int childIndex = meshBVH.nodes[nodeIndex].childIndex;
+			if (childIndex == 0) continue;
+
+			int pair = allocatePair();
+			slots[childIndex] = pair;
+			slots[childIndex + 1] = pair + 1;
+		}
+	}
+
+	Node root;
+	for (int depth = (int)levels.size() - 1; depth >= 0; depth--) {
+		for (int nodeIndex : levels[depth]) {
+			Node node = meshBVH.nodes[nodeIndex];
+			node.triangleIndex += first;
+			if (node.childIndex != 0) {
+				heights[nodeIndex] = 1 + std::max(heights[node.childIndex], heights[node.childIndex + 1]);
+				node.childIndex = slots[node.childIndex];
+			}
+
+			if (nodeIndex == 0) {
+				root = node;
+			}
+			else {
+				setNode(slots[nodeIndex], node, heights[nodeIndex]);
+			}
+		}
+	}
+	insertSubtree(root, heights[0]);
+
+	mergeRanges(changedNodes, editedNodes);
+	editedTriangles = { BVHRange{ first, (int)meshTriangles.size() } };
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	stats.editTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+	return BVHRange{ first, (int)meshTriangles.size() };
+}
+
+// pRange is what insertTriangles returned. The triangles stay in place but no
+// leaf references them anymore, their slots are reused by later inserts.
+void BVH::removeTriangles(const BVHRange& pRange) {
+	auto startTime = std::chrono::high_resolution_clock::now();
+	changedNodes.clear();
+
+	for (int i = pRange.first; i < pRange.first + pRange.count; i++) {
+		if (editLeaves[i] >= 0) removeLeaf(editLeaves[i]);
+	}
+
+	// Adjacent free ranges are merged
+	freeTriangleRanges.push_back(pRange);
+	std::sort(freeTriangleRanges.begin(), freeTriangleRanges.end(), [](const BVHRange& pA, const BVHRange& pB) { return pA.first < pB.first; });
+	std::vector<BVHRange> merged;
+	for (const BVHRange& range : freeTriangleRanges) {
+		if (!merged.empty() && merged.back().first + merged.back().count == range.first) {
+			merged.back().count += range.count;
+		}
+		else {
+			merged.push_back(range);
+		}
+	}
+	freeTriangleRanges.swap(merged);
+
+	mergeRanges(changedNodes, editedNodes);
+	editedTriangles.clear();
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	stats.editTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+}
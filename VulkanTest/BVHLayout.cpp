@@ -0,0 +1,157 @@
+#include "BVH.h"
+#include <algorithm>
+#include <deque>
+#include <queue>
+
+// Every layout is a new order of the sibling pairs. The root stays at index 0,
+// and the children of the k-th inner node in the order go to 2k + 1 and 2k + 2.
+
+static const int LAYOUT_TOP_DEPTH = 6;
+static const int LAYOUT_BLOCK_BYTES = 4096;
+
+static void depthFirstOrder(const std::vector<Node>& pNodes, int pRoot, std::vector<int>& pOrder) {
+	std::vector<int> stack = { pRoot };
+	while (!stack.empty()) {
+		int nodeIndex = stack.back();
+		stack.pop_back();
+		const Node& node = pNodes[nodeIndex];
+		if (node.childIndex == 0) continue;
+
+		pOrder.push_back(nodeIndex);
+		stack.push_back(node.childIndex + 1);
+		stack.push_back(node.childIndex);
+	}
+}
+
+static void breadthFirstTopOrder(const std::vector<Node>& pNodes, std::vector<int>& pOrder) {
+	std::vector<int> level = { 0 };
+	for (int depth = 0; depth < LAYOUT_TOP_DEPTH && !level.empty(); depth++) {
+		std::vector<int> nextLevel;
+		for (int nodeIndex : level) {
+			const Node& node = pNodes[nodeIndex];
+			if (node.childIndex == 0) continue;
+
+			pOrder.push_back(nodeIndex);
+			nextLevel.push_back(node.childIndex);
+			nextLevel.push_back(node.childIndex + 1);
+		}
+		level.swap(nextLevel);
+	}
+
+	for (int nodeIndex : level) {
+		depthFirstOrder(pNodes, nodeIndex, pOrder);
+	}
+}
+
+static void collectAtDepth(const std::vector<Node>& pNodes, int pNodeIndex, int pDepth, std::vector<int>& pResult) {
+	const Node& node = pNodes[pNodeIndex];
+	if (node.childIndex == 0) return;
+	if (pDepth == 0) {
+		pResult.push_back(pNodeIndex);
+		return;
+	}
+	collectAtDepth(pNodes, node.childIndex, pDepth - 1, pResult);
+	collectAtDepth(pNodes, node.childIndex + 1, pDepth - 1, pResult);
+}
+
+// Lays out the top half of the pHeight levels below pNodeIndex, then each
+// subtree hanging below it, recursively
+static void vanEmdeBoasOrder(const std::vector<Node>& pNodes, const std::vector<int>& pHeights, int pNodeIndex, int pHeight, std::vector<int>& pOrder) {
+	pHeight = std::min(pHeight, pHeights[pNodeIndex]);
+	if (pHeight <= 0) return;
+	if (pHeight == 1) {
+		pOrder.push_back(pNodeIndex);
+		return;
+	}
+
+	int topHeight = pHeight / 2;
+	vanEmdeBoasOrder(pNodes, pHeights, pNodeIndex, topHeight, pOrder);
+
+	std::vector<int> bottomRoots;
+	collectAtDepth(pNodes, pNodeIndex, topHeight, bottomRoots);
+	for (int root : bottomRoots) {
+		vanEmdeBoasOrder(pNodes, pHeights, root, pHeight - topHeight, pOrder);
+	}
+}
+
+// Fills blocks of LAYOUT_BLOCK_BYTES with the largest nodes of a subtree, as a
+// random ray visits a node with a probability proportional to its area. The
+// nodes that did not fit start blocks of their own.
+static void treeletOrder(const std::vector<Node>& pNodes, std::vector<int>& pOrder) {
+	const int pairsPerBlock = std::max(1, LAYOUT_BLOCK_BYTES / (int)(2 * sizeof(Node)));
+	auto isSmaller = [&](int pA, int pB) { return pNodes[pA].bounds.halfArea() < pNodes[pB].bounds.halfArea(); };
+
+	std::deque<int> blockRoots = { 0 };
+	while (!blockRoots.empty()) {
+		std::priority_queue<int, std::vector<int>, decltype(isSmaller)> candidates(isSmaller);
+		candidates.push(blockRoots.front());
+		blockRoots.pop_front();
+
+		for (int pairs = 0; pairs < pairsPerBlock && !candidates.empty(); ) {
+			int nodeIndex = candidates.top();
+			candidates.pop();
+			const Node& node = pNodes[nodeIndex];
+			if (node.childIndex == 0) continue;
+
+			pOrder.push_back(nodeIndex);
+			candidates.push(node.childIndex);
+			candidates.push(node.childIndex + 1);
+			pairs++;
+		}
+
+		while (!candidates.empty()) {
+			if (pNodes[candidates.top()].childIndex != 0) blockRoots.push_back(candidates.top());
+			candidates.pop();
+		}
+	}
+}
+
+void BVH::reorderNodes(BVHNodeLayout pLayout) {
+	if (nodes.empty() || pLayout == BVHNodeLayout::BuildOrder) return;
+
+	// Inner nodes in the order their children are placed
+	std::vector<int> order;
+	order.reserve(nodes.size() / 2);
+	if (pLayout == BVHNodeLayout::DepthFirst) {
+		depthFirstOrder(nodes, 0, order);
+	}
+	else if (pLayout == BVHNodeLayout::BreadthFirstTop) {
+		breadthFirstTopOrder(nodes, order);
+	}
+	else if (pLayout == BVHNodeLayout::VanEmdeBoas) {
+		// Inner levels below each node, children always come after their parent
+		std::vector<int> heights(nodes.size(), 0);
+		std::vector<std::vector<int>> levels;
+		collectLevels(levels);
+		for (int depth = (int)levels.size() - 1; depth >= 0; depth--) {
+			for (int nodeIndex : levels[depth]) {
+				const Node& node = nodes[nodeIndex];
+				if (node.childIndex != 0) {
+					heights[nodeIndex] = 1 + std::max(heights[node.childIndex], heights[node.childIndex + 1]);
+				}
+			}
+		}
+		vanEmdeBoasOrder(nodes, heights, 0, heights[0], order);
+	}
+	else {
+		treeletOrder(nodes, order);
+	}
+
+	std::vector<int> remap(nodes.size(), 0);
+	int count = 1;
+	for (int nodeIndex : order) {
+		remap[nodes[nodeIndex].childIndex] = count++;
+		remap[nodes[nodeIndex].childIndex + 1] = count++;
+	}
+
+	std::vector<Node> reordered(count);
+	for (size_t i = 0; i < nodes.size(); i++) {
+		if (i != 0 && remap[i] == 0) continue;
+
+		Node node = nodes[i];
+		if (node.childIndex != 0) node.childIndex = remap[node.childIndex];
+		reordered[remap[i]] = node;
+	}
+	nodes.swap(reordered);
+	editParents.clear();
+}
@@ -0,0 +1,257 @@
+#include "BVH.h"
+#include "BoundsSIMD.h"
+#include "ThreadPool.h"
+#include "RayTests.h"
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+// Lazy construction: buildLazy splits the top of the tree and stops at the
+// subtrees of at most lazySubtreeSize triangles, which keep the slots of the
+// node arena reserved for them. The first ray to reach one builds it there.
+//
+// Rays read the child index of every slot from an atomic copy. A pending
+// subtree holds -(depth + 1), the ray that swaps it for LAZY_BUILDING builds
+// the subtree and a release store of the real child index publishes it. Rays
+// that find a subtree being built test its triangles through the reference
+// snapshot instead of waiting, so no ray ever blocks on another.
+
+static const int LAZY_BUILDING = std::numeric_limits<int>::min();
+static const int LAZY_RAY_BATCH_SIZE = 1024;
+
+struct BVH::LazyState {
+	std::unique_ptr<std::atomic<int>[]> children;
+	std::vector<int> indices; // triangle of every reference after the eager splits
+	std::atomic<int> pending{ 0 };
+};
+
+// Without workers every task runs on the calling thread, so the rays can
+// share it while they expand subtrees
+static ThreadPool& inlinePool() {
+	static ThreadPool pool(1);
+	return pool;
+}
+
+void BVH::buildLazy(std::vector<Triangle>& pTriangles) {
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	ThreadPool threadPool(settings.numThreads);
+	beginBuild(threadPool);
+
+	BoundingBox bounds;
+	BoundingBox centroidBounds;
+	createRefs(pTriangles, bounds, centroidBounds);
+
+	int triangleCount = (int)refs.size();
+	createNodeArena(std::max(1, 2 * triangleCount - 1));
+	scratch.resize(refs.size());
+	trackMemory(scratch.capacity() * sizeof(PrimitiveRef));
+
+	nodes[0] = Node{ bounds, 0, triangleCount, 0 };
+	lazySubtreeSize = std::max(1, settings.lazySubtreeSize);
+	split(0, centroidBounds, 0, 1);
+	lazySubtreeSize = 0;
+
+	// Only partitions of more than two chunks go through the scratch buffer
+	if (settings.lazySubtreeSize < 2 * PARALLEL_CHUNK_SIZE) {
+		trackMemory(-(long long)(scratch.capacity() * sizeof(PrimitiveRef)));
+		scratch.clear();
+		scratch.shrink_to_fit();
+	}
+
+	lazy = std::make_shared<LazyState>();
+	lazy->children.reset(new std::atomic<int>[nodes.size()]);
+	lazy->indices.resize(refs.size());
+	trackMemory(nodes.size() * sizeof(std::atomic<int>) + lazy->indices.capacity() * sizeof(int));
+
+	for (size_t i = 0; i < nodes.size(); i++) {
+		lazy->children[i].store(0, std::memory_order_relaxed);
+	}
+	for (int i = 0; i < triangleCount; i++) {
+		lazy->indices[i] = refs[i].index;
+	}
+
+	// Pending subtrees are the inner nodes whose children slots are still unused
+	std::vector<std::pair<int, int>> stack = { { 0, 0 } };
+	while (!stack.empty()) {
+		auto [nodeIndex, depth] = stack.back();
+		stack.pop_back();
+		const Node& node = nodes[nodeIndex];
+		if (node.childIndex == 0) continue;
+
+		if (nodes[node.childIndex].triangleCount < 0) {
+			lazy->children[nodeIndex].store(-(depth + 1), std::memory_order_relaxed);
+			lazy->pending++;
+			continue;
+		}
+		lazy->children[nodeIndex].store(node.childIndex, std::memory_order_relaxed);
+		stack.push_back({ node.childIndex, depth + 1 });
+		stack.push_back({ node.childIndex + 1, depth + 1 });
+	}
+	this->pool = &inlinePool();
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	stats.buildTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+	stats.sahCost = 0.0f;
+	stats.numThreads = threadPool.size();
+	stats.lazySubtrees = lazy->pending;
+	stats.lazyExpandedSubtrees = 0;
+	stats.lazyRays = 0;
+	stats.lazyRayHits = 0;
+	stats.lazyRayTimeMs = 0.0;
+	stats.lazyCompleteTimeMs = 0.0;
+}
+
+void BVH::expandLazy(int pNodeIndex, int pState) {
+	if (!lazy->children[pNodeIndex].compare_exchange_strong(pState, LAZY_BUILDING, std::memory_order_acquire)) return;
+
+	Node& node = nodes[pNodeIndex];
+	int childrenIndex = node.childIndex;
+	node.childIndex = 0;
+
+	SIMDBox centroidBounds;
+	for (int i = node.triangleIndex; i < node.triangleIndex + node.triangleCount; i++) {
+		centroidBounds.growToInclude(refCentroid(refs[i]));
+	}
+	split(pNodeIndex, centroidBounds.toBoundingBox(), -pState - 1, childrenIndex);
+
+	// The subtree stays within the 2n - 2 slots reserved for it
+	int end = childrenIndex + 2 * node.triangleCount - 2;
+	for (int slot = childrenIndex; slot < end; slot++) {
+		if (nodes[slot].triangleCount >= 0) {
+			lazy->children[slot].store(nodes[slot].childIndex, std::memory_order_relaxed);
+		}
+	}
+	lazy->children[pNodeIndex].store(node.childIndex, std::memory_order_release);
+	lazy->pending--;
+}
+
+// Closest hit of the ray, in the triangle order of pTriangles. Safe to call
+// from several threads at once until completeLazy.
+bool BVH::intersectLazy(const std::vector<Triangle>& pTriangles, const glm::vec3& pOrigin, const glm::vec3& pDir, float& pDst, int& pTriangleIndex) {
+	pDst = std::numeric_limits<float>::infinity();
+	pTriangleIndex = -1;
+	if (nodes.empty()) return false;
+
+	glm::vec3 invDir = 1.0f / pDir;
+	auto testTriangle = [&](int pIndex) {
+		float dst;
+		if (rayTriangleDst(pOrigin, pDir, pTriangles[pIndex], dst) && dst < pDst) {
+			pDst = dst;
+			pTriangleIndex = pIndex;
+		}
+	};
+
+	std::vector<int> nodeStack = { 0 };
+	while (!nodeStack.empty()) {
+		int nodeIndex = nodeStack.back();
+		nodeStack.pop_back();
+		const Node& node = nodes[nodeIndex];
+
+		// The child index of the node is written by the ray expanding it, only
+		// the atomic copy may be read meanwhile
+		int childIndex;
+		if (lazy) {
+			std::atomic<int>& children = lazy->children[nodeIndex];
+			childIndex = children.load(std::memory_order_acquire);
+			if (childIndex < 0 && childIndex != LAZY_BUILDING) {
+				expandLazy(nodeIndex, childIndex);
+				childIndex = children.load(std::memory_order_acquire);
+			}
+		}
+		else {
+			childIndex = node.childIndex;
+		}
+
+		if (childIndex == LAZY_BUILDING) {
+			for (int i = node.triangleIndex; i < node.triangleIndex + node.triangleCount; i++) {
+				testTriangle(lazy->indices[i]);
+			}
+			continue;
+		}
+		if (childIndex == 0) {
+			for (int i = node.triangleIndex; i < node.triangleIndex + node.triangleCount; i++) {
+				testTriangle(lazy ? refs[i].index : i);
+			}
+			continue;
+		}
+
+		float dstA = rayBoxDst(pOrigin, invDir, nodes[childIndex].bounds.boundsMin, nodes[childIndex].bounds.boundsMax);
+		float dstB = rayBoxDst(pOrigin, invDir, nodes[childIndex + 1].bounds.boundsMin, nodes[childIndex + 1].bounds.boundsMax);
+		bool isNearestA = dstA < dstB;
+		if ((isNearestA ? dstB : dstA) < pDst) nodeStack.push_back(isNearestA ? childIndex + 1 : childIndex);
+		if ((isNearestA ? dstA : dstB) < pDst) nodeStack.push_back(isNearestA ? childIndex : childIndex + 1);
+	}
+	return pTriangleIndex >= 0;
+}
+
+int BVH::pendingSubtrees() const {
+	return lazy ? lazy->pending.load() : 0;
+}
+
+// The sampled rays of the statistics through intersectLazy on the worker
+// threads, building the subtrees they reach first
+void BVH::castLazyRays(const std::vector<Triangle>& pTriangles, int pRayCount) {
+	if (nodes.empty() || pRayCount <= 0) return;
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	int pendingBefore = pendingSubtrees();
+	int rayBatches = (pRayCount + LAZY_RAY_BATCH_SIZE - 1) / LAZY_RAY_BATCH_SIZE;
+	std::vector<int> batchHits(rayBatches, 0);
+
+	ThreadPool threadPool(settings.numThreads);
+	threadPool.parallelFor(rayBatches, [&](int pBatch) {
+		std::mt19937 rng(pBatch + 1);
+		int end = std::min(pRayCount, (pBatch + 1) * LAZY_RAY_BATCH_SIZE);
+		for (int ray = pBatch * LAZY_RAY_BATCH_SIZE; ray < end; ray++) {
+			glm::vec3 origin, dir;
+			sampleRay(rng, nodes[0].bounds, origin, dir);
+			float dst;
+			int triangleIndex;
+			if (intersectLazy(pTriangles, origin, dir, dst, triangleIndex)) batchHits[pBatch]++;
+		}
+	});
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	stats.lazyRays = pRayCount;
+	stats.lazyRayHits = 0;
+	for (int hits : batchHits) stats.lazyRayHits += hits;
+	stats.lazyExpandedSubtrees = pendingBefore - pendingSubtrees();
+	stats.lazyRayTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+}
+
+// Builds the subtrees no ray reached and turns the tree into a regular one,
+// with the triangles in leaf order, ready for the GPU. No ray may be cast
+// through intersectLazy meanwhile.
+void BVH::completeLazy(std::vector<Triangle>& pTriangles) {
+	if (!lazy) return;
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	ThreadPool threadPool(settings.numThreads);
+	this->pool = &threadPool;
+
+	std::vector<int> pendingNodes;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		int state = lazy->children[i].load(std::memory_order_relaxed);
+		if (state < 0 && state != LAZY_BUILDING) pendingNodes.push_back((int)i);
+	}
+	threadPool.parallelFor((int)pendingNodes.size(), [&](int pIndex) {
+		int nodeIndex = pendingNodes[pIndex];
+		expandLazy(nodeIndex, lazy->children[nodeIndex].load(std::memory_order_relaxed));
+	});
+
+	trackMemory(-(long long)(nodes.size() * sizeof(std::atomic<int>) + lazy->indices.capacity() * sizeof(int)));
+	lazy.reset();
+	trackMemory(-(long long)(scratch.capacity() * sizeof(PrimitiveRef)));
+	scratch.clear();
+	scratch.shrink_to_fit();
+
+	compactNodes();
+	reorderTriangles(pTriangles);
+	endBuild();
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	stats.lazyCompleteTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+	stats.sahCost = computeSAHCost();
+}
@@ -0,0 +1,178 @@
+#include "BVH.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <limits>
+
+// Linear BVH: the references are sorted along a Morton curve through their
+// centroids and the hierarchy follows the bits of the sorted codes, so the
+// whole build is a handful of linear passes instead of a SAH search.
+
+static const int RADIX_BITS = 8;
+static const int RADIX_SIZE = 1 << RADIX_BITS;
+
+// Spreads the low pBits bits of pValue out to every third bit
+static uint64_t expandBits(uint64_t pValue, int pBits) {
+	uint64_t result = 0;
+	for (int i = 0; i < pBits; i++) {
+		result |= ((pValue >> i) & 1ull) << (3 * i);
+	}
+	return result;
+}
+
+static int highestBit(uint64_t pValue) {
+	int bit = 0;
+	for (int shift = 32; shift > 0; shift >>= 1) {
+		if (pValue >> shift) {
+			pValue >>= shift;
+			bit += shift;
+		}
+	}
+	return bit;
+}
+
+void BVH::buildLinear(const BoundingBox& pCentroidBounds) {
+	int triangleCount = (int)refs.size();
+	int bitsPerAxis = settings.mortonBits > 30 ? 21 : 10;
+	float gridSize = (float)((1 << bitsPerAxis) - 1);
+	glm::vec3 extent = glm::max(pCentroidBounds.boundsMax - pCentroidBounds.boundsMin, glm::vec3(std::numeric_limits<float>::min()));
+
+	std::vector<uint64_t> codes(triangleCount);
+	std::vector<uint32_t> order(triangleCount);
+	trackMemory(codes.capacity() * sizeof(uint64_t) + order.capacity() * sizeof(uint32_t));
+
+	pool->parallelFor(numChunks(triangleCount), [&](int pChunk) {
+		int first = pChunk * PARALLEL_CHUNK_SIZE;
+		int end = std::min(first + PARALLEL_CHUNK_SIZE, triangleCount);
+
+		for (int i = first; i < end; i++) {
+			glm::vec3 cell = (refs[i].centroid - pCentroidBounds.boundsMin) / extent * gridSize;
+			cell = glm::clamp(cell, glm::vec3(0.0f), glm::vec3(gridSize));
+			codes[i] = (expandBits((uint64_t)cell.x, bitsPerAxis) << 2) |
+				(expandBits((uint64_t)cell.y, bitsPerAxis) << 1) |
+				expandBits((uint64_t)cell.z, bitsPerAxis);
+			order[i] = i;
+		}
+	});
+
+	sortMortonCodes(codes, order);
+
+	scratch.resize(refs.size());
+	trackMemory(scratch.capacity() * sizeof(PrimitiveRef));
+	pool->parallelFor(numChunks(triangleCount), [&](int pChunk) {
+		int first = pChunk * PARALLEL_CHUNK_SIZE;
+		int end = std::min(first + PARALLEL_CHUNK_SIZE, triangleCount);
+		for (int i = first; i < end; i++) {
+			scratch[i] = refs[order[i]];
+		}
+	});
+	refs.swap(scratch);
+	trackMemory(-(long long)(scratch.capacity() * sizeof(PrimitiveRef) + order.capacity() * sizeof(uint32_t)));
+	scratch.clear();
+	scratch.shrink_to_fit();
+	order.clear();
+	order.shrink_to_fit();
+
+	createNodeArena(std::max(1, 2 * triangleCount - 1));
+	emitLinear(0, codes, 0, triangleCount, 0, 1);
+	compactNodes();
+
+	trackMemory(-(long long)(codes.capacity() * sizeof(uint64_t)));
+}
+
+void BVH::sortMortonCodes(std::vector<uint64_t>& pCodes, std::vector<uint32_t>& pOrder) {
+	int count = (int)pCodes.size();
+	int chunks = numChunks(count);
+	int codeBits = settings.mortonBits > 30 ? 63 : 30;
+	int passes = (codeBits + RADIX_BITS - 1) / RADIX_BITS;
+
+	std::vector<uint64_t> sortedCodes(count);
+	std::vector<uint32_t> sortedOrder(count);
+	std::vector<int> offsets(chunks * RADIX_SIZE);
+	trackMemory(sortedCodes.capacity() * sizeof(uint64_t) + sortedOrder.capacity() * sizeof(uint32_t));
+
+	// Least significant digit first. Each chunk counts its digits, and the
+	// offsets are laid out digit-major, chunk-minor so every pass is stable.
+	for (int pass = 0; pass < passes; pass++) {
+		int shift = pass * RADIX_BITS;
+		std::fill(offsets.begin(), offsets.end(), 0);
+
+		pool->parallelFor(chunks, [&](int pChunk) {
+			int first = pChunk * PARALLEL_CHUNK_SIZE;
+			int end = std::min(first + PARALLEL_CHUNK_SIZE, count);
+			int* chunkOffsets = &offsets[pChunk * RADIX_SIZE];
+			for (int i = first; i < end; i++) {
+				chunkOffsets[(pCodes[i] >> shift) & (RADIX_SIZE - 1)]++;
+			}
+		});
+
+		int offset = 0;
+		for (int digit = 0; digit < RADIX_SIZE; digit++) {
+			for (int chunk = 0; chunk < chunks; chunk++) {
+				int digitCount = offsets[chunk * RADIX_SIZE + digit];
+				offsets[chunk * RADIX_SIZE + digit] = offset;
+				offset += digitCount;
+			}
+		}
+
+		pool->parallelFor(chunks, [&](int pChunk) {
+			int first = pChunk * PARALLEL_CHUNK_SIZE;
+			int end = std::min(first + PARALLEL_CHUNK_SIZE, count);
+			int* chunkOffsets = &offsets[pChunk * RADIX_SIZE];
+			for (int i = first; i < end; i++) {
+				int destination = chunkOffsets[(pCodes[i] >> shift) & (RADIX_SIZE - 1)]++;
+				sortedCodes[destination] = pCodes[i];
+				sortedOrder[destination] = pOrder[i];
+			}
+		});
+
+		pCodes.swap(sortedCodes);
+		pOrder.swap(sortedOrder);
+	}
+
+	trackMemory(-(long long)(sortedCodes.capacity() * sizeof(uint64_t) + sortedOrder.capacity() * sizeof(uint32_t)));
+}
+
+BoundingBox BVH::emitLinear(int pNodeIndex, const std::vector<uint64_t>& pCodes, int pFirst, int pCount, int pDepth, int pChildrenIndex) {
+	nodes[pNodeIndex] = Node{ {}, pFirst, pCount, 0 };
+
+	if (pCount == 1 || pDepth == settings.maxDepth) {
+		for (int i = pFirst; i < pFirst + pCount; i++) {
+			nodes[pNodeIndex].bounds.growToInclude(refs[i].boundsMin, refs[i].boundsMax);
+		}
+		return nodes[pNodeIndex].bounds;
+	}
+
+	// Split where the highest bit that differs inside the range flips. Runs of
+	// identical codes are split in the middle.
+	int last = pFirst + pCount - 1;
+	uint64_t difference = pCodes[pFirst] ^ pCodes[last];
+	int splitIndex = pFirst + pCount / 2;
+	if (difference != 0) {
+		int bit = highestBit(difference);
+		splitIndex = (int)(std::partition_point(pCodes.begin() + pFirst, pCodes.begin() + last + 1,
+			[bit](uint64_t pCode) { return ((pCode >> bit) & 1ull) == 0; }) - pCodes.begin());
+	}
+
+	int countA = splitIndex - pFirst;
+	int countB = pCount - countA;
+	nodes[pNodeIndex].childIndex = pChildrenIndex;
+
+	int childrenIndexA = pChildrenIndex + 2;
+	int childrenIndexB = pChildrenIndex + 2 * countA;
+	BoundingBox boundsA, boundsB;
+
+	if (std::min(countA, countB) >= PARALLEL_SUBTREE_SIZE && pool->size() > 1) {
+		TaskGroup group;
+		pool->run(group, [&]() { boundsA = emitLinear(pChildrenIndex, pCodes, pFirst, countA, pDepth + 1, childrenIndexA); });
+		boundsB = emitLinear(pChildrenIndex + 1, pCodes, splitIndex, countB, pDepth + 1, childrenIndexB);
+		pool->wait(group);
+	}
+	else {
+		boundsA = emitLinear(pChildrenIndex, pCodes, pFirst, countA, pDepth + 1, childrenIndexA);
+		boundsB = emitLinear(pChildrenIndex + 1, pCodes, splitIndex, countB, pDepth + 1, childrenIndexB);
+	}
+
+	nodes[pNodeIndex].bounds = boundsA;
+	nodes[pNodeIndex].bounds.growToInclude(boundsB);
+	return nodes[pNodeIndex].bounds;
+}
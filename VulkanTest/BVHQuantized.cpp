@@ -0,0 +1,89 @@
+#include "BVH.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+// Fits [pMin, pMax] into 8 bit steps of 2^pExponent above pOrigin. The shader
+// decodes with the same float operations, so the bounds are widened until the
+// decoded box contains the child, which keeps the traversal conservative.
+static bool quantizeAxis(float pOrigin, int pExponent, float pMin, float pMax, uint32_t& pLow, uint32_t& pHigh) {
+	float scale = std::ldexp(1.0f, pExponent);
+	float low = std::max(0.0f, std::floor((pMin - pOrigin) / scale));
+	float high = std::max(0.0f, std::ceil((pMax - pOrigin) / scale));
+
+	while (low > 0.0f && pOrigin + low * scale > pMin) low--;
+	while (high <= 255.0f && pOrigin + high * scale < pMax) high++;
+	if (high > 255.0f) return false;
+
+	pLow = (uint32_t)low;
+	pHigh = (uint32_t)high;
+	return true;
+}
+
+void BVH::quantize() {
+	if (!settings.quantized || wideNodes.empty()) return;
+
+	int width = wideWidth();
+	int nodeCount = (int)(wideNodes.size() / width);
+	int stride = QUANTIZED_HEADER_SIZE + width * QUANTIZED_CHILD_SIZE;
+	quantizedNodes.assign((size_t)nodeCount * stride, 0);
+
+	for (int n = 0; n < nodeCount; n++) {
+		const WideChild* children = &wideNodes[(size_t)n * width];
+		uint32_t* encoded = &quantizedNodes[(size_t)n * stride];
+
+		BoundingBox bounds;
+		for (int c = 0; c < width; c++) {
+			if (children[c].triangleCount >= 0) {
+				bounds.growToInclude(children[c].boundsMin, children[c].boundsMax);
+			}
+		}
+		glm::vec3 origin = glm::min(bounds.boundsMin, bounds.boundsMax);
+		glm::vec3 extent = glm::max(bounds.boundsMax - bounds.boundsMin, glm::vec3(0.0f));
+
+		uint32_t low[8][3] = {};
+		uint32_t high[8][3] = {};
+		int exponents[3];
+		for (int axis = 0; axis < 3; axis++) {
+			// Smallest power of two that spans the box in 255 steps, raised
+			// further if rounding pushes a child past the last step
+			int exponent = -126;
+			if (extent[axis] > 0.0f) {
+				exponent = std::max(-126, (int)std::ceil(std::log2(extent[axis] / 255.0f)));
+			}
+
+			bool fits = false;
+			while (!fits) {
+				fits = true;
+				for (int c = 0; c < width && fits; c++) {
+					if (children[c].triangleCount < 0) continue;
+					fits = quantizeAxis(origin[axis], exponent, children[c].boundsMin[axis], children[c].boundsMax[axis], low[c][axis], high[c][axis]);
+				}
+				if (!fits) exponent++;
+			}
+			exponents[axis] = exponent;
+		}
+
+		for (int axis = 0; axis < 3; axis++) {
+			float value = origin[axis];
+			std::memcpy(&encoded[axis], &value, sizeof(float));
+			encoded[3] |= (uint32_t)(exponents[axis] + 127) << (8 * axis);
+		}
+
+		for (int c = 0; c < width; c++) {
+			uint32_t* child = &encoded[QUANTIZED_HEADER_SIZE + c * QUANTIZED_CHILD_SIZE];
+			if (children[c].triangleCount < 0) {
+				child[1] = QUANTIZED_EMPTY_CHILD << 16;
+				continue;
+			}
+			if (children[c].triangleCount >= (int)QUANTIZED_EMPTY_CHILD) {
+				throw std::runtime_error("BVH leaf too large for the quantized node format!");
+			}
+
+			child[0] = low[c][0] | (low[c][1] << 8) | (low[c][2] << 16) | (high[c][0] << 24);
+			child[1] = high[c][1] | (high[c][2] << 8) | ((uint32_t)children[c].triangleCount << 16);
+			child[2] = (uint32_t)children[c].index;
+		}
+	}
+}
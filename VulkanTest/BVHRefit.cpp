@@ -0,0 +1,176 @@
+#include "BVH.h"
+#include "ThreadPool.h"
+#include <stdexcept>
+#include <chrono>
+#include <algorithm>
+
+// Refitting keeps the topology and recomputes the bounds bottom-up from the
+// current triangle positions. Nodes of one depth never contain each other, so
+// each depth is refitted in parallel, starting with the deepest.
+
+static const int REFIT_BATCH_SIZE = 1024;
+static const int REFIT_RANGE_GAP = 16;
+
+static BoundingBox triangleRangeBounds(const std::vector<Triangle>& pTriangles, int pFirst, int pCount) {
+	BoundingBox bounds;
+	for (int i = pFirst; i < pFirst + pCount; i++) {
+		// From the positions, the cached min and max of a moved triangle are stale
+		bounds.growToInclude(glm::vec3(pTriangles[i].posA));
+		bounds.growToInclude(glm::vec3(pTriangles[i].posB));
+		bounds.growToInclude(glm::vec3(pTriangles[i].posC));
+	}
+	return bounds;
+}
+
+static bool sameBounds(const BoundingBox& pA, const BoundingBox& pB) {
+	return pA.boundsMin == pB.boundsMin && pA.boundsMax == pB.boundsMax;
+}
+
+// Merges the changed entries into ranges for uploading. Gaps of a few
+// unchanged entries are uploaded too, to keep the number of copies low.
+void BVH::mergeRanges(std::vector<int>& pChanged, std::vector<BVHRange>& pRanges) {
+	pRanges.clear();
+	std::sort(pChanged.begin(), pChanged.end());
+	for (int index : pChanged) {
+		if (!pRanges.empty() && index < pRanges.back().first + pRanges.back().count + REFIT_RANGE_GAP) {
+			pRanges.back().count = index - pRanges.back().first + 1;
+		}
+		else {
+			pRanges.push_back(BVHRange{ index, 1 });
+		}
+	}
+}
+
+void BVH::refit(const std::vector<Triangle>& pTriangles) {
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	refitNodes.clear();
+	refitWideNodes.clear();
+	if (nodes.empty()) return;
+	if (lazy) {
+		throw std::runtime_error("a lazy BVH has to be completed before it is refitted!");
+	}
+
+	ThreadPool threadPool(settings.numThreads);
+	this->pool = &threadPool;
+
+	std::vector<std::vector<int>> levels;
+	collectLevels(levels);
+
+	std::vector<int> changed;
+	for (int depth = (int)levels.size() - 1; depth >= 0; depth--) {
+		const std::vector<int>& level = levels[depth];
+		int batches = ((int)level.size() + REFIT_BATCH_SIZE - 1) / REFIT_BATCH_SIZE;
+		std::vector<std::vector<int>> batchChanged(batches);
+
+		pool->parallelFor(batches, [&](int pBatch) {
+			int first = pBatch * REFIT_BATCH_SIZE;
+			int end = std::min(first + REFIT_BATCH_SIZE, (int)level.size());
+			for (int i = first; i < end; i++) {
+				Node& node = nodes[level[i]];
+
+				BoundingBox bounds;
+				if (node.childIndex == 0) {
+					bounds = triangleRangeBounds(pTriangles, node.triangleIndex, node.triangleCount);
+				}
+				else {
+					bounds = nodes[node.childIndex].bounds;
+					bounds.growToInclude(nodes[node.childIndex + 1].bounds);
+				}
+
+				if (!sameBounds(bounds, node.bounds)) {
+					node.bounds = bounds;
+					batchChanged[pBatch].push_back(level[i]);
+				}
+			}
+		});
+
+		for (const std::vector<int>& batch : batchChanged) {
+			changed.insert(changed.end(), batch.begin(), batch.end());
+		}
+	}
+	mergeRanges(changed, refitNodes);
+
+	refitWide(pTriangles);
+	this->pool = nullptr;
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	stats.refitTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+	stats.refitSahCost = computeSAHCost();
+}
+
+void BVH::refitWide(const std::vector<Triangle>& pTriangles) {
+	if (wideNodes.empty()) return;
+
+	int width = wideWidth();
+	std::vector<int> changed;
+
+	for (int depth = (int)wideLevelOffsets.size() - 2; depth >= 0; depth--) {
+		int levelFirst = wideLevelOffsets[depth];
+		int levelCount = wideLevelOffsets[depth + 1] - levelFirst;
+		int batches = (levelCount + REFIT_BATCH_SIZE - 1) / REFIT_BATCH_SIZE;
+		std::vector<std::vector<int>> batchChanged(batches);
+
+		pool->parallelFor(batches, [&](int pBatch) {
+			int first = levelFirst + pBatch * REFIT_BATCH_SIZE;
+			int end = std::min(first + REFIT_BATCH_SIZE, levelFirst + levelCount);
+			for (int n = first; n < end; n++) {
+				bool changed = false;
+				for (int c = 0; c < width; c++) {
+					WideChild& child = wideNodes[(size_t)n * width + c];
+					if (child.triangleCount < 0) continue;
+
+					BoundingBox bounds;
+					if (child.triangleCount > 0) {
+						bounds = triangleRangeBounds(pTriangles, child.index, child.triangleCount);
+					}
+					else {
+						for (int g = 0; g < width; g++) {
+							const WideChild& grandchild = wideNodes[(size_t)child.index * width + g];
+							if (grandchild.triangleCount >= 0) {
+								bounds.growToInclude(grandchild.boundsMin, grandchild.boundsMax);
+							}
+						}
+					}
+
+					if (bounds.boundsMin != child.boundsMin || bounds.boundsMax != child.boundsMax) {
+						child.boundsMin = bounds.boundsMin;
+						child.boundsMax = bounds.boundsMax;
+						changed = true;
+					}
+				}
+
+				if (changed) {
+					batchChanged[pBatch].push_back(n);
+				}
+			}
+		});
+
+		for (const std::vector<int>& batch : batchChanged) {
+			changed.insert(changed.end(), batch.begin(), batch.end());
+		}
+	}
+	mergeRanges(changed, refitWideNodes);
+
+	// A quantized node only depends on its own children, so the same range of
+	// quantized nodes changes
+	quantize();
+}
+
+bool BVH::needsRebuild() const {
+	return stats.refitSahCost > stats.sahCost * settings.rebuildThreshold;
+}
+
+void BVH::getRefitOrder(std::vector<int>& pOrder, std::vector<int>& pLevelOffsets) const {
+	// Node indices deepest level first, for refitting one level per dispatch
+	std::vector<std::vector<int>> levels;
+	collectLevels(levels);
+
+	pOrder.clear();
+	pLevelOffsets.clear();
+	for (int depth = (int)levels.size() - 1; depth >= 0; depth--) {
+		pLevelOffsets.push_back((int)pOrder.size());
+		pOrder.insert(pOrder.end(), levels[depth].begin(), levels[depth].end());
+	}
+	pLevelOffsets.push_back((int)pOrder.size());
+}
@@ -0,0 +1,272 @@
+#include "BVH.h"
+#include <algorithm>
+
+// Spatial split BVH (Stich et al. 2009). Besides the binned object split every
+// node also tries splitting space itself: references that straddle the plane
+// are clipped against it and end up in both children, which removes most of
+// the overlap that long or large triangles cause in an object split BVH.
+
+static bool isValid(const BoundingBox& pBox) {
+	return glm::all(glm::lessThanEqual(pBox.boundsMin, pBox.boundsMax));
+}
+
+static void addReference(std::vector<PrimitiveRef>& pRefs, BoundingBox& pBounds, BoundingBox& pCentroidBounds, const PrimitiveRef& pRef) {
+	pRefs.push_back(pRef);
+	pBounds.growToInclude(pRef.boundsMin, pRef.boundsMax);
+	pCentroidBounds.growToInclude(pRef.centroid);
+}
+
+static PrimitiveRef clippedReference(const PrimitiveRef& pRef, const BoundingBox& pPiece) {
+	return PrimitiveRef{ pPiece.boundsMin, pRef.index, pPiece.boundsMax, (pPiece.boundsMin + pPiece.boundsMax) * 0.5f };
+}
+
+void BVH::buildSpatial(const std::vector<Triangle>& pTriangles, const BoundingBox& pBounds, const BoundingBox& pCentroidBounds) {
+	int triangleCount = (int)refs.size();
+	spatialTriangles = &pTriangles;
+	maxSpatialRefs = triangleCount + (int)(settings.spatialSplitBudget * triangleCount);
+	spatialRefCount = triangleCount;
+	spatialRootArea = pBounds.halfArea();
+
+	// The final reference count is only known at the end, so nodes are appended
+	// depth first into an arena large enough for the whole duplication budget
+	nodes.clear();
+	nodes.shrink_to_fit();
+	nodes.reserve(std::max(1, 2 * maxSpatialRefs - 1));
+	trackMemory(nodes.capacity() * sizeof(Node));
+	nodes.push_back(Node{ pBounds, 0, triangleCount, 0 });
+
+	spatialOutput.clear();
+	spatialOutput.reserve(maxSpatialRefs);
+	trackMemory(spatialOutput.capacity() * sizeof(PrimitiveRef));
+
+	std::vector<PrimitiveRef> rootRefs;
+	rootRefs.swap(refs);
+	splitSpatial(0, rootRefs, pCentroidBounds, 0);
+	trackMemory(-(long long)(rootRefs.capacity() * sizeof(PrimitiveRef)));
+	rootRefs.clear();
+	rootRefs.shrink_to_fit();
+
+	refs.swap(spatialOutput);
+	stats.duplicatedReferences = (int)refs.size() - triangleCount;
+	spatialTriangles = nullptr;
+}
+
+void BVH::splitSpatial(int pNodeIndex, std::vector<PrimitiveRef>& pRefs, const BoundingBox& pCentroidBounds, int pDepth) {
+	int count = (int)pRefs.size();
+	BoundingBox bounds = nodes[pNodeIndex].bounds;
+
+	Split objectSplit;
+	SpatialSplit spatialSplit;
+	if (pDepth < settings.maxDepth && count > 1) {
+		objectSplit = chooseSplit(pRefs.data(), count, pCentroidBounds);
+
+		BoundingBox overlap;
+		overlap.boundsMin = glm::max(objectSplit.boundsA.boundsMin, objectSplit.boundsB.boundsMin);
+		overlap.boundsMax = glm::min(objectSplit.boundsA.boundsMax, objectSplit.boundsB.boundsMax);
+		bool overlapping = objectSplit.axis < 0 || overlap.halfArea() > settings.spatialSplitOverlap * spatialRootArea;
+
+		if (overlapping && spatialRefCount < maxSpatialRefs) {
+			spatialSplit = chooseSpatialSplit(pRefs, bounds);
+		}
+	}
+
+	std::vector<PrimitiveRef> refsA, refsB;
+	PartitionResult result;
+
+	if (shouldSplit(bounds, count, std::min(objectSplit.cost, spatialSplit.cost))) {
+		if (spatialSplit.cost < objectSplit.cost) {
+			partitionSpatial(pRefs, spatialSplit, refsA, refsB, result);
+		}
+
+		if ((refsA.empty() || refsB.empty()) && objectSplit.axis >= 0) {
+			refsA.clear();
+			refsB.clear();
+			result = PartitionResult{};
+
+			for (const PrimitiveRef& ref : pRefs) {
+				if (binIndex(pCentroidBounds, objectSplit.axis, ref.centroid[objectSplit.axis]) <= objectSplit.bin) {
+					addReference(refsA, result.boundsA, result.centroidBoundsA, ref);
+				}
+				else {
+					addReference(refsB, result.boundsB, result.centroidBoundsB, ref);
+				}
+			}
+		}
+	}
+
+	int firstOutput = (int)spatialOutput.size();
+
+	if (refsA.empty() || refsB.empty()) {
+		spatialOutput.insert(spatialOutput.end(), pRefs.begin(), pRefs.end());
+		nodes[pNodeIndex].triangleIndex = firstOutput;
+		nodes[pNodeIndex].triangleCount = count;
+		return;
+	}
+
+	trackMemory((refsA.capacity() + refsB.capacity()) * sizeof(PrimitiveRef));
+	trackMemory(-(long long)(pRefs.capacity() * sizeof(PrimitiveRef)));
+	pRefs.clear();
+	pRefs.shrink_to_fit();
+
+	int childIndex = (int)nodes.size();
+	nodes[pNodeIndex].childIndex = childIndex;
+	nodes.push_back(Node{ result.boundsA, 0, (int)refsA.size(), 0 });
+	nodes.push_back(Node{ result.boundsB, 0, (int)refsB.size(), 0 });
+
+	splitSpatial(childIndex, refsA, result.centroidBoundsA, pDepth + 1);
+	splitSpatial(childIndex + 1, refsB, result.centroidBoundsB, pDepth + 1);
+
+	// Interior nodes cover the output range of their subtree, duplicates included
+	nodes[pNodeIndex].triangleIndex = firstOutput;
+	nodes[pNodeIndex].triangleCount = (int)spatialOutput.size() - firstOutput;
+
+	trackMemory(-(long long)((refsA.capacity() + refsB.capacity()) * sizeof(PrimitiveRef)));
+}
+
+BVH::SpatialSplit BVH::chooseSpatialSplit(const std::vector<PrimitiveRef>& pRefs, const BoundingBox& pBounds) {
+	const int numBins = settings.numBins;
+	int count = (int)pRefs.size();
+
+	SpatialSplit best;
+	std::vector<SpatialBin> bins(numBins);
+	std::vector<BoundingBox> rightBounds(numBins);
+	std::vector<int> rightCounts(numBins);
+
+	for (int axis = 0; axis < 3; axis++) {
+		float origin = pBounds.boundsMin[axis];
+		float binSize = (pBounds.boundsMax[axis] - origin) / numBins;
+		if (binSize <= 0.0f) continue;
+
+		// Every reference is clipped into each bin it touches, and counted as
+		// entering its first bin and leaving its last one
+		std::fill(bins.begin(), bins.end(), SpatialBin{});
+		for (const PrimitiveRef& ref : pRefs) {
+			int firstBin = std::clamp((int)((ref.boundsMin[axis] - origin) / binSize), 0, numBins - 1);
+			int lastBin = std::clamp((int)((ref.boundsMax[axis] - origin) / binSize), firstBin, numBins - 1);
+
+			for (int bin = firstBin; bin <= lastBin; bin++) {
+				float binMin = bin == firstBin ? ref.boundsMin[axis] : origin + bin * binSize;
+				float binMax = bin == lastBin ? ref.boundsMax[axis] : origin + (bin + 1) * binSize;
+				BoundingBox piece = clipReference(ref, axis, binMin, binMax);
+				if (isValid(piece)) {
+					bins[bin].bounds.growToInclude(piece);
+				}
+			}
+			bins[firstBin].entries++;
+			bins[lastBin].exits++;
+		}
+
+		BoundingBox right;
+		int rightCount = 0;
+		for (int i = numBins - 1; i > 0; i--) {
+			right.growToInclude(bins[i].bounds);
+			rightCount += bins[i].exits;
+			rightBounds[i - 1] = right;
+			rightCounts[i - 1] = rightCount;
+		}
+
+		BoundingBox left;
+		int leftCount = 0;
+		for (int i = 0; i < numBins - 1; i++) {
+			left.growToInclude(bins[i].bounds);
+			leftCount += bins[i].entries;
+
+			int duplicates = leftCount + rightCounts[i] - count;
+			if (leftCount == 0 || rightCounts[i] == 0 || spatialRefCount + duplicates > maxSpatialRefs) continue;
+
+			float cost = nodeCost(left, leftCount) + nodeCost(rightBounds[i], rightCounts[i]);
+			if (cost < best.cost) {
+				best.cost = cost;
+				best.axis = axis;
+				best.position = origin + (i + 1) * binSize;
+			}
+		}
+	}
+
+	return best;
+}
+
+void BVH::partitionSpatial(std::vector<PrimitiveRef>& pRefs, const SpatialSplit& pSplit, std::vector<PrimitiveRef>& pRefsA, std::vector<PrimitiveRef>& pRefsB, PartitionResult& pResult) {
+	const int axis = pSplit.axis;
+	const float position = pSplit.position;
+	std::vector<int> straddling;
+
+	for (int i = 0; i < (int)pRefs.size(); i++) {
+		const PrimitiveRef& ref = pRefs[i];
+		if (ref.boundsMax[axis] <= position) {
+			addReference(pRefsA, pResult.boundsA, pResult.centroidBoundsA, ref);
+		}
+		else if (ref.boundsMin[axis] >= position) {
+			addReference(pRefsB, pResult.boundsB, pResult.centroidBoundsB, ref);
+		}
+		else {
+			straddling.push_back(i);
+		}
+	}
+
+	// Reference unsplitting: a straddling reference is only duplicated when
+	// that is cheaper than moving it whole into either child
+	for (int i : straddling) {
+		const PrimitiveRef& ref = pRefs[i];
+		BoundingBox pieceA = clipReference(ref, axis, -std::numeric_limits<float>::max(), position);
+		BoundingBox pieceB = clipReference(ref, axis, position, std::numeric_limits<float>::max());
+
+		int countA = (int)pRefsA.size();
+		int countB = (int)pRefsB.size();
+
+		BoundingBox splitA = pResult.boundsA, splitB = pResult.boundsB;
+		BoundingBox wholeA = pResult.boundsA, wholeB = pResult.boundsB;
+		splitA.growToInclude(pieceA);
+		splitB.growToInclude(pieceB);
+		wholeA.growToInclude(ref.boundsMin, ref.boundsMax);
+		wholeB.growToInclude(ref.boundsMin, ref.boundsMax);
+
+		float costSplit = nodeCost(splitA, countA + 1) + nodeCost(splitB, countB + 1);
+		float costA = nodeCost(wholeA, countA + 1) + nodeCost(pResult.boundsB, countB);
+		float costB = nodeCost(pResult.boundsA, countA) + nodeCost(wholeB, countB + 1);
+
+		if (!isValid(pieceB) || (costA <= costSplit && costA <= costB)) {
+			addReference(pRefsA, pResult.boundsA, pResult.centroidBoundsA, ref);
+		}
+		else if (!isValid(pieceA) || costB <= costSplit) {
+			addReference(pRefsB, pResult.boundsB, pResult.centroidBoundsB, ref);
+		}
+		else {
+			addReference(pRefsA, pResult.boundsA, pResult.centroidBoundsA, clippedReference(ref, pieceA));
+			addReference(pRefsB, pResult.boundsB, pResult.centroidBoundsB, clippedReference(ref, pieceB));
+			spatialRefCount++;
+		}
+	}
+
+	pResult.countA = (int)pRefsA.size();
+}
+
+BoundingBox BVH::clipReference(const PrimitiveRef& pRef, int pAxis, float pMin, float pMax) const {
+	const Triangle& tri = (*spatialTriangles)[pRef.index];
+	glm::vec3 vertices[3] = { glm::vec3(tri.posA), glm::vec3(tri.posB), glm::vec3(tri.posC) };
+	BoundingBox piece;
+
+	// Bounds of the part of the triangle between the two planes: the vertices
+	// inside the slab plus every point where an edge crosses one of the planes
+	for (int i = 0; i < 3; i++) {
+		glm::vec3 a = vertices[i];
+		glm::vec3 b = vertices[(i + 1) % 3];
+
+		if (a[pAxis] >= pMin && a[pAxis] <= pMax) {
+			piece.growToInclude(a);
+		}
+
+		for (float plane : { pMin, pMax }) {
+			if ((a[pAxis] < plane && b[pAxis] > plane) || (a[pAxis] > plane && b[pAxis] < plane)) {
+				glm::vec3 crossing = glm::mix(a, b, (plane - a[pAxis]) / (b[pAxis] - a[pAxis]));
+				crossing[pAxis] = plane;
+				piece.growToInclude(crossing);
+			}
+		}
+	}
+
+	// The reference may already be a clipped piece of the triangle
+	piece.boundsMin = glm::max(piece.boundsMin, pRef.boundsMin);
+	piece.boundsMax = glm::min(piece.boundsMax, pRef.boundsMax);
+	return piece;
+}
@@ -0,0 +1,285 @@
+#include "BVH.h"
+#include "ThreadPool.h"
+#include "RayTests.h"
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+// Offline quality metrics of the built tree. The ray cast mirrors the
+// traversal loops of shader.comp, so its counts match what the GPU does.
+
+static const int STATS_BATCH_SIZE = 1024;
+static const int MAX_CLIPPED_VERTICES = 9;
+
+static float polygonArea(const glm::vec3* pVertices, int pCount) {
+	glm::vec3 sum(0.0f);
+	for (int i = 1; i + 1 < pCount; i++) {
+		sum += glm::cross(pVertices[i] - pVertices[0], pVertices[i + 1] - pVertices[0]);
+	}
+	return 0.5f * glm::length(sum);
+}
+
+// Area of the part of the triangle inside the box, clipping it against the
+// six box planes
+static float clippedArea(const Triangle& pTri, const BoundingBox& pBox) {
+	glm::vec3 polygon[MAX_CLIPPED_VERTICES] = { glm::vec3(pTri.posA), glm::vec3(pTri.posB), glm::vec3(pTri.posC) };
+	glm::vec3 clipped[MAX_CLIPPED_VERTICES];
+	int count = 3;
+
+	for (int plane = 0; plane < 6 && count > 0; plane++) {
+		int axis = plane % 3;
+		bool isMax = plane >= 3;
+		float limit = isMax ? pBox.boundsMax[axis] : pBox.boundsMin[axis];
+
+		int clippedCount = 0;
+		for (int i = 0; i < count; i++) {
+			const glm::vec3& a = polygon[i];
+			const glm::vec3& b = polygon[(i + 1) % count];
+			float distA = isMax ? limit - a[axis] : a[axis] - limit;
+			float distB = isMax ? limit - b[axis] : b[axis] - limit;
+
+			if (distA >= 0.0f) clipped[clippedCount++] = a;
+			if ((distA >= 0.0f) != (distB >= 0.0f) && clippedCount < MAX_CLIPPED_VERTICES) {
+				clipped[clippedCount++] = a + (b - a) * (distA / (distA - distB));
+			}
+		}
+
+		count = clippedCount;
+		std::copy(clipped, clipped + count, polygon);
+	}
+
+	return count >= 3 ? polygonArea(polygon, count) : 0.0f;
+}
+
+static bool boxesOverlap(const BoundingBox& pA, const glm::vec3& pMin, const glm::vec3& pMax) {
+	return glm::all(glm::lessThanEqual(pA.boundsMin, pMax)) && glm::all(glm::lessThanEqual(pMin, pA.boundsMax));
+}
+
+BVHQualityStats BVH::computeQualityStats(const std::vector<Triangle>& pTriangles, int pSampleRays) const {
+	BVHQualityStats quality;
+	if (nodes.empty()) return quality;
+
+	ThreadPool threadPool(settings.numThreads);
+
+	quality.sahCost = computeSAHCost();
+	quality.nodeCount = (int)nodes.size();
+	quality.nodeBytes = sizeof(Node) * nodes.size();
+	quality.wideNodeBytes = sizeof(WideChild) * wideNodes.size();
+	quality.quantizedNodeBytes = sizeof(uint32_t) * quantizedNodes.size();
+
+	// Depth first order, with enter and exit numbers to tell ancestors apart
+	std::vector<int> depths(nodes.size(), 0);
+	std::vector<int> enter(nodes.size(), 0);
+	std::vector<int> leave(nodes.size(), 0);
+	std::vector<int> leafOf(pTriangles.size(), 0);
+	std::vector<std::pair<int, bool>> stack = { { 0, false } };
+	int counter = 0;
+	while (!stack.empty()) {
+		auto [nodeIndex, done] = stack.back();
+		stack.pop_back();
+		const Node& node = nodes[nodeIndex];
+
+		if (done) {
+			leave[nodeIndex] = counter++;
+			continue;
+		}
+
+		enter[nodeIndex] = counter++;
+		stack.push_back({ nodeIndex, true });
+		if (node.childIndex == 0) {
+			quality.leafCount++;
+			quality.maxLeafDepth = std::max(quality.maxLeafDepth, depths[nodeIndex]);
+			if ((int)quality.leafDepthHistogram.size() <= depths[nodeIndex]) quality.leafDepthHistogram.resize(depths[nodeIndex] + 1, 0);
+			quality.leafDepthHistogram[depths[nodeIndex]]++;
+			if ((int)quality.leafSizeHistogram.size() <= node.triangleCount) quality.leafSizeHistogram.resize(node.triangleCount + 1, 0);
+			quality.leafSizeHistogram[node.triangleCount]++;
+			for (int i = node.triangleIndex; i < node.triangleIndex + node.triangleCount; i++) leafOf[i] = nodeIndex;
+		}
+		else {
+			for (int child = node.childIndex; child < node.childIndex + 2; child++) {
+				depths[child] = depths[nodeIndex] + 1;
+				stack.push_back({ child, false });
+			}
+		}
+	}
+
+	// Sibling overlap
+	float rootArea = std::max(nodes[0].bounds.halfArea(), std::numeric_limits<float>::min());
+	int innerCount = 0;
+	for (const Node& node : nodes) {
+		if (node.childIndex == 0) continue;
+
+		const BoundingBox& boundsA = nodes[node.childIndex].bounds;
+		const BoundingBox& boundsB = nodes[node.childIndex + 1].bounds;
+		BoundingBox overlap;
+		overlap.boundsMin = glm::max(boundsA.boundsMin, boundsB.boundsMin);
+		overlap.boundsMax = glm::min(boundsA.boundsMax, boundsB.boundsMax);
+		float area = glm::all(glm::lessThanEqual(overlap.boundsMin, overlap.boundsMax)) ? overlap.halfArea() : 0.0f;
+
+		quality.childOverlap += area / rootArea;
+		quality.meanRelativeOverlap += area / std::max(node.bounds.halfArea(), std::numeric_limits<float>::min());
+		innerCount++;
+	}
+	if (innerCount > 0) quality.meanRelativeOverlap /= innerCount;
+
+	// EPO, each triangle visits the nodes its box overlaps and adds the area
+	// clipped to those it does not belong to
+	int triangleCount = (int)pTriangles.size();
+	int batches = (triangleCount + STATS_BATCH_SIZE - 1) / STATS_BATCH_SIZE;
+	std::vector<double> batchOverlap(batches, 0.0);
+	std::vector<double> batchArea(batches, 0.0);
+	threadPool.parallelFor(batches, [&](int pBatch) {
+		std::vector<int> nodeStack;
+		int end = std::min(triangleCount, (pBatch + 1) * STATS_BATCH_SIZE);
+		for (int i = pBatch * STATS_BATCH_SIZE; i < end; i++) {
+			const Triangle& tri = pTriangles[i];
+			glm::vec3 triMin = glm::min(glm::vec3(tri.posA), glm::min(glm::vec3(tri.posB), glm::vec3(tri.posC)));
+			glm::vec3 triMax = glm::max(glm::vec3(tri.posA), glm::max(glm::vec3(tri.posB), glm::vec3(tri.posC)));
+			glm::vec3 corners[3] = { glm::vec3(tri.posA), glm::vec3(tri.posB), glm::vec3(tri.posC) };
+			batchArea[pBatch] += polygonArea(corners, 3);
+
+			int leaf = leafOf[i];
+			nodeStack.assign(1, 0);
+			while (!nodeStack.empty()) {
+				int nodeIndex = nodeStack.back();
+				nodeStack.pop_back();
+				const Node& node = nodes[nodeIndex];
+				if (!boxesOverlap(node.bounds, triMin, triMax)) continue;
+
+				bool isAncestor = enter[nodeIndex] <= enter[leaf] && leave[leaf] <= leave[nodeIndex];
+				if (!isAncestor) {
+					float cost = node.childIndex == 0 ? (float)node.triangleCount : 1.0f;
+					batchOverlap[pBatch] += cost * clippedArea(tri, node.bounds);
+				}
+
+				if (node.childIndex != 0) {
+					nodeStack.push_back(node.childIndex);
+					nodeStack.push_back(node.childIndex + 1);
+				}
+			}
+		}
+	});
+
+	double overlapSum = 0.0;
+	double sceneArea = 0.0;
+	for (int batch = 0; batch < batches; batch++) {
+		overlapSum += batchOverlap[batch];
+		sceneArea += batchArea[batch];
+	}
+	quality.epo = sceneArea > 0.0 ? (float)(overlapSum / sceneArea) : 0.0f;
+
+	castSampleRays(pTriangles, pSampleRays, quality);
+	return quality;
+}
+
+// The binary and the wide tree are timed in separate passes over the same rays
+void BVH::castSampleRays(const std::vector<Triangle>& pTriangles, int pSampleRays, BVHQualityStats& pQuality) const {
+	if (nodes.empty() || pSampleRays <= 0) return;
+
+	ThreadPool threadPool(settings.numThreads);
+	int rayBatches = (pSampleRays + STATS_BATCH_SIZE - 1) / STATS_BATCH_SIZE;
+	std::vector<long long> batchNodes(rayBatches, 0), batchTriangles(rayBatches, 0);
+	std::vector<long long> batchWideNodes(rayBatches, 0), batchWideTriangles(rayBatches, 0);
+
+	auto startTime = std::chrono::high_resolution_clock::now();
+	threadPool.parallelFor(rayBatches, [&](int pBatch) {
+		std::mt19937 rng(pBatch + 1);
+		std::vector<int> nodeStack;
+
+		int end = std::min(pSampleRays, (pBatch + 1) * STATS_BATCH_SIZE);
+		for (int ray = pBatch * STATS_BATCH_SIZE; ray < end; ray++) {
+			glm::vec3 origin, dir;
+			sampleRay(rng, nodes[0].bounds, origin, dir);
+			glm::vec3 invDir = 1.0f / dir;
+
+			float closest = std::numeric_limits<float>::infinity();
+			nodeStack.assign(1, 0);
+			while (!nodeStack.empty()) {
+				const Node& node = nodes[nodeStack.back()];
+				nodeStack.pop_back();
+				batchNodes[pBatch]++;
+
+				if (node.childIndex == 0) {
+					for (int i = node.triangleIndex; i < node.triangleIndex + node.triangleCount; i++) {
+						float dst;
+						if (rayTriangleDst(origin, dir, pTriangles[i], dst) && dst < closest) closest = dst;
+					}
+					batchTriangles[pBatch] += node.triangleCount;
+					continue;
+				}
+
+				int childA = node.childIndex;
+				int childB = node.childIndex + 1;
+				float dstA = rayBoxDst(origin, invDir, nodes[childA].bounds.boundsMin, nodes[childA].bounds.boundsMax);
+				float dstB = rayBoxDst(origin, invDir, nodes[childB].bounds.boundsMin, nodes[childB].bounds.boundsMax);
+				bool isNearestA = dstA < dstB;
+				if ((isNearestA ? dstB : dstA) < closest) nodeStack.push_back(isNearestA ? childB : childA);
+				if ((isNearestA ? dstA : dstB) < closest) nodeStack.push_back(isNearestA ? childA : childB);
+			}
+		}
+	});
+	auto binaryEndTime = std::chrono::high_resolution_clock::now();
+
+	int width = wideWidth();
+	if (!wideNodes.empty()) {
+		threadPool.parallelFor(rayBatches, [&](int pBatch) {
+			std::mt19937 rng(pBatch + 1);
+			std::vector<std::pair<float, int>> wideStack;
+
+			int end = std::min(pSampleRays, (pBatch + 1) * STATS_BATCH_SIZE);
+			for (int ray = pBatch * STATS_BATCH_SIZE; ray < end; ray++) {
+				glm::vec3 origin, dir;
+				sampleRay(rng, nodes[0].bounds, origin, dir);
+				glm::vec3 invDir = 1.0f / dir;
+
+				float closest = std::numeric_limits<float>::infinity();
+				wideStack.assign(1, { 0.0f, 0 });
+				while (!wideStack.empty()) {
+					auto [nodeDst, nodeIndex] = wideStack.back();
+					wideStack.pop_back();
+					if (nodeDst >= closest) continue;
+					batchWideNodes[pBatch]++;
+
+					size_t firstPushed = wideStack.size();
+					for (int c = 0; c < width; c++) {
+						const WideChild& child = wideNodes[nodeIndex * width + c];
+						if (child.triangleCount < 0) continue;
+
+						float dst = rayBoxDst(origin, invDir, child.boundsMin, child.boundsMax);
+						if (dst >= closest) continue;
+
+						if (child.triangleCount > 0) {
+							for (int i = child.index; i < child.index + child.triangleCount; i++) {
+								float triDst;
+								if (rayTriangleDst(origin, dir, pTriangles[i], triDst) && triDst < closest) closest = triDst;
+							}
+							batchWideTriangles[pBatch] += child.triangleCount;
+						}
+						else {
+							// Far to near, so the nearest child is popped first
+							auto slot = std::upper_bound(wideStack.begin() + firstPushed, wideStack.end(), std::make_pair(dst, child.index),
+								[](const std::pair<float, int>& pA, const std::pair<float, int>& pB) { return pA.first > pB.first; });
+							wideStack.insert(slot, { dst, child.index });
+						}
+					}
+				}
+			}
+		});
+	}
+	auto wideEndTime = std::chrono::high_resolution_clock::now();
+
+	long long totalNodes = 0, totalTriangles = 0, totalWideNodes = 0, totalWideTriangles = 0;
+	for (int batch = 0; batch < rayBatches; batch++) {
+		totalNodes += batchNodes[batch];
+		totalTriangles += batchTriangles[batch];
+		totalWideNodes += batchWideNodes[batch];
+		totalWideTriangles += batchWideTriangles[batch];
+	}
+	pQuality.sampledRays = pSampleRays;
+	pQuality.nodesPerRay = (float)totalNodes / pSampleRays;
+	pQuality.trianglesPerRay = (float)totalTriangles / pSampleRays;
+	pQuality.wideNodesPerRay = (float)totalWideNodes / pSampleRays;
+	pQuality.wideTrianglesPerRay = (float)totalWideTriangles / pSampleRays;
+	pQuality.rayCastTimeMs = std::chrono::duration<double, std::milli>(binaryEndTime - startTime).count();
+	pQuality.wideRayCastTimeMs = std::chrono::duration<double, std::milli>(wideEndTime - binaryEndTime).count();
+}
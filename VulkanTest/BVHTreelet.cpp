@@ -0,0 +1,177 @@
+#include "BVH.h"
+#include "ThreadPool.h"
+#include <chrono>
+#include <algorithm>
+
+// Treelet restructuring after Karras and Aila, "Fast Parallel Construction of
+// High-Quality Bounding Volume Hierarchies". A treelet is a node together with
+// the few nodes below it that have the largest surfaces. Its leaves are kept
+// as they are, and the internal nodes are rearranged into the topology with
+// the lowest SAH cost, found by dynamic programming over subsets of the leaves.
+
+static const int MAX_TREELET_LEAVES = 8;
+static const int TREELET_BATCH_SIZE = 256;
+
+struct Treelet {
+	int leafCount = 0;
+	int leaves[MAX_TREELET_LEAVES];
+	Node leafNodes[MAX_TREELET_LEAVES];
+	int pairs[MAX_TREELET_LEAVES - 1];
+	int pairCount = 0;
+
+	BoundingBox bounds[1 << MAX_TREELET_LEAVES];
+	float costs[1 << MAX_TREELET_LEAVES];
+	int heights[1 << MAX_TREELET_LEAVES];
+	int partitions[1 << MAX_TREELET_LEAVES];
+};
+
+static int lowestBit(int pSet) {
+	int bit = 0;
+	while (!(pSet & (1 << bit))) bit++;
+	return bit;
+}
+
+void BVH::optimizeTreelets() {
+	if (nodes.size() < 3 || settings.treeletLeaves < 3) return;
+
+	auto startTime = std::chrono::high_resolution_clock::now();
+	stats.unoptimizedSahCost = computeSAHCost();
+
+	int nodeCount = (int)nodes.size();
+	std::vector<float> costs(nodeCount);
+	std::vector<int> heights(nodeCount);
+	std::vector<std::vector<int>> levels;
+	trackMemory(costs.capacity() * sizeof(float) + heights.capacity() * sizeof(int));
+
+	for (int iteration = 0; iteration < std::max(1, settings.treeletIterations); iteration++) {
+		// Treelets rooted at the same depth never overlap, and restructuring one
+		// leaves everything above its root untouched. The levels are therefore
+		// processed bottom-up, with the treelets of one level in parallel.
+		collectLevels(levels);
+
+		for (int depth = (int)levels.size() - 1; depth >= 0; depth--) {
+			const std::vector<int>& level = levels[depth];
+			int batches = ((int)level.size() + TREELET_BATCH_SIZE - 1) / TREELET_BATCH_SIZE;
+
+			pool->parallelFor(batches, [&](int pBatch) {
+				int first = pBatch * TREELET_BATCH_SIZE;
+				int end = std::min(first + TREELET_BATCH_SIZE, (int)level.size());
+				for (int i = first; i < end; i++) {
+					int nodeIndex = level[i];
+					const Node& node = nodes[nodeIndex];
+					if (node.childIndex == 0) {
+						costs[nodeIndex] = node.bounds.halfArea() * node.triangleCount;
+						heights[nodeIndex] = 0;
+						continue;
+					}
+
+					// Everything below this node is final by now
+					costs[nodeIndex] = node.bounds.halfArea() + costs[node.childIndex] + costs[node.childIndex + 1];
+					heights[nodeIndex] = 1 + std::max(heights[node.childIndex], heights[node.childIndex + 1]);
+					optimizeTreelet(nodeIndex, depth, costs, heights);
+				}
+			});
+		}
+	}
+
+	trackMemory(-(long long)(costs.capacity() * sizeof(float) + heights.capacity() * sizeof(int)));
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	stats.treeletTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+}
+
+static void emitTreelet(std::vector<Node>& pNodes, Treelet& pTreelet, int pSlot, int pSet, int& pNextPair, std::vector<float>& pCosts, std::vector<int>& pHeights) {
+	if ((pSet & (pSet - 1)) == 0) {
+		pNodes[pSlot] = pTreelet.leafNodes[lowestBit(pSet)];
+		pCosts[pSlot] = pTreelet.costs[pSet];
+		pHeights[pSlot] = pTreelet.heights[pSet];
+		return;
+	}
+
+	int pair = pTreelet.pairs[pNextPair++];
+	int setA = pTreelet.partitions[pSet];
+	emitTreelet(pNodes, pTreelet, pair, setA, pNextPair, pCosts, pHeights);
+	emitTreelet(pNodes, pTreelet, pair + 1, pSet ^ setA, pNextPair, pCosts, pHeights);
+
+	// Internal nodes keep the triangle count of their subtree, but after
+	// restructuring the triangles below them are no longer one contiguous range
+	const Node& childA = pNodes[pair];
+	const Node& childB = pNodes[pair + 1];
+	pNodes[pSlot] = Node{ pTreelet.bounds[pSet], std::min(childA.triangleIndex, childB.triangleIndex), childA.triangleCount + childB.triangleCount, pair };
+	pCosts[pSlot] = pTreelet.costs[pSet];
+	pHeights[pSlot] = pTreelet.heights[pSet];
+}
+
+void BVH::optimizeTreelet(int pRoot, int pDepth, std::vector<float>& pCosts, std::vector<int>& pHeights) {
+	Treelet treelet;
+	int maxLeaves = std::min(settings.treeletLeaves, MAX_TREELET_LEAVES);
+
+	// Grow the treelet by repeatedly opening the leaf with the largest surface
+	treelet.pairs[treelet.pairCount++] = nodes[pRoot].childIndex;
+	treelet.leaves[0] = nodes[pRoot].childIndex;
+	treelet.leaves[1] = nodes[pRoot].childIndex + 1;
+	treelet.leafCount = 2;
+
+	while (treelet.leafCount < maxLeaves) {
+		int largest = -1;
+		float largestArea = -1.0f;
+		for (int i = 0; i < treelet.leafCount; i++) {
+			const Node& leaf = nodes[treelet.leaves[i]];
+			if (leaf.childIndex != 0 && leaf.bounds.halfArea() > largestArea) {
+				largest = i;
+				largestArea = leaf.bounds.halfArea();
+			}
+		}
+		if (largest < 0) break;
+
+		int childIndex = nodes[treelet.leaves[largest]].childIndex;
+		treelet.pairs[treelet.pairCount++] = childIndex;
+		treelet.leaves[largest] = childIndex;
+		treelet.leaves[treelet.leafCount++] = childIndex + 1;
+	}
+	if (treelet.leafCount < 3) return;
+
+	// Best topology for every subset of the leaves. Subsets are visited in
+	// increasing order, so both halves of a partition are always known.
+	int fullSet = (1 << treelet.leafCount) - 1;
+	for (int set = 1; set <= fullSet; set++) {
+		int bit = lowestBit(set);
+		int rest = set & (set - 1);
+
+		if (rest == 0) {
+			int leafIndex = treelet.leaves[bit];
+			treelet.leafNodes[bit] = nodes[leafIndex];
+			treelet.bounds[set] = nodes[leafIndex].bounds;
+			treelet.costs[set] = pCosts[leafIndex];
+			treelet.heights[set] = pHeights[leafIndex];
+			continue;
+		}
+
+		treelet.bounds[set] = treelet.bounds[rest];
+		treelet.bounds[set].growToInclude(treelet.bounds[1 << bit]);
+
+		// Only partitions holding the lowest leaf on the left, so each one is tried once
+		float bestCost = std::numeric_limits<float>::max();
+		int bestPartition = 0;
+		for (int setA = set; setA != 0; setA = (setA - 1) & set) {
+			if (setA == set || !(setA & (1 << bit))) continue;
+			float cost = treelet.costs[setA] + treelet.costs[set ^ setA];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestPartition = setA;
+			}
+		}
+
+		treelet.costs[set] = treelet.bounds[set].halfArea() + bestCost;
+		treelet.partitions[set] = bestPartition;
+		treelet.heights[set] = 1 + std::max(treelet.heights[bestPartition], treelet.heights[set ^ bestPartition]);
+	}
+
+	// Keep the current topology unless the new one is cheaper and still fits
+	// the traversal stack of the shader
+	if (treelet.costs[fullSet] >= pCosts[pRoot] * (1.0f - 1e-5f)) return;
+	if (pDepth + treelet.heights[fullSet] > settings.maxDepth) return;
+
+	int nextPair = 0;
+	emitTreelet(nodes, treelet, pRoot, fullSet, nextPair, pCosts, pHeights);
+}
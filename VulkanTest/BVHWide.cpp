@@ -0,0 +1,98 @@
+#include "BVH.h"
+#include <algorithm>
+
+// Collapses the binary tree into a BVH4 or BVH8. Every wide node starts with
+// the two children of a binary node and keeps opening its inner child with the
+// largest surface until all slots are used, so each fetch in the shader tests
+// as many boxes as possible.
+
+void BVH::collapse() {
+	wideNodes.clear();
+	quantizedNodes.clear();
+	wideLevelOffsets.clear();
+	stats.wideDepth = 0;
+
+	// The quantized and child bounds formats store child bounds in the parent,
+	// so they need the collapsed tree even for a width of 2
+	if ((settings.width <= 2 && !settings.quantized && !settings.childBounds) || nodes.empty()) return;
+	int width = wideWidth();
+
+	const WideChild emptyChild{ glm::vec3(std::numeric_limits<float>::max()), 0, glm::vec3(-std::numeric_limits<float>::max()), -1 };
+	wideNodes.assign(width, emptyChild);
+
+	if (nodes[0].childIndex == 0) {
+		if (nodes[0].triangleCount > 0) {
+			wideNodes[0] = WideChild{ nodes[0].bounds.boundsMin, nodes[0].triangleIndex, nodes[0].bounds.boundsMax, nodes[0].triangleCount };
+		}
+		stats.wideDepth = 1;
+		wideLevelOffsets = { 0, 1 };
+		quantize();
+		return;
+	}
+
+	// Breadth first, every entry is a binary node and the wide node it becomes.
+	// Wide nodes are numbered in the same order, so every depth is one range
+	// of them, starting at wideLevelOffsets[depth - 1].
+	struct PendingNode {
+		int node;
+		int wideNode;
+		int depth;
+	};
+	std::vector<PendingNode> pending{ { 0, 0, 1 } };
+
+	for (size_t i = 0; i < pending.size(); i++) {
+		PendingNode current = pending[i];
+		if (current.depth > stats.wideDepth) {
+			stats.wideDepth = current.depth;
+			wideLevelOffsets.push_back(current.wideNode);
+		}
+
+		int children[8];
+		int childCount = 2;
+		children[0] = nodes[current.node].childIndex;
+		children[1] = nodes[current.node].childIndex + 1;
+
+		while (childCount < width) {
+			int largest = -1;
+			float largestArea = -1.0f;
+			for (int c = 0; c < childCount; c++) {
+				const Node& child = nodes[children[c]];
+				if (child.childIndex != 0 && child.bounds.halfArea() > largestArea) {
+					largest = c;
+					largestArea = child.bounds.halfArea();
+				}
+			}
+			if (largest < 0) break;
+
+			int childIndex = nodes[children[largest]].childIndex;
+			children[largest] = childIndex;
+			children[childCount++] = childIndex + 1;
+		}
+
+		for (int c = 0; c < childCount; c++) {
+			const Node& child = nodes[children[c]];
+			WideChild wideChild{ child.bounds.boundsMin, child.triangleIndex, child.bounds.boundsMax, child.triangleCount };
+
+			if (child.childIndex != 0) {
+				wideChild.index = (int)(wideNodes.size() / width);
+				wideChild.triangleCount = 0;
+				pending.push_back({ children[c], wideChild.index, current.depth + 1 });
+				wideNodes.resize(wideNodes.size() + width, emptyChild);
+			}
+			wideNodes[current.wideNode * width + c] = wideChild;
+		}
+	}
+
+	wideLevelOffsets.push_back((int)(wideNodes.size() / width));
+	quantize();
+}
+
+int BVH::wideWidth() const {
+	return std::clamp(settings.width, 2, 8);
+}
+
+int BVH::wideStackSize() const {
+	// Every level on the path to the current node leaves at most width - 1
+	// siblings on the stack, and the deepest level pushes up to width children
+	return (wideWidth() - 1) * stats.wideDepth + 1;
+}
@@ -9,3 +9,18 @@ void BoundingBox::growToInclude(glm::vec3 pPoint) {
 	this->boundsMin = glm::min(pPoint, this->boundsMin);
 	this->boundsMax = glm::max(pPoint, this->boundsMax);
 }
+
+void BoundingBox::growToInclude(glm::vec3 pMin, glm::vec3 pMax) {
+	this->boundsMin = glm::min(this->boundsMin, pMin);
+	this->boundsMax = glm::max(this->boundsMax, pMax);
+}
+
+void BoundingBox::growToInclude(const BoundingBox& pBox) {
+	this->boundsMin = glm::min(this->boundsMin, pBox.boundsMin);
+	this->boundsMax = glm::max(this->boundsMax, pBox.boundsMax);
+}
+
+float BoundingBox::halfArea() const {
+	glm::vec3 size = glm::max(this->boundsMax - this->boundsMin, glm::vec3(0.0f));
+	return size.x * (size.y + size.z) + size.y * size.z;
+}
@@ -8,7 +8,8 @@ public:
 	alignas(16) glm::vec3 boundsMax = glm::vec4(-std::numeric_limits<float>::max());
 
 	void growToInclude(const Triangle* pTri);
-private:
 	void growToInclude(glm::vec3 pPoint);
+	void growToInclude(glm::vec3 pMin, glm::vec3 pMax);
+	void growToInclude(const BoundingBox& pBox);
+	float halfArea() const;
 };
-
@@ -0,0 +1,261 @@
+#pragma once
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include "BVH.h"
+
+// SIMD kernels for the bounds math of the builders. A box lives in two 4 lane
+// registers holding x, y and z, so growing it by a reference is one min and
+// one max. Boxes processed in batches are stored as structure of arrays, 4 (SSE)
+// or 8 (AVX) of them per instruction. Without SSE the same interface runs on glm.
+//
+// The kernels do the same float operations in the same order as the scalar
+// code they replace, so the trees do not depend on the instruction set.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_SIMD_SSE
+#include <immintrin.h>
+#endif
+#if defined(BVH_SIMD_SSE) && (defined(__AVX2__) || defined(__AVX__))
+#define BVH_SIMD_AVX
+#endif
+
+#ifdef BVH_SIMD_SSE
+using SIMDVector = __m128;
+
+// x, y and z of a packed vec3, the fourth lane 0
+inline SIMDVector loadVector3(const glm::vec3& pVector) {
+	__m128 xy = _mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double*>(&pVector.x)));
+	return _mm_movelh_ps(xy, _mm_load_ss(&pVector.z));
+}
+
+inline SIMDVector loadVector4(const glm::vec4& pVector) {
+	return _mm_loadu_ps(&pVector.x);
+}
+
+inline glm::vec3 storeVector3(SIMDVector pVector) {
+	alignas(16) float values[4];
+	_mm_store_ps(values, pVector);
+	return glm::vec3(values[0], values[1], values[2]);
+}
+#else
+using SIMDVector = glm::vec3;
+
+inline SIMDVector loadVector3(const glm::vec3& pVector) {
+	return pVector;
+}
+
+inline SIMDVector loadVector4(const glm::vec4& pVector) {
+	return glm::vec3(pVector);
+}
+
+inline glm::vec3 storeVector3(SIMDVector pVector) {
+	return pVector;
+}
+#endif
+
+struct SIMDBox {
+#ifdef BVH_SIMD_SSE
+	__m128 boundsMin = _mm_set1_ps(std::numeric_limits<float>::max());
+	__m128 boundsMax = _mm_set1_ps(-std::numeric_limits<float>::max());
+
+	void growToInclude(SIMDVector pPoint) {
+		boundsMin = _mm_min_ps(boundsMin, pPoint);
+		boundsMax = _mm_max_ps(boundsMax, pPoint);
+	}
+
+	void growToInclude(SIMDVector pMin, SIMDVector pMax) {
+		boundsMin = _mm_min_ps(boundsMin, pMin);
+		boundsMax = _mm_max_ps(boundsMax, pMax);
+	}
+
+	void growToInclude(const SIMDBox& pBox) {
+		growToInclude(pBox.boundsMin, pBox.boundsMax);
+	}
+
+	float halfArea() const {
+		alignas(16) float size[4];
+		_mm_store_ps(size, _mm_max_ps(_mm_sub_ps(boundsMax, boundsMin), _mm_setzero_ps()));
+		return size[0] * (size[1] + size[2]) + size[1] * size[2];
+	}
+#else
+	glm::vec3 boundsMin = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 boundsMax = glm::vec3(-std::numeric_limits<float>::max());
+
+	void growToInclude(SIMDVector pPoint) {
+		boundsMin = glm::min(boundsMin, pPoint);
+		boundsMax = glm::max(boundsMax, pPoint);
+	}
+
+	void growToInclude(SIMDVector pMin, SIMDVector pMax) {
+		boundsMin = glm::min(boundsMin, pMin);
+		boundsMax = glm::max(boundsMax, pMax);
+	}
+
+	void growToInclude(const SIMDBox& pBox) {
+		growToInclude(pBox.boundsMin, pBox.boundsMax);
+	}
+
+	float halfArea() const {
+		glm::vec3 size = glm::max(boundsMax - boundsMin, glm::vec3(0.0f));
+		return size.x * (size.y + size.z) + size.y * size.z;
+	}
+#endif
+
+	BoundingBox toBoundingBox() const {
+		BoundingBox box;
+		box.boundsMin = storeVector3(boundsMin);
+		box.boundsMax = storeVector3(boundsMax);
+		return box;
+	}
+};
+
+inline SIMDVector refBoundsMin(const PrimitiveRef& pRef) {
+	return loadVector3(pRef.boundsMin);
+}
+
+inline SIMDVector refBoundsMax(const PrimitiveRef& pRef) {
+	return loadVector3(pRef.boundsMax);
+}
+
+inline SIMDVector refCentroid(const PrimitiveRef& pRef) {
+	return loadVector3(pRef.centroid);
+}
+
+// Same as (posA + posB + posC) / 3
+inline SIMDVector triangleCentroidSIMD(const Triangle& pTri) {
+#ifdef BVH_SIMD_SSE
+	__m128 sum = _mm_add_ps(_mm_add_ps(loadVector4(pTri.posA), loadVector4(pTri.posB)), loadVector4(pTri.posC));
+	return _mm_div_ps(sum, _mm_set1_ps(3.0f));
+#else
+	return glm::vec3(pTri.posA + pTri.posB + pTri.posC) / 3.0f;
+#endif
+}
+
+// Bin of a centroid on all three axes at once, as BVH::binIndex computes it
+// for one: (centroid - min) / extent * numBins, truncated and clamped, 0 on
+// axes without extent
+class SIMDBinMapping {
+public:
+	SIMDBinMapping(const BoundingBox& pCentroidBounds, int pNumBins) {
+		glm::vec3 extent = pCentroidBounds.boundsMax - pCentroidBounds.boundsMin;
+#ifdef BVH_SIMD_SSE
+		boundsMin = loadVector3(pCentroidBounds.boundsMin);
+		extentVector = loadVector3(extent);
+		hasExtent = _mm_cmpgt_ps(extentVector, _mm_setzero_ps());
+		numBins = _mm_set1_ps((float)pNumBins);
+		lastBin = _mm_set1_ps((float)(pNumBins - 1));
+#else
+		boundsMin = pCentroidBounds.boundsMin;
+		extentVector = extent;
+		numBins = pNumBins;
+#endif
+	}
+
+	void binIndices(SIMDVector pCentroid, int* pIndices) const {
+#ifdef BVH_SIMD_SSE
+		// Clamping before the conversion, NaN of axes without extent turn into 0
+		__m128 position = _mm_mul_ps(_mm_div_ps(_mm_sub_ps(pCentroid, boundsMin), extentVector), numBins);
+		position = _mm_min_ps(_mm_max_ps(position, _mm_setzero_ps()), lastBin);
+		position = _mm_and_ps(position, hasExtent);
+		alignas(16) int indices[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(indices), _mm_cvttps_epi32(position));
+		pIndices[0] = indices[0];
+		pIndices[1] = indices[1];
+		pIndices[2] = indices[2];
+#else
+		for (int axis = 0; axis < 3; axis++) {
+			if (extentVector[axis] <= 0.0f) {
+				pIndices[axis] = 0;
+				continue;
+			}
+			int index = (int)((pCentroid[axis] - boundsMin[axis]) / extentVector[axis] * numBins);
+			pIndices[axis] = std::clamp(index, 0, numBins - 1);
+		}
+#endif
+	}
+
+private:
+#ifdef BVH_SIMD_SSE
+	__m128 boundsMin, extentVector, hasExtent, numBins, lastBin;
+#else
+	glm::vec3 boundsMin, extentVector;
+	int numBins;
+#endif
+};
+
+// Boxes as one array per coordinate, for the kernels that evaluate many of
+// them at once. The arrays share one allocation, each padded to the SIMD
+// width, followed by the costs nodeCosts writes.
+class BoxesSoA {
+public:
+	void resize(int pCount) {
+		stride = (pCount + 7) & ~7;
+		values.assign(7 * stride, 0.0f);
+	}
+
+	void set(int pIndex, const SIMDBox& pBox) {
+		glm::vec3 boundsMin = storeVector3(pBox.boundsMin);
+		glm::vec3 boundsMax = storeVector3(pBox.boundsMax);
+		for (int axis = 0; axis < 3; axis++) {
+			values[axis * stride + pIndex] = boundsMin[axis];
+			values[(3 + axis) * stride + pIndex] = boundsMax[axis];
+		}
+	}
+
+	BoundingBox get(int pIndex) const {
+		BoundingBox box;
+		for (int axis = 0; axis < 3; axis++) {
+			box.boundsMin[axis] = values[axis * stride + pIndex];
+			box.boundsMax[axis] = values[(3 + axis) * stride + pIndex];
+		}
+		return box;
+	}
+
+	float cost(int pIndex) const {
+		return values[6 * stride + pIndex];
+	}
+
+	// Cost of box i is halfArea(box i) * pCounts[i], for the first pCount boxes
+	void nodeCosts(const int* pCounts, int pCount) {
+		const float* minX = &values[0];
+		const float* minY = minX + stride;
+		const float* minZ = minY + stride;
+		const float* maxX = minZ + stride;
+		const float* maxY = maxX + stride;
+		const float* maxZ = maxY + stride;
+		float* costs = &values[6 * stride];
+
+		int i = 0;
+#ifdef BVH_SIMD_AVX
+		for (; i + 8 <= pCount; i += 8) {
+			__m256 sizeX = _mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(maxX + i), _mm256_loadu_ps(minX + i)), _mm256_setzero_ps());
+			__m256 sizeY = _mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(maxY + i), _mm256_loadu_ps(minY + i)), _mm256_setzero_ps());
+			__m256 sizeZ = _mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(maxZ + i), _mm256_loadu_ps(minZ + i)), _mm256_setzero_ps());
+			__m256 area = _mm256_add_ps(_mm256_mul_ps(sizeX, _mm256_add_ps(sizeY, sizeZ)), _mm256_mul_ps(sizeY, sizeZ));
+			__m256 counts = _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pCounts + i)));
+			_mm256_storeu_ps(costs + i, _mm256_mul_ps(area, counts));
+		}
+#endif
+#ifdef BVH_SIMD_SSE
+		for (; i + 4 <= pCount; i += 4) {
+			__m128 sizeX = _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(maxX + i), _mm_loadu_ps(minX + i)), _mm_setzero_ps());
+			__m128 sizeY = _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(maxY + i), _mm_loadu_ps(minY + i)), _mm_setzero_ps());
+			__m128 sizeZ = _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(maxZ + i), _mm_loadu_ps(minZ + i)), _mm_setzero_ps());
+			__m128 area = _mm_add_ps(_mm_mul_ps(sizeX, _mm_add_ps(sizeY, sizeZ)), _mm_mul_ps(sizeY, sizeZ));
+			__m128 counts = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pCounts + i)));
+			_mm_storeu_ps(costs + i, _mm_mul_ps(area, counts));
+		}
+#endif
+		for (; i < pCount; i++) {
+			float sizeX = std::max(maxX[i] - minX[i], 0.0f);
+			float sizeY = std::max(maxY[i] - minY[i], 0.0f);
+			float sizeZ = std::max(maxZ[i] - minZ[i], 0.0f);
+			costs[i] = (sizeX * (sizeY + sizeZ) + sizeY * sizeZ) * pCounts[i];
+		}
+	}
+
+private:
+	std::vector<float> values;
+	int stride = 0;
+};
@@ -1,6 +1,7 @@
 #pragma once
 #include "BoundingBox.h"
 #include <vector>
+#include <cstdint>
 
 struct Node {
 	BoundingBox bounds{};
@@ -10,3 +11,23 @@ struct Node {
 	float padding;
 };
 
+// One child slot of a wide BVH node, a node being BVHSettings::width
+// consecutive slots. Leaves hold their triangle range, inner children the
+// index of their wide node with a triangle count of 0, and unused slots a
+// triangle count of -1.
+struct WideChild {
+	glm::vec3 boundsMin;
+	int index;
+	glm::vec3 boundsMax;
+	int triangleCount;
+};
+
+// Quantized wide nodes are QUANTIZED_HEADER_SIZE + width * QUANTIZED_CHILD_SIZE
+// uints. The header holds the float origin of the node box and one biased 8 bit
+// power of two exponent per axis. Each child holds its box as 8 bit multiples
+// of those powers of two above the origin (low xyz, high xyz), a 16 bit
+// triangle count with the same meaning as in WideChild (0xFFFF when unused)
+// and the index.
+const int QUANTIZED_HEADER_SIZE = 4;
+const int QUANTIZED_CHILD_SIZE = 3;
+const uint32_t QUANTIZED_EMPTY_CHILD = 0xFFFF;
@@ -0,0 +1,60 @@
+#pragma once
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <cmath>
+#include <glm/glm.hpp>
+#include "Shapes.h"
+#include "BoundingBox.h"
+
+// CPU versions of the ray tests in shader.comp, for the offline BVH tools
+
+// Sampled rays of the statistics: origins uniform in the root box and
+// directions uniform on the sphere
+inline void sampleRay(std::mt19937& pRng, const BoundingBox& pBounds, glm::vec3& pOrigin, glm::vec3& pDir) {
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	glm::vec3 fraction(unit(pRng), unit(pRng), unit(pRng));
+	pOrigin = pBounds.boundsMin + fraction * (pBounds.boundsMax - pBounds.boundsMin);
+	float z = 2.0f * unit(pRng) - 1.0f;
+	float phi = 6.2831853f * unit(pRng);
+	float radius = std::sqrt(std::max(0.0f, 1.0f - z * z));
+	pDir = glm::vec3(radius * std::cos(phi), radius * std::sin(phi), z);
+}
+
+inline float rayBoxDst(const glm::vec3& pOrigin, const glm::vec3& pInvDir, const glm::vec3& pMin, const glm::vec3& pMax) {
+	glm::vec3 tMin = (pMin - pOrigin) * pInvDir;
+	glm::vec3 tMax = (pMax - pOrigin) * pInvDir;
+	glm::vec3 t1 = glm::min(tMin, tMax);
+	glm::vec3 t2 = glm::max(tMin, tMax);
+	float tNear = std::max(std::max(t1.x, t1.y), t1.z);
+	float tFar = std::min(std::min(t2.x, t2.y), t2.z);
+	return tFar >= tNear && tFar > 0.0f ? tNear : std::numeric_limits<float>::infinity();
+}
+
+// Same test as hitNormalTriangle in the shader, which skips back faces
+inline bool rayTriangleDst(const glm::vec3& pOrigin, const glm::vec3& pDir, const Triangle& pTri, float& pDst) {
+	glm::vec3 posA(pTri.posA);
+	glm::vec3 edgeAB = glm::vec3(pTri.posB) - posA;
+	glm::vec3 edgeAC = glm::vec3(pTri.posC) - posA;
+	glm::vec3 normalVector = glm::cross(edgeAB, edgeAC);
+	glm::vec3 ao = pOrigin - posA;
+	glm::vec3 dao = glm::cross(ao, pDir);
+
+	float determinant = -glm::dot(pDir, normalVector);
+	float invDet = 1.0f / determinant;
+	pDst = glm::dot(ao, normalVector) * invDet;
+	float u = glm::dot(edgeAC, dao) * invDet;
+	float v = -glm::dot(edgeAB, dao) * invDet;
+	return determinant >= 1e-8f && pDst >= 0.0f && u >= 0.0f && v >= 0.0f && 1.0f - u - v >= 0.0f;
+}
+
+// rayTriangleDst on the precomputed record, the ray is moved to the space of
+// the unit triangle instead. Hits front faces only as well.
+inline bool rayWoopTriangleDst(const glm::vec3& pOrigin, const glm::vec3& pDir, const WoopTriangle& pTri, float& pDst) {
+	float originZ = glm::dot(glm::vec3(pTri.rowZ), pOrigin) + pTri.rowZ.w;
+	float dirZ = glm::dot(glm::vec3(pTri.rowZ), pDir);
+	pDst = -originZ / dirZ;
+	float u = glm::dot(glm::vec3(pTri.rowX), pOrigin) + pTri.rowX.w + pDst * glm::dot(glm::vec3(pTri.rowX), pDir);
+	float v = glm::dot(glm::vec3(pTri.rowY), pOrigin) + pTri.rowY.w + pDst * glm::dot(glm::vec3(pTri.rowY), pDir);
+	return dirZ < 0.0f && pDst >= 0.0f && u >= 0.0f && v >= 0.0f && u + v <= 1.0f;
+}
@@ -4,7 +4,12 @@
 
 
 #include <glm/glm.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <limits>
+#include <vector>
+#include "AttributeCompression.h"
 
 struct alignas(16) Material {
 	glm::vec4 color;
@@ -19,10 +24,389 @@ struct Triangle
 {
 	glm::vec4 posA, posB, posC;
 	glm::vec4 normalA, normalB, normalC;
-	Material material;
+	int materialIndex; // into the material table of the scene
+	uint32_t vertexIndices[3]; // corners in the vertex table of the scene
 	glm::vec4 min, max;
 };
 
+// The GPU copy of the triangles is split in two streams. Traversal reads the
+// intersection record on every leaf test and the shading record only once the
+// closest hit is known. The bounds stay on the CPU for the builders.
+struct TriangleIntersection {
+	glm::vec4 posA, posB, posC;
+};
+
+// Intersection record precomputed from the positions: the rows of the affine
+// transform that maps the triangle onto the unit triangle (Woop). In that
+// space the ray hits at z = 0 with the barycentrics of B and C in x and y,
+// so the test needs no edges or cross products. Also 48 bytes.
+struct WoopTriangle {
+	glm::vec4 rowX, rowY, rowZ;
+
+	// Inverse of [B - A, C - A, normal, A], in double precision. Degenerate
+	// triangles keep zero rows, which no ray hits.
+	static WoopTriangle fromPositions(const glm::vec4& pA, const glm::vec4& pB, const glm::vec4& pC) {
+		glm::dvec3 posA(pA.x, pA.y, pA.z);
+		glm::dvec3 edgeAB = glm::dvec3(pB.x, pB.y, pB.z) - posA;
+		glm::dvec3 edgeAC = glm::dvec3(pC.x, pC.y, pC.z) - posA;
+		glm::dvec3 normal = glm::cross(edgeAB, edgeAC);
+		double determinant = glm::dot(normal, normal);
+		if (determinant == 0.0) return WoopTriangle{};
+
+		auto row = [&](const glm::dvec3& pRow) {
+			return glm::vec4((float)pRow.x, (float)pRow.y, (float)pRow.z, (float)-glm::dot(pRow, posA));
+		};
+		return WoopTriangle{ row(glm::cross(edgeAC, normal) / determinant), row(glm::cross(normal, edgeAB) / determinant), row(normal / determinant) };
+	}
+};
+
+// The material index fills the fourth component after normalC, as the vec3
+// and int of the shader pack in std140. normalC is three floats since the
+// aligned glm::vec3 takes 16 bytes.
+struct TriangleShading {
+	glm::vec4 normalA, normalB;
+	float normalC[3];
+	int materialIndex;
+};
+
+// Indexed geometry: a corner shared by the triangles of a closed mesh, the
+// position and normal pairs of the model without repeats
+struct Vertex {
+	glm::vec4 position, normal;
+};
+
+// Replaces both records of a triangle when indexed, 16 bytes instead of 96
+struct IndexedTriangle {
+	uint32_t vertexA, vertexB, vertexC;
+	int materialIndex;
+};
+
+// Replaces the shading record when compressed: octahedral normals and the
+// material index, 16 bytes instead of 48
+struct CompressedShading {
+	uint32_t normalA, normalB, normalC;
+	int materialIndex;
+};
+
+// Largest differences between the compressed attributes and the triangles
+struct CompressionError {
+	float maxNormalAngle = 0.0f; // degrees
+	float maxPositionError = 0.0f;
+	float meanPositionError = 0.0f;
+	float minBlockStep = 0.0f; // coarsest axis of the finest block
+	float maxBlockStep = 0.0f; // coarsest axis of the coarsest block
+	float sceneExtent = 0.0f;
+};
+
+struct TriangleStreams {
+	std::vector<TriangleIntersection> intersection;
+	std::vector<WoopTriangle> woopIntersection;
+	std::vector<TriangleShading> shading;
+	bool woop = false; // Woop records replace the positions of intersection
+
+	// With indexed set the GPU reads the triangles through their indices into
+	// vertices, in place of the intersection and shading records
+	std::vector<IndexedTriangle> indexedTriangles;
+	std::vector<Vertex> vertices;
+	bool indexed = false;
+
+	// With compressed set both records use the encoding of AttributeCompression.h,
+	// the intersection stream in blocks of COMPRESSED_BLOCK_WORDS
+	std::vector<uint32_t> compressedIntersection;
+	std::vector<CompressedShading> compressedShading;
+	bool compressed = false;
+
+	// Power of two step per axis of every block. Updates of some triangles
+	// keep the steps of their blocks unless one outgrows them.
+	std::vector<glm::vec3> compressedSteps;
+	// Error of the last update of all triangles against the positions before
+	// they were snapped
+	CompressionError compressedError;
+
+	// What the GPU reads on leaf tests, intersectionSize bytes
+	const void* intersectionData() const {
+		if (indexed) return indexedTriangles.data();
+		if (compressed) return compressedIntersection.data();
+		return woop ? static_cast<const void*>(woopIntersection.data()) : static_cast<const void*>(intersection.data());
+	}
+
+	// Bytes of the intersection stream of pCount triangles
+	size_t intersectionSize(size_t pCount) const {
+		if (compressed) return sizeof(uint32_t) * COMPRESSED_BLOCK_WORDS * ((pCount + COMPRESSED_BLOCK_SIZE - 1) / COMPRESSED_BLOCK_SIZE);
+		return (indexed ? sizeof(IndexedTriangle) : sizeof(TriangleIntersection)) * pCount;
+	}
+
+	// What the GPU reads for the closest hit
+	const void* shadingData() const {
+		if (indexed) return vertices.data();
+		return compressed ? static_cast<const void*>(compressedShading.data()) : static_cast<const void*>(shading.data());
+	}
+
+	size_t shadingSize() const {
+		if (indexed) return sizeof(Vertex) * vertices.size();
+		return compressed ? sizeof(CompressedShading) * compressedShading.size() : sizeof(TriangleShading) * shading.size();
+	}
+
+	// Converts the triangles [pFirst, pFirst + pCount) and keeps the streams
+	// as long as pTriangles. Indexed, the corners of the triangles are written
+	// back to the vertices, so a refit moves every triangle sharing them.
+	// Compressed, the corners are snapped to what their blocks decode them to,
+	// so bounds fitted to pTriangles hold what the GPU intersects, and the
+	// blocks are quantized again. Returns true if a block outgrew its steps and
+	// every triangle was snapped and quantized again, the BVH then needs a
+	// refit of all of its bounds.
+	bool update(std::vector<Triangle>& pTriangles, int pFirst, int pCount) {
+		if (indexed) {
+			indexedTriangles.resize(pTriangles.size());
+			for (int i = pFirst; i < pFirst + pCount; i++) {
+				const Triangle& tri = pTriangles[i];
+				indexedTriangles[i] = IndexedTriangle{ tri.vertexIndices[0], tri.vertexIndices[1], tri.vertexIndices[2], tri.materialIndex };
+				vertices[tri.vertexIndices[0]].position = tri.posA;
+				vertices[tri.vertexIndices[1]].position = tri.posB;
+				vertices[tri.vertexIndices[2]].position = tri.posC;
+			}
+			return false;
+		}
+
+		if (compressed) {
+			int triangleCount = (int)pTriangles.size();
+			int blockCount = (triangleCount + COMPRESSED_BLOCK_SIZE - 1) / COMPRESSED_BLOCK_SIZE;
+			compressedIntersection.resize((size_t)blockCount * COMPRESSED_BLOCK_WORDS);
+			compressedShading.resize(pTriangles.size());
+			compressedSteps.resize(blockCount, glm::vec3(0.0f));
+			if (pCount <= 0) return false;
+
+			// All triangles start over from the finest steps. When an edit
+			// outgrows the steps of a block, the block takes coarser steps and
+			// every corner is snapped again, as a corner it shares with other
+			// blocks has to move in all of them.
+			bool allTriangles = pFirst == 0 && pCount == triangleCount;
+			bool resnapped = allTriangles || !snapToCompressedSteps(pTriangles, pFirst, pFirst + pCount, false);
+			if (resnapped) {
+				std::vector<Triangle> original;
+				if (allTriangles) {
+					original = pTriangles;
+					std::fill(compressedSteps.begin(), compressedSteps.end(), glm::vec3(0.0f));
+				}
+				snapToCompressedSteps(pTriangles, 0, triangleCount, true);
+				for (int block = 0; block < blockCount; block++) {
+					compressBlock(pTriangles, block);
+				}
+				if (allTriangles) {
+					encodeShading(pTriangles, 0, triangleCount);
+					compressedError = compressionError(original);
+					return true;
+				}
+			}
+			else {
+				for (int block = pFirst / COMPRESSED_BLOCK_SIZE; block <= (pFirst + pCount - 1) / COMPRESSED_BLOCK_SIZE; block++) {
+					compressBlock(pTriangles, block);
+				}
+			}
+			encodeShading(pTriangles, pFirst, pCount);
+			return resnapped;
+		}
+
+		intersection.resize(pTriangles.size());
+		woopIntersection.resize(woop ? pTriangles.size() : 0);
+		shading.resize(pTriangles.size());
+		for (int i = pFirst; i < pFirst + pCount; i++) {
+			const Triangle& tri = pTriangles[i];
+			intersection[i] = TriangleIntersection{ tri.posA, tri.posB, tri.posC };
+			if (woop) {
+				woopIntersection[i] = WoopTriangle::fromPositions(tri.posA, tri.posB, tri.posC);
+			}
+			shading[i] = TriangleShading{ tri.normalA, tri.normalB, { tri.normalC.x, tri.normalC.y, tri.normalC.z }, tri.materialIndex };
+		}
+		return false;
+	}
+
+	bool update(std::vector<Triangle>& pTriangles) {
+		return update(pTriangles, 0, (int)pTriangles.size());
+	}
+
+	void blockBounds(const std::vector<Triangle>& pTriangles, int pBlock, glm::vec3& pMin, glm::vec3& pMax) const {
+		int first = pBlock * COMPRESSED_BLOCK_SIZE;
+		int end = std::min(first + COMPRESSED_BLOCK_SIZE, (int)pTriangles.size());
+
+		pMin = glm::vec3(std::numeric_limits<float>::max());
+		pMax = glm::vec3(-std::numeric_limits<float>::max());
+		for (int i = first; i < end; i++) {
+			const Triangle& tri = pTriangles[i];
+			pMin = glm::min(glm::min(pMin, glm::vec3(tri.posA)), glm::min(glm::vec3(tri.posB), glm::vec3(tri.posC)));
+			pMax = glm::max(glm::max(pMax, glm::vec3(tri.posA)), glm::max(glm::vec3(tri.posB), glm::vec3(tri.posC)));
+		}
+	}
+
+	// Snaps the corners of the triangles [pFirst, pEnd) to the steps of their
+	// blocks, a corner found in several blocks to the coarsest of their steps.
+	// Blocks without steps yet, or all of them with pGrow, take coarser steps
+	// until their snapped corners fit. Returns false, with the positions left
+	// as they were, if another block would need coarser steps.
+	bool snapToCompressedSteps(std::vector<Triangle>& pTriangles, int pFirst, int pEnd, bool pGrow) {
+		int firstBlock = pFirst / COMPRESSED_BLOCK_SIZE;
+		int endBlock = (pEnd - 1) / COMPRESSED_BLOCK_SIZE + 1;
+		std::vector<Triangle> original(pTriangles.begin() + pFirst, pTriangles.begin() + pEnd);
+
+		std::vector<bool> growing(endBlock - firstBlock);
+		for (int block = firstBlock; block < endBlock; block++) {
+			growing[block - firstBlock] = pGrow || compressedSteps[block].x == 0.0f;
+			if (growing[block - firstBlock]) {
+				glm::vec3 boundsMin, boundsMax;
+				blockBounds(pTriangles, block, boundsMin, boundsMax);
+				compressedSteps[block] = glm::max(compressedSteps[block], compressedBlockStep(boundsMin, boundsMax));
+			}
+		}
+
+		// Corners of equal position share an entry of cornerSteps
+		std::vector<int> corners;
+		int cornerCount = numberCorners(original, corners);
+		std::vector<glm::vec3> cornerSteps;
+
+		while (true) {
+			cornerSteps.assign(cornerCount, glm::vec3(0.0f));
+			for (size_t i = 0; i < corners.size(); i++) {
+				glm::vec3& step = cornerSteps[corners[i]];
+				step = glm::max(step, compressedSteps[(pFirst + i / 3) / COMPRESSED_BLOCK_SIZE]);
+			}
+
+			for (int i = pFirst; i < pEnd; i++) {
+				const Triangle& source = original[i - pFirst];
+				Triangle& tri = pTriangles[i];
+				glm::vec4* positions[3] = { &tri.posA, &tri.posB, &tri.posC };
+				const glm::vec4* sourcePositions[3] = { &source.posA, &source.posB, &source.posC };
+				for (int corner = 0; corner < 3; corner++) {
+					const glm::vec3& step = cornerSteps[corners[3 * (i - pFirst) + corner]];
+					for (int axis = 0; axis < 3; axis++) {
+						(*positions[corner])[axis] = std::round((*sourcePositions[corner])[axis] / step[axis]) * step[axis];
+					}
+				}
+				tri.min = glm::min(tri.posA, glm::min(tri.posB, tri.posC));
+				tri.max = glm::max(tri.posA, glm::max(tri.posB, tri.posC));
+			}
+
+			// Rounding to a shared coarser step can widen a block past its own
+			bool grown = false;
+			for (int block = firstBlock; block < endBlock; block++) {
+				glm::vec3 boundsMin, boundsMax;
+				blockBounds(pTriangles, block, boundsMin, boundsMax);
+				glm::vec3 step = compressedBlockStep(boundsMin, boundsMax);
+				if (glm::all(glm::lessThanEqual(step, compressedSteps[block]))) continue;
+
+				if (!growing[block - firstBlock]) {
+					std::copy(original.begin(), original.end(), pTriangles.begin() + pFirst);
+					return false;
+				}
+				compressedSteps[block] = glm::max(compressedSteps[block], step);
+				grown = true;
+			}
+			if (!grown) return true;
+		}
+	}
+
+	// Numbers the distinct positions of the corners, corner c of triangle i
+	// gets pCorners[3 * i + c], and returns how many there are. Open addressing
+	// on the bits of the positions, a std::unordered_map spends most of its
+	// time allocating nodes.
+	static int numberCorners(const std::vector<Triangle>& pTriangles, std::vector<int>& pCorners) {
+		auto position = [&](size_t pCorner) -> const glm::vec4& {
+			const Triangle& tri = pTriangles[pCorner / 3];
+			return pCorner % 3 == 0 ? tri.posA : pCorner % 3 == 1 ? tri.posB : tri.posC;
+		};
+
+		size_t capacity = 1;
+		while (capacity < 6 * pTriangles.size()) capacity <<= 1;
+		std::vector<int> slots(capacity, -1);
+		std::vector<size_t> firstCorners;
+		pCorners.resize(3 * pTriangles.size());
+
+		for (size_t corner = 0; corner < pCorners.size(); corner++) {
+			const glm::vec4& pos = position(corner);
+			uint32_t bits[3];
+			std::memcpy(bits, &pos, sizeof(bits));
+			uint64_t hash = bits[0] * 0x9E3779B97F4A7C15ull ^ bits[1] * 0xC2B2AE3D27D4EB4Full ^ bits[2] * 0x165667B19E3779F9ull;
+			size_t slot = (hash ^ hash >> 29) & (capacity - 1);
+
+			while (slots[slot] >= 0 && std::memcmp(&position(firstCorners[slots[slot]]), &pos, sizeof(bits)) != 0) {
+				slot = (slot + 1) & (capacity - 1);
+			}
+			if (slots[slot] < 0) {
+				slots[slot] = (int)firstCorners.size();
+				firstCorners.push_back(corner);
+			}
+			pCorners[corner] = slots[slot];
+		}
+		return (int)firstCorners.size();
+	}
+
+	void compressBlock(const std::vector<Triangle>& pTriangles, int pBlock) {
+		int first = pBlock * COMPRESSED_BLOCK_SIZE;
+		int end = std::min(first + COMPRESSED_BLOCK_SIZE, (int)pTriangles.size());
+
+		glm::vec3 boundsMin, boundsMax;
+		blockBounds(pTriangles, pBlock, boundsMin, boundsMax);
+
+		uint32_t* block = &compressedIntersection[(size_t)pBlock * COMPRESSED_BLOCK_WORDS];
+		writeCompressedHeader(block, boundsMin, compressedSteps[pBlock]);
+		for (int i = first; i < end; i++) {
+			glm::vec3 corners[3] = { glm::vec3(pTriangles[i].posA), glm::vec3(pTriangles[i].posB), glm::vec3(pTriangles[i].posC) };
+			writeCompressedTriangle(block, i - first, corners);
+		}
+	}
+
+	void encodeShading(const std::vector<Triangle>& pTriangles, int pFirst, int pCount) {
+		for (int i = pFirst; i < pFirst + pCount; i++) {
+			const Triangle& tri = pTriangles[i];
+			compressedShading[i] = CompressedShading{ encodeOctahedral(tri.normalA), encodeOctahedral(tri.normalB), encodeOctahedral(tri.normalC), tri.materialIndex };
+		}
+	}
+
+	// Decodes the compressed streams and compares them with pTriangles, the
+	// triangles they were built from
+	CompressionError compressionError(const std::vector<Triangle>& pTriangles) const {
+		CompressionError error;
+		if (!compressed || pTriangles.empty()) return error;
+
+		double positionErrorSum = 0.0;
+		glm::vec3 sceneMin(std::numeric_limits<float>::max());
+		glm::vec3 sceneMax(-std::numeric_limits<float>::max());
+		for (size_t i = 0; i < pTriangles.size(); i++) {
+			const Triangle& tri = pTriangles[i];
+			const uint32_t* block = &compressedIntersection[i / COMPRESSED_BLOCK_SIZE * COMPRESSED_BLOCK_WORDS];
+			glm::vec3 corners[3];
+			readCompressedTriangle(block, (int)(i % COMPRESSED_BLOCK_SIZE), corners);
+
+			const glm::vec4* positions[3] = { &tri.posA, &tri.posB, &tri.posC };
+			const glm::vec4* normals[3] = { &tri.normalA, &tri.normalB, &tri.normalC };
+			const uint32_t encodedNormals[3] = { compressedShading[i].normalA, compressedShading[i].normalB, compressedShading[i].normalC };
+			for (int corner = 0; corner < 3; corner++) {
+				sceneMin = glm::min(sceneMin, glm::vec3(*positions[corner]));
+				sceneMax = glm::max(sceneMax, glm::vec3(*positions[corner]));
+				float positionError = glm::length(corners[corner] - glm::vec3(*positions[corner]));
+				error.maxPositionError = std::max(error.maxPositionError, positionError);
+				positionErrorSum += positionError;
+
+				glm::vec3 normal(*normals[corner]);
+				if (glm::dot(normal, normal) == 0.0f) continue;
+				float cosine = glm::clamp(glm::dot(glm::normalize(normal), decodeOctahedral(encodedNormals[corner])), -1.0f, 1.0f);
+				error.maxNormalAngle = std::max(error.maxNormalAngle, glm::degrees(std::acos(cosine)));
+			}
+
+			if (i % COMPRESSED_BLOCK_SIZE == 0) {
+				float header[COMPRESSED_HEADER_WORDS];
+				std::memcpy(header, block, sizeof(header));
+				float step = std::max(std::max(header[3], header[4]), header[5]);
+				error.minBlockStep = i == 0 ? step : std::min(error.minBlockStep, step);
+				error.maxBlockStep = std::max(error.maxBlockStep, step);
+			}
+		}
+		error.meanPositionError = (float)(positionErrorSum / (3.0 * pTriangles.size()));
+		glm::vec3 sceneSize = sceneMax - sceneMin;
+		error.sceneExtent = std::max(std::max(sceneSize.x, sceneSize.y), sceneSize.z);
+		return error;
+	}
+};
+
 struct MeshInfo {
 	glm::vec4 info;
 	Material material;
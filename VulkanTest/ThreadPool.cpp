@@ -0,0 +1,92 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int pNumThreads) {
+	int numThreads = pNumThreads > 0 ? pNumThreads : (int)std::thread::hardware_concurrency();
+
+	// The calling thread helps while it waits, so it counts as one of the threads
+	for (int i = 1; i < numThreads; i++) {
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(tasksMutex);
+		stopping = true;
+	}
+	tasksAvailable.notify_all();
+
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+int ThreadPool::size() const {
+	return (int)workers.size() + 1;
+}
+
+void ThreadPool::run(TaskGroup& pGroup, std::function<void()> pTask) {
+	pGroup.pending++;
+
+	if (workers.empty()) {
+		pTask();
+		pGroup.pending--;
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(tasksMutex);
+		tasks.push_back({ std::move(pTask), &pGroup });
+	}
+	tasksAvailable.notify_one();
+}
+
+void ThreadPool::wait(TaskGroup& pGroup) {
+	while (pGroup.pending > 0) {
+		if (!runPendingTask()) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void ThreadPool::parallelFor(int pCount, const std::function<void(int)>& pFunction) {
+	TaskGroup group;
+	for (int i = 0; i < pCount; i++) {
+		run(group, [&pFunction, i]() { pFunction(i); });
+	}
+	wait(group);
+}
+
+bool ThreadPool::runPendingTask() {
+	Task task;
+	{
+		std::lock_guard<std::mutex> lock(tasksMutex);
+		if (tasks.empty()) return false;
+
+		// Newest first, so a waiting thread keeps working on its own subtree
+		task = std::move(tasks.back());
+		tasks.pop_back();
+	}
+
+	task.function();
+	task.group->pending--;
+	return true;
+}
+
+void ThreadPool::workerLoop() {
+	while (true) {
+		Task task;
+		{
+			std::unique_lock<std::mutex> lock(tasksMutex);
+			tasksAvailable.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (stopping && tasks.empty()) return;
+
+			// Oldest first, those are the largest subtrees
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+
+		task.function();
+		task.group->pending--;
+	}
+}
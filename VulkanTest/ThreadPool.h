@@ -0,0 +1,42 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct TaskGroup {
+	std::atomic<int> pending{ 0 };
+};
+
+class ThreadPool {
+public:
+	explicit ThreadPool(int pNumThreads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int size() const;
+
+	void run(TaskGroup& pGroup, std::function<void()> pTask);
+	void wait(TaskGroup& pGroup);
+	void parallelFor(int pCount, const std::function<void(int)>& pFunction);
+
+private:
+	struct Task {
+		std::function<void()> function;
+		TaskGroup* group;
+	};
+
+	std::vector<std::thread> workers;
+	std::deque<Task> tasks;
+	std::mutex tasksMutex;
+	std::condition_variable tasksAvailable;
+	bool stopping = false;
+
+	bool runPendingTask();
+	void workerLoop();
+};
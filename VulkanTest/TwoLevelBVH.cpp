@@ -0,0 +1,156 @@
+#include "TwoLevelBVH.h"
+#include <algorithm>
+#include <stdexcept>
+
+static void storeRows(const glm::mat4& pMatrix, glm::vec4* pRows) {
+	for (int row = 0; row < 3; row++) {
+		pRows[row] = glm::vec4(pMatrix[0][row], pMatrix[1][row], pMatrix[2][row], pMatrix[3][row]);
+	}
+}
+
+static BoundingBox transformBounds(const BoundingBox& pBounds, const glm::mat4& pTransform) {
+	BoundingBox bounds;
+	for (int corner = 0; corner < 8; corner++) {
+		glm::vec3 point((corner & 1) ? pBounds.boundsMax.x : pBounds.boundsMin.x,
+			(corner & 2) ? pBounds.boundsMax.y : pBounds.boundsMin.y,
+			(corner & 4) ? pBounds.boundsMax.z : pBounds.boundsMin.z);
+		bounds.growToInclude(glm::vec3(pTransform * glm::vec4(point, 1.0f)));
+	}
+	return bounds;
+}
+
+void TwoLevelBVH::buildBottomLevels(std::vector<Triangle>& pTriangles, std::vector<MeshInfo>& pMeshes, int pMaxInstances) {
+	// The shader walks both levels with the binary layout
+	BVHSettings meshSettings = settings;
+	meshSettings.width = 2;
+	meshSettings.quantized = false;
+	meshSettings.childBounds = false;
+
+	topLevelCapacity = std::max(1, 2 * pMaxInstances - 1);
+	nodes.assign(topLevelCapacity, Node{ {}, 0, 0, 0 });
+	meshLevels.clear();
+	instanceMeshes.clear();
+	instanceTransforms.clear();
+	instances.clear();
+
+	// Every mesh keeps its triangles together, in the leaf order of its own BVH
+	std::vector<Triangle> ordered;
+	ordered.reserve(pTriangles.size());
+
+	for (MeshInfo& mesh : pMeshes) {
+		int first = (int)mesh.info.x;
+		int count = (int)mesh.info.y;
+		std::vector<Triangle> meshTriangles(pTriangles.begin() + first, pTriangles.begin() + first + count);
+
+		BVH meshBVH;
+		meshBVH.settings = meshSettings;
+		meshBVH.build(meshTriangles);
+
+		int nodeOffset = (int)nodes.size();
+		int triangleOffset = (int)ordered.size();
+		for (Node node : meshBVH.nodes) {
+			if (node.childIndex != 0) node.childIndex += nodeOffset;
+			node.triangleIndex += triangleOffset;
+			nodes.push_back(node);
+		}
+		meshLevels.push_back(MeshLevel{ nodeOffset, meshBVH.nodes[0].bounds });
+
+		ordered.insert(ordered.end(), meshTriangles.begin(), meshTriangles.end());
+		mesh.info.x = (float)triangleOffset;
+		mesh.info.y = (float)meshTriangles.size();
+	}
+
+	pTriangles.swap(ordered);
+}
+
+int TwoLevelBVH::addInstance(int pMesh, const glm::mat4& pTransform) {
+	if ((int)instanceMeshes.size() * 2 + 1 > topLevelCapacity) {
+		throw std::runtime_error("too many BVH instances for the reserved top level!");
+	}
+
+	instanceMeshes.push_back(pMesh);
+	instanceTransforms.push_back(pTransform);
+	return (int)instanceMeshes.size() - 1;
+}
+
+void TwoLevelBVH::setTransform(int pInstance, const glm::mat4& pTransform) {
+	instanceTransforms[pInstance] = pTransform;
+}
+
+glm::mat4 TwoLevelBVH::transform(int pInstance) const {
+	return instanceTransforms[pInstance];
+}
+
+void TwoLevelBVH::buildTopLevel() {
+	std::vector<BoundingBox> instanceBounds(instanceMeshes.size());
+	for (size_t i = 0; i < instanceMeshes.size(); i++) {
+		instanceBounds[i] = transformBounds(meshLevels[instanceMeshes[i]].bounds, instanceTransforms[i]);
+	}
+
+	BVH topLevel;
+	topLevel.settings = settings;
+	topLevel.settings.width = 2;
+	topLevel.settings.quantized = false;
+	topLevel.settings.childBounds = false;
+
+	std::vector<int> order;
+	topLevel.build(instanceBounds, order);
+	topLevelStats = topLevel.stats;
+
+	std::copy(topLevel.nodes.begin(), topLevel.nodes.end(), nodes.begin());
+
+	// Top level leaves index the instances in leaf order
+	instances.resize(order.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		Instance& instance = instances[i];
+		storeRows(instanceTransforms[order[i]], instance.objectToWorld);
+		storeRows(glm::inverse(instanceTransforms[order[i]]), instance.worldToObject);
+		instance.rootIndex = meshLevels[instanceMeshes[order[i]]].rootIndex;
+	}
+}
+
+// Fits the mesh nodes to moved triangles, children before their parents,
+// then rebuilds the top level over the new mesh bounds
+void TwoLevelBVH::refitBottomLevels(const std::vector<Triangle>& pTriangles) {
+	std::vector<int> order;
+	for (MeshLevel& level : meshLevels) {
+		order.assign(1, level.rootIndex);
+		for (size_t i = 0; i < order.size(); i++) {
+			const Node& node = nodes[order[i]];
+			if (node.childIndex != 0) {
+				order.push_back(node.childIndex);
+				order.push_back(node.childIndex + 1);
+			}
+		}
+
+		for (auto it = order.rbegin(); it != order.rend(); ++it) {
+			Node& node = nodes[*it];
+			BoundingBox bounds;
+			if (node.childIndex == 0) {
+				for (int i = node.triangleIndex; i < node.triangleIndex + node.triangleCount; i++) {
+					bounds.growToInclude(glm::vec3(pTriangles[i].posA));
+					bounds.growToInclude(glm::vec3(pTriangles[i].posB));
+					bounds.growToInclude(glm::vec3(pTriangles[i].posC));
+				}
+			}
+			else {
+				bounds = nodes[node.childIndex].bounds;
+				bounds.growToInclude(nodes[node.childIndex + 1].bounds);
+			}
+			node.bounds = bounds;
+		}
+		level.bounds = nodes[level.rootIndex].bounds;
+	}
+
+	if (!instanceMeshes.empty()) {
+		buildTopLevel();
+	}
+}
+
+int TwoLevelBVH::topLevelSize() const {
+	return topLevelCapacity;
+}
+
+BoundingBox TwoLevelBVH::meshBounds(int pMesh) const {
+	return meshLevels[pMesh].bounds;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+#include "Shapes.h"
+#include "Node.h"
+#include "BVH.h"
+
+// Transformed reference to the bottom level BVH of one mesh. The transforms
+// are the rows of 3x4 matrices.
+struct Instance {
+	glm::vec4 objectToWorld[3];
+	glm::vec4 worldToObject[3];
+	int rootIndex;
+	int padding[3];
+};
+
+// A bottom level BVH per mesh and a top level BVH over the instances placed
+// in the scene. Everything shares one node array: the region reserved for the
+// top level comes first so it can be rebuilt without moving the meshes.
+class TwoLevelBVH {
+public:
+	BVHSettings settings;
+	BVHBuildStats topLevelStats;
+	std::vector<Node> nodes;
+	std::vector<Instance> instances;
+
+	void buildBottomLevels(std::vector<Triangle>& pTriangles, std::vector<MeshInfo>& pMeshes, int pMaxInstances);
+	int addInstance(int pMesh, const glm::mat4& pTransform);
+	void setTransform(int pInstance, const glm::mat4& pTransform);
+	glm::mat4 transform(int pInstance) const;
+	void buildTopLevel();
+	void refitBottomLevels(const std::vector<Triangle>& pTriangles);
+	int topLevelSize() const;
+	BoundingBox meshBounds(int pMesh) const;
+
+private:
+	struct MeshLevel {
+		int rootIndex;
+		BoundingBox bounds;
+	};
+
+	std::vector<MeshLevel> meshLevels;
+	std::vector<int> instanceMeshes;
+	std::vector<glm::mat4> instanceTransforms;
+	int topLevelCapacity = 0;
+};
@@ -20,13 +20,20 @@
 #include <array>
 #include <optional>
 #include <set>
+#include <unordered_map>
 #include <random>
 #include <filesystem>
+#include <thread>
+#include <atomic>
 #define NOMINMAX
 #include <windows.h>
+#include <psapi.h>
 #include "Shapes.h"
 #include "BoundingBox.h"
 #include "Node.h"
+#include "BVH.h"
+#include "TwoLevelBVH.h"
+#include "BVHCalibration.h"
 
 const uint32_t WIDTH = 1280;
 const uint32_t HEIGHT = 720;
@@ -34,9 +41,114 @@ const uint32_t HEIGHT = 720;
 std::string MODEL_PATH;
 std::string EXE_PATH;
 
+BVHSettings bvhSettings;
+
+// Copies of the model placed on a grid, 0 renders the model once without a
+// top level BVH
+int bvhInstances = 0;
+
+// Print a quality report after building, casting this many sampled rays on the CPU
+bool bvhStatsEnabled = false;
+int bvhStatsRays = 10000;
+
+// Time the CPU traversal of the same sampled rays with every node layout
+bool bvhLayoutBenchmark = false;
+
+// Build only the top of the BVH on the background thread of bvhPreview, cast
+// the sampled rays through it and let them build the subtrees they reach. The
+// GPU renders the preview until completeLazy has built the rest.
+bool bvhLazy = false;
+
+// Render with a quick LBVH first and swap in the tree of bvhSettings once a
+// background thread has built it
+bool bvhPreview = false;
+
+// Build a binary LBVH with gpubuild.comp, straight into the buffers the
+// shader reads, instead of building on the CPU and uploading the tree
+bool bvhGpuBuild = false;
+
+// Upload the triangles as precomputed Woop records instead of positions
+bool bvhWoopTriangles = false;
+
+// Upload the shared vertices of the model and one index record per triangle
+// instead of the positions and normals of every corner
+bool bvhIndexedTriangles = false;
+
+// Upload the positions quantized to 16 bits in blocks of triangles and the
+// normals octahedral encoded, see AttributeCompression.h
+bool bvhCompressedTriangles = false;
+
+// Time the triangle test on positions and on Woop records, on the CPU and GPU
+bool bvhTriangleBenchmark = false;
+
+// Mesh of the model moved up and down every frame, the BVH is refitted around
+// it instead of rebuilt. -1 keeps the scene still. The refit runs on the GPU
+// when refit.comp can take the tree, unless bvhRefitOnCpu is set.
+int bvhRefitAnimateMesh = -1;
+bool bvhRefitOnCpu = false;
+
+// Mesh of the model inserted as a shifted copy and removed again once the
+// scene is up, checking the edited BVH against full rebuilds. -1 skips it.
+int bvhEditDemoMesh = -1;
+
+// Instance of the --bvh-instances grid moved up and down every frame with
+// moveInstance. -1 keeps the instances still.
+int bvhInstanceAnimate = -1;
+
+const char* BVH_LAYOUT_NAMES[] = { "build", "dfs", "bfs", "veb", "treelet" };
+
+// Backend whose measured costs drive the SAH, "cpu", "gpu" or "none". The
+// profile saved for the device is used unless --bvh-calibrate measures it again.
+std::string bvhCostBackend = "gpu";
+bool bvhCalibrate = false;
+const char* BVH_COST_PROFILE_FILE = "bvh_costs.txt";
+
+// Set from the command line, negative values keep the profile's
+float bvhTraversalCost = -1.0f;
+int bvhMaxLeafSize = -1;
+
+// Rays and primitives of the GPU calibration dispatch
+const int GPU_CALIBRATION_RAYS = 65536;
+const int GPU_CALIBRATION_PRIMITIVES = 4096;
+
+struct CalibrationConstants {
+    int32_t mode;
+    int32_t count;
+    int32_t padding[2];
+    glm::vec4 sceneMin;
+    glm::vec4 sceneMax;
+};
+
+// Stages of gpubuild.comp, one dispatch each. The radix sort runs its three
+// stages once per 4 bit digit, an even number of passes leaves the codes in
+// the first half of the scratch buffer.
+enum GPUBuildStage {
+    GPU_BUILD_CENTROID_BOUNDS,
+    GPU_BUILD_MORTON_CODES,
+    GPU_BUILD_COUNT_DIGITS,
+    GPU_BUILD_SCAN_DIGITS,
+    GPU_BUILD_SCATTER_DIGITS,
+    GPU_BUILD_HIERARCHY,
+    GPU_BUILD_FIT_BOUNDS,
+    GPU_BUILD_COLLAPSE
+};
+const int GPU_BUILD_GROUP_SIZE = 128;
+const int GPU_BUILD_RADIX_PASSES = 8;
+const int GPU_BUILD_HEADER_SIZE = 8;
+
+struct GPUBuildConstants {
+    int32_t stage;
+    int32_t count;
+    int32_t pass;
+    int32_t blockCount;
+    int32_t maxDepth;
+};
+
 
 const int MAX_FRAMES_IN_FLIGHT = 2;
-const int MAX_DEPTH = 32; 
+
+// Spare capacity of the triangle and node buffers for meshes inserted at runtime
+const float SCENE_EDIT_HEADROOM = 0.25f;
 
 bool firstMouse = true;
 float yaw = -90.0f;
@@ -48,6 +160,11 @@ float fov = 45.0f;
 bool pressedP = false;
 bool wasPPressed = false;
 
+// M makes the material of this mesh glow, through setMaterial
+int highlightMaterial = 0;
+bool pressedM = false;
+bool wasMPressed = false;
+
 const std::vector<const char*> validationLayers = {
     "VK_LAYER_KHRONOS_validation"
 };
@@ -146,26 +263,90 @@ private:
     VkPipelineLayout computePipelineLayout;
     VkPipeline computePipeline;
 
+    VkDescriptorSetLayout refitDescriptorSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout refitPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline refitPipeline = VK_NULL_HANDLE;
+    VkDescriptorSet refitDescriptorSet;
+    VkBuffer refitOrderBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory refitOrderBufferMemory = VK_NULL_HANDLE;
+    std::vector<int> refitLevelOffsets;
+    bool refitOrderStale = false;
+    // The GPU refit leaves the bounds of bvh.nodes behind, they are refitted
+    // on the CPU before the next edit
+    bool refitOnGpuOnly = false;
+    bool rebuildReported = false;
+
+    // --bvh-refit-animate: the runs of the animated mesh's triangles in leaf
+    // order and their positions at rest
+    std::vector<BVHRange> animatedRanges;
+    std::vector<Triangle> animatedRest;
+    float animationAmplitude = 0.0f;
+    int animatedFrames = 0;
+
+    // The M key highlight, see toggleHighlight
+    bool materialHighlighted = false;
+    Material highlightedOriginal{};
+
+    // Set by moveInstance until the next compute command buffer uploads the
+    // rebuilt top level
+    bool topLevelDirty = false;
+    glm::mat4 animatedInstanceRest{ 1.0f };
+    float instanceAmplitude = 0.0f;
+    int animatedInstanceFrames = 0;
+
+    // Two-phase build: the final tree, built on a background thread while the
+    // preview renders, with its data already copied to staging buffers
+    std::thread finalBVHThread;
+    std::atomic<bool> finalBVHReady{ false };
+    std::exception_ptr finalBVHError;
+    BVH finalBVH;
+    std::vector<Triangle> finalTriangles;
+    TriangleStreams finalTriangleStreams;
+    std::array<VkBuffer, 3> finalStagingBuffers = { VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE };
+    std::array<VkDeviceMemory, 3> finalStagingMemory = { VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE };
+    std::array<int32_t, 8> computeSpecialization{};
+
     VkCommandPool commandPool;
 
     VkDescriptorSetLayout graphicsDescriptorSetLayout;
 
     std::vector<Triangle> triangles;
     std::vector<MeshInfo> meshes;
-    std::vector<Node*> allNodes;
+    // Indexed by Triangle::materialIndex, entries edited with setMaterial are
+    // uploaded by the next compute command buffer
+    std::vector<Material> materialTable;
+    std::vector<int> dirtyMaterials;
+    BVH bvh;
+    TwoLevelBVH instancedBVH;
 
     std::vector<VkBuffer> uniformBuffers;
     std::vector<VkDeviceMemory> uniformBuffersMemory;
     std::vector<void*> uniformBuffersMapped;
 
+    // The intersection stream of the triangles, the shading stream has its own buffer
+    TriangleStreams triangleStreams;
     VkBuffer trianglesBuffer;
     VkDeviceMemory trianglesBufferMemory;
+    VkDeviceSize trianglesBufferSize;
+
+    VkBuffer triangleShadingBuffer;
+    VkDeviceMemory triangleShadingBufferMemory;
+    VkDeviceSize triangleShadingBufferSize;
 
     VkBuffer meshesBuffer;
     VkDeviceMemory meshesBufferMemory;
 
+    VkBuffer materialsBuffer;
+    VkDeviceMemory materialsBufferMemory;
+    VkDeviceSize materialsBufferSize;
+
     VkBuffer nodesBuffer;
     VkDeviceMemory nodesBufferMemory;
+    VkDeviceSize nodesBufferSize;
+
+    VkBuffer instancesBuffer;
+    VkDeviceMemory instancesBufferMemory;
+    VkDeviceSize instancesBufferSize;
 
     VkImage storageImage;
     VkSampler storageImageSampler;
@@ -269,6 +450,15 @@ private:
         else if (pState == GLFW_RELEASE) {
             wasPPressed = false;
         }
+
+        int mState = glfwGetKey(pWindow, GLFW_KEY_M);
+        if (mState == GLFW_PRESS && !wasMPressed) {
+            pressedM = !pressedM;
+            wasMPressed = true;
+        }
+        else if (mState == GLFW_RELEASE) {
+            wasMPressed = false;
+        }
     }
 
     void initVulkan() {
@@ -285,15 +475,17 @@ private:
         createComputeDescriptorSetLayout();
         createGraphicsDescriptorSetLayout();
         createGraphicsPipeline();
-        createComputePipeline();
         createFramebuffers();
         createCommandPool();
         loadModel();
+        applyBVHCostProfile();
         createBVH();
+        createComputePipeline();
         createUniformBuffers();
         createDescriptorPool();
         createComputeDescriptorSets();
         createGraphicsDescriptorSets();
+        createRefitResources();
         createCommandBuffers();
         createComputeCommandBuffers();
         createSyncObjects();
@@ -302,6 +494,19 @@ private:
     void mainLoop() {
         while (!glfwWindowShouldClose(window)) {
             glfwPollEvents();
+            if (bvhRefitAnimateMesh >= 0 && !finalBVHThread.joinable()) {
+                animateRefit();
+            }
+            if (bvhInstanceAnimate >= 0) {
+                animateInstance();
+            }
+            if (bvhEditDemoMesh >= 0 && !finalBVHThread.joinable()) {
+                runEditDemo();
+                bvhEditDemoMesh = -1;
+            }
+            if (pressedM != materialHighlighted) {
+                toggleHighlight();
+            }
             drawFrame();
             processInput(window);
             double currentTime = glfwGetTime();
@@ -325,6 +530,15 @@ private:
     }
 
     void cleanup() {
+        // A final BVH still being built is waited for and never uploaded
+        if (finalBVHThread.joinable()) {
+            finalBVHThread.join();
+        }
+        for (size_t i = 0; i < finalStagingBuffers.size(); i++) {
+            vkDestroyBuffer(device, finalStagingBuffers[i], nullptr);
+            vkFreeMemory(device, finalStagingMemory[i], nullptr);
+        }
+
         cleanupSwapChain();
 
         vkDestroyImageView(device, storageImageView, nullptr);
@@ -335,11 +549,23 @@ private:
         vkDestroyBuffer(device, trianglesBuffer, nullptr);
         vkFreeMemory(device, trianglesBufferMemory, nullptr);
 
+        vkDestroyBuffer(device, triangleShadingBuffer, nullptr);
+        vkFreeMemory(device, triangleShadingBufferMemory, nullptr);
+
         vkDestroyBuffer(device, meshesBuffer, nullptr);
         vkFreeMemory(device, meshesBufferMemory, nullptr);
 
+        vkDestroyBuffer(device, materialsBuffer, nullptr);
+        vkFreeMemory(device, materialsBufferMemory, nullptr);
+
         vkDestroyBuffer(device, nodesBuffer, nullptr);
         vkFreeMemory(device, nodesBufferMemory, nullptr);
+
+        vkDestroyBuffer(device, instancesBuffer, nullptr);
+        vkFreeMemory(device, instancesBufferMemory, nullptr);
+
+        vkDestroyBuffer(device, refitOrderBuffer, nullptr);
+        vkFreeMemory(device, refitOrderBufferMemory, nullptr);
       
 
         for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
@@ -353,12 +579,16 @@ private:
         vkDestroyPipeline(device, computePipeline, nullptr);
         vkDestroyPipelineLayout(device, computePipelineLayout, nullptr);
 
+        vkDestroyPipeline(device, refitPipeline, nullptr);
+        vkDestroyPipelineLayout(device, refitPipelineLayout, nullptr);
+
         vkDestroyRenderPass(device, renderPass, nullptr);
 
         vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 
         vkDestroyDescriptorSetLayout(device, computeDescriptorSetLayout, nullptr);
         vkDestroyDescriptorSetLayout(device, graphicsDescriptorSetLayout, nullptr);
+        vkDestroyDescriptorSetLayout(device, refitDescriptorSetLayout, nullptr);
 
         for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
             vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
@@ -828,7 +1058,7 @@ private:
     }
 
     void createComputeDescriptorSetLayout() {
-        std::array<VkDescriptorSetLayoutBinding, 5> layoutBindings{};
+        std::array<VkDescriptorSetLayoutBinding, 8> layoutBindings{};
 
         layoutBindings[0].binding = 0;
         layoutBindings[0].descriptorCount = 1;
@@ -860,6 +1090,24 @@ private:
         layoutBindings[4].pImmutableSamplers = nullptr;
         layoutBindings[4].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 
+        layoutBindings[5].binding = 5;
+        layoutBindings[5].descriptorCount = 1;
+        layoutBindings[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        layoutBindings[5].pImmutableSamplers = nullptr;
+        layoutBindings[5].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+        layoutBindings[6].binding = 6;
+        layoutBindings[6].descriptorCount = 1;
+        layoutBindings[6].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        layoutBindings[6].pImmutableSamplers = nullptr;
+        layoutBindings[6].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+        layoutBindings[7].binding = 7;
+        layoutBindings[7].descriptorCount = 1;
+        layoutBindings[7].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        layoutBindings[7].pImmutableSamplers = nullptr;
+        layoutBindings[7].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
         VkDescriptorSetLayoutCreateInfo layoutInfo{};
         layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
         layoutInfo.bindingCount = static_cast<uint32_t>(layoutBindings.size());
@@ -1015,6 +1263,36 @@ private:
         vkDestroyShaderModule(device, vertShaderModule, nullptr);
     }
 
+    // The shader's BVH_WIDTH, BVH_STACK_SIZE, BVH_QUANTIZED, BVH_INSTANCED, BVH_CHILD_BOUNDS, TRIANGLE_WOOP, TRIANGLE_INDEXED and TRIANGLE_COMPRESSED
+    std::array<int32_t, 8> bvhSpecializationData() const {
+        int32_t woop = triangleStreams.woop ? 1 : 0;
+        int32_t indexed = triangleStreams.indexed ? 1 : 0;
+        int32_t compressed = triangleStreams.compressed ? 1 : 0;
+        if (!bvh.wideNodes.empty()) {
+            return { bvh.wideWidth(), bvh.wideStackSize(), bvh.quantizedNodes.empty() ? 0 : 1, 0, 1, woop, indexed, compressed };
+        }
+        if (!instancedBVH.instances.empty()) {
+            return { 2, MAX_DEPTH + 1, 0, 1, 0, woop, indexed, compressed };
+        }
+        return { 2, MAX_DEPTH + 1, 0, 0, 0, woop, indexed, compressed };
+    }
+
+    // What binding 4 holds for pBVH, in its most compact format
+    static void getNodeData(const BVH& pBVH, const void*& pData, VkDeviceSize& pSize) {
+        if (!pBVH.quantizedNodes.empty()) {
+            pData = pBVH.quantizedNodes.data();
+            pSize = sizeof(uint32_t) * pBVH.quantizedNodes.size();
+        }
+        else if (!pBVH.wideNodes.empty()) {
+            pData = pBVH.wideNodes.data();
+            pSize = sizeof(WideChild) * pBVH.wideNodes.size();
+        }
+        else {
+            pData = pBVH.nodes.data();
+            pSize = sizeof(Node) * pBVH.nodes.size();
+        }
+    }
+
     void createComputePipeline() {
         auto computeShaderCode = readFile("C:/Users/Bussab/Documents/USP/Codes C++/VulkanTest/VulkanTest/comp.spv");
 
@@ -1026,6 +1304,22 @@ private:
         computeShaderStageInfo.module = computeShaderModule;
         computeShaderStageInfo.pName = "main";
 
+        computeSpecialization = bvhSpecializationData();
+
+        std::array<VkSpecializationMapEntry, 8> specializationEntries{};
+        for (uint32_t i = 0; i < specializationEntries.size(); i++) {
+            specializationEntries[i].constantID = i;
+            specializationEntries[i].offset = i * sizeof(int32_t);
+            specializationEntries[i].size = sizeof(int32_t);
+        }
+
+        VkSpecializationInfo specializationInfo{};
+        specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationEntries.size());
+        specializationInfo.pMapEntries = specializationEntries.data();
+        specializationInfo.dataSize = sizeof(computeSpecialization);
+        specializationInfo.pData = computeSpecialization.data();
+        computeShaderStageInfo.pSpecializationInfo = &specializationInfo;
+
         VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
         pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
         pipelineLayoutInfo.setLayoutCount = 1;
@@ -1094,22 +1388,19 @@ private:
             vkMapMemory(device, uniformBuffersMemory[i], 0, bufferSize, 0, &uniformBuffersMapped[i]);
         }
 
-        //TRIANGLES BUFFER
-        VkDeviceSize triBufferSize = sizeof(Triangle) * triangles.size();
-        VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
-
-        createBuffer(triBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
-        void* data;
-        vkMapMemory(device, stagingBufferMemory, 0, triBufferSize, 0, &data);
-        memcpy(data, triangles.data(), triBufferSize);
-        vkUnmapMemory(device, stagingBufferMemory);
-
-        createBuffer(triBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, trianglesBuffer, trianglesBufferMemory);
-        copyBuffer(stagingBuffer, trianglesBuffer, triBufferSize);
+        //TRIANGLES BUFFERS
+        // buildBVHOnGPU already filled the intersection stream, createBVH
+        // already compressed the triangles
+        if (!triangleStreams.compressed) {
+            triangleStreams.update(triangles);
+        }
+        if (!bvhGpuBuild) {
+            createSceneBuffer(triangleStreams.intersectionData(), triangleStreams.intersectionSize(triangles.size()), trianglesBuffer, trianglesBufferMemory, trianglesBufferSize);
+        }
+        createSceneBuffer(triangleStreams.shadingData(), triangleStreams.shadingSize(), triangleShadingBuffer, triangleShadingBufferMemory, triangleShadingBufferSize);
 
-        vkDestroyBuffer(device, stagingBuffer, nullptr);
-        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        //MATERIALS BUFFER
+        createSceneBuffer(materialTable.data(), sizeof(Material) * materialTable.size(), materialsBuffer, materialsBufferMemory, materialsBufferSize);
 
         //MESH INFO BUFFER
         VkDeviceSize meshesBufferSize = sizeof(MeshInfo) * meshes.size();
@@ -1130,41 +1421,83 @@ private:
         vkFreeMemory(device, stagingBufferMemory2, nullptr);
 
         //NODES BUFFER
-        VkDeviceSize nodesBufferSize = sizeof(Node) * allNodes.size();
-        VkBuffer stagingBuffer3;
-        VkDeviceMemory stagingBufferMemory3;
-        void* data3;
+        // buildBVHOnGPU already filled it
+        if (!bvhGpuBuild) {
+            const void* nodesData;
+            getNodeData(bvh, nodesData, nodesBufferSize);
+            if (!instancedBVH.instances.empty()) {
+                nodesData = instancedBVH.nodes.data();
+                nodesBufferSize = sizeof(Node) * instancedBVH.nodes.size();
+            }
+
+            // Only the binary tree of a single BVH can take inserted meshes
+            VkDeviceSize nodesDataSize = nodesBufferSize;
+            if (bvh.wideNodes.empty() && instancedBVH.instances.empty()) {
+                nodesBufferSize += static_cast<VkDeviceSize>(nodesDataSize * SCENE_EDIT_HEADROOM);
+            }
+
+            VkBuffer stagingBuffer3;
+            VkDeviceMemory stagingBufferMemory3;
+            void* data3;
+
+            createBuffer(nodesDataSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer3, stagingBufferMemory3);
+            vkMapMemory(device, stagingBufferMemory3, 0, nodesDataSize, 0, &data3);
+            memcpy(data3, nodesData, nodesDataSize);
+            vkUnmapMemory(device, stagingBufferMemory3);
 
-        createBuffer(nodesBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer3, stagingBufferMemory3);
-        vkMapMemory(device, stagingBufferMemory3, 0, nodesBufferSize, 0, &data3);
+            createBuffer(nodesBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, nodesBuffer, nodesBufferMemory);
+            copyBuffer(stagingBuffer3, nodesBuffer, nodesDataSize);
 
-        std::vector<Node> nodes;
-        nodes.reserve(allNodes.size());
+            vkDestroyBuffer(device, stagingBuffer3, nullptr);
+            vkFreeMemory(device, stagingBufferMemory3, nullptr);
+        }
 
-        for (const auto& nodePtr : allNodes) {
-            Node node;
-            node.triangleCount = nodePtr->triangleCount;
-            node.triangleIndex = nodePtr->triangleIndex;
-            node.bounds = nodePtr->bounds;
-            node.childIndex = nodePtr->childIndex;
-            nodes.push_back(node);
+        //INSTANCES BUFFER
+        // Binding 5 is always written, a single unused instance stands in without instancing
+        std::vector<Instance> instances = instancedBVH.instances;
+        if (instances.empty()) {
+            instances.push_back(Instance{});
         }
+        instancesBufferSize = sizeof(Instance) * instances.size();
+
+        VkBuffer stagingBuffer4;
+        VkDeviceMemory stagingBufferMemory4;
+        void* data4;
+
+        createBuffer(instancesBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer4, stagingBufferMemory4);
+        vkMapMemory(device, stagingBufferMemory4, 0, instancesBufferSize, 0, &data4);
+        memcpy(data4, instances.data(), instancesBufferSize);
+        vkUnmapMemory(device, stagingBufferMemory4);
+
+        createBuffer(instancesBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, instancesBuffer, instancesBufferMemory);
+        copyBuffer(stagingBuffer4, instancesBuffer, instancesBufferSize);
 
-        //std::swap(nodes[1].bounds, nodes[2].bounds);
+        vkDestroyBuffer(device, stagingBuffer4, nullptr);
+        vkFreeMemory(device, stagingBufferMemory4, nullptr);
 
-        memcpy(data3, nodes.data(), nodesBufferSize);
-        vkUnmapMemory(device, stagingBufferMemory3);
+    }
+
+    // Device local buffer holding pData, with the spare capacity inserted meshes use
+    void createSceneBuffer(const void* pData, VkDeviceSize pDataSize, VkBuffer& pBuffer, VkDeviceMemory& pBufferMemory, VkDeviceSize& pBufferSize) {
+        pBufferSize = pDataSize + static_cast<VkDeviceSize>(pDataSize * SCENE_EDIT_HEADROOM);
+        VkBuffer stagingBuffer;
+        VkDeviceMemory stagingBufferMemory;
 
-        createBuffer(nodesBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, nodesBuffer, nodesBufferMemory);
-        copyBuffer(stagingBuffer3, nodesBuffer, nodesBufferSize);
+        createBuffer(pDataSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+        void* data;
+        vkMapMemory(device, stagingBufferMemory, 0, pDataSize, 0, &data);
+        memcpy(data, pData, (size_t)pDataSize);
+        vkUnmapMemory(device, stagingBufferMemory);
 
-        vkDestroyBuffer(device, stagingBuffer3, nullptr);
-        vkFreeMemory(device, stagingBufferMemory3, nullptr);
+        createBuffer(pBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, pBuffer, pBufferMemory);
+        copyBuffer(stagingBuffer, pBuffer, pDataSize);
 
+        vkDestroyBuffer(device, stagingBuffer, nullptr);
+        vkFreeMemory(device, stagingBufferMemory, nullptr);
     }
 
     void createDescriptorPool() {
-        std::array<VkDescriptorPoolSize, 6> poolSizes{};
+        std::array<VkDescriptorPoolSize, 10> poolSizes{};
 
         poolSizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
         poolSizes[0].descriptorCount = MAX_FRAMES_IN_FLIGHT; 
@@ -1184,11 +1517,24 @@ private:
         poolSizes[5].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
         poolSizes[5].descriptorCount = MAX_FRAMES_IN_FLIGHT;
 
+        poolSizes[6].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        poolSizes[6].descriptorCount = MAX_FRAMES_IN_FLIGHT;
+
+        poolSizes[7].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        poolSizes[7].descriptorCount = MAX_FRAMES_IN_FLIGHT;
+
+        poolSizes[8].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        poolSizes[8].descriptorCount = MAX_FRAMES_IN_FLIGHT;
+
+        // The refit set
+        poolSizes[9].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        poolSizes[9].descriptorCount = 3;
+
         VkDescriptorPoolCreateInfo poolInfo{};
         poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
         poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
         poolInfo.pPoolSizes = poolSizes.data();
-        poolInfo.maxSets = MAX_FRAMES_IN_FLIGHT * 2;
+        poolInfo.maxSets = MAX_FRAMES_IN_FLIGHT * 2 + 1;
 
         if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool) != VK_SUCCESS) {
             throw std::runtime_error("failed to create descriptor pool!");
@@ -1221,7 +1567,7 @@ private:
             VkDescriptorBufferInfo trianglesInfo{};
             trianglesInfo.buffer = trianglesBuffer;
             trianglesInfo.offset = 0;
-            trianglesInfo.range = sizeof(Triangle) * triangles.size();
+            trianglesInfo.range = trianglesBufferSize;
 
             VkDescriptorBufferInfo meshesInfo{};
             meshesInfo.buffer = meshesBuffer;
@@ -1231,9 +1577,24 @@ private:
             VkDescriptorBufferInfo nodesInfo{};
             nodesInfo.buffer = nodesBuffer;
             nodesInfo.offset = 0;
-            nodesInfo.range = sizeof(Node) * allNodes.size();
+            nodesInfo.range = nodesBufferSize;
 
-            std::array<VkWriteDescriptorSet, 5> descriptorWrite{};
+            VkDescriptorBufferInfo instancesInfo{};
+            instancesInfo.buffer = instancesBuffer;
+            instancesInfo.offset = 0;
+            instancesInfo.range = instancesBufferSize;
+
+            VkDescriptorBufferInfo shadingInfo{};
+            shadingInfo.buffer = triangleShadingBuffer;
+            shadingInfo.offset = 0;
+            shadingInfo.range = triangleShadingBufferSize;
+
+            VkDescriptorBufferInfo materialsInfo{};
+            materialsInfo.buffer = materialsBuffer;
+            materialsInfo.offset = 0;
+            materialsInfo.range = materialsBufferSize;
+
+            std::array<VkWriteDescriptorSet, 8> descriptorWrite{};
             descriptorWrite[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
             descriptorWrite[0].dstSet = computeDescriptorSets[i];
             descriptorWrite[0].dstBinding = 0;
@@ -1274,167 +1635,1391 @@ private:
             descriptorWrite[4].descriptorCount = 1;
             descriptorWrite[4].pBufferInfo = &nodesInfo;
 
+            descriptorWrite[5].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrite[5].dstSet = computeDescriptorSets[i];
+            descriptorWrite[5].dstBinding = 5;
+            descriptorWrite[5].dstArrayElement = 0;
+            descriptorWrite[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorWrite[5].descriptorCount = 1;
+            descriptorWrite[5].pBufferInfo = &instancesInfo;
+
+            descriptorWrite[6].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrite[6].dstSet = computeDescriptorSets[i];
+            descriptorWrite[6].dstBinding = 6;
+            descriptorWrite[6].dstArrayElement = 0;
+            descriptorWrite[6].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorWrite[6].descriptorCount = 1;
+            descriptorWrite[6].pBufferInfo = &shadingInfo;
+
+            descriptorWrite[7].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrite[7].dstSet = computeDescriptorSets[i];
+            descriptorWrite[7].dstBinding = 7;
+            descriptorWrite[7].dstArrayElement = 0;
+            descriptorWrite[7].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorWrite[7].descriptorCount = 1;
+            descriptorWrite[7].pBufferInfo = &materialsInfo;
+
             vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrite.size()), descriptorWrite.data(), 0, nullptr);
         }
     }
 
-    void createGraphicsDescriptorSets() {
-        std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, graphicsDescriptorSetLayout);
-        VkDescriptorSetAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-        allocInfo.descriptorPool = descriptorPool;
-        allocInfo.descriptorSetCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
-        allocInfo.pSetLayouts = layouts.data();
+    void createRefitResources() {
+        // The GPU refit only knows the binary node layout of a single BVH, and
+        // the bounds of triangle positions
+        if (!bvh.wideNodes.empty() || !instancedBVH.instances.empty() || triangleStreams.woop || triangleStreams.indexed || triangleStreams.compressed) {
+            return;
+        }
 
-        graphicsDescriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
-        if (vkAllocateDescriptorSets(device, &allocInfo, graphicsDescriptorSets.data()) != VK_SUCCESS) {
-            throw std::runtime_error("failed to allocate graphics descriptor sets!");
+        std::array<VkDescriptorSetLayoutBinding, 3> layoutBindings{};
+        for (uint32_t i = 0; i < layoutBindings.size(); i++) {
+            layoutBindings[i].binding = i;
+            layoutBindings[i].descriptorCount = 1;
+            layoutBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            layoutBindings[i].pImmutableSamplers = nullptr;
+            layoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
         }
 
-        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-            VkDescriptorImageInfo sampledImageInfo{};
-            sampledImageInfo.sampler = storageImageSampler;
-            sampledImageInfo.imageView = storageImageView; 
-            sampledImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        VkDescriptorSetLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = static_cast<uint32_t>(layoutBindings.size());
+        layoutInfo.pBindings = layoutBindings.data();
 
-            VkWriteDescriptorSet descriptorWrite{};
-            descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            descriptorWrite.dstSet = graphicsDescriptorSets[i];
-            descriptorWrite.dstBinding = 0;
-            descriptorWrite.dstArrayElement = 0;
-            descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-            descriptorWrite.descriptorCount = 1;
-            descriptorWrite.pImageInfo = &sampledImageInfo;
+        if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &refitDescriptorSetLayout) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create refit descriptor set layout!");
+        }
 
-            vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+        // First entry and size of the level in the refit order
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = 2 * sizeof(int32_t);
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &refitDescriptorSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+        if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &refitPipelineLayout) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create refit pipeline layout!");
         }
-    }
 
+        auto refitShaderCode = readFile("../VulkanTest/refit.spv");
+        VkShaderModule refitShaderModule = createShaderModule(refitShaderCode);
 
-    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
-        VkBufferCreateInfo bufferInfo{};
-        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-        bufferInfo.size = size;
-        bufferInfo.usage = usage;
-        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.layout = refitPipelineLayout;
+        pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineInfo.stage.module = refitShaderModule;
+        pipelineInfo.stage.pName = "main";
 
-        if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
-            throw std::runtime_error("failed to create buffer!");
+        if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &refitPipeline) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create refit pipeline!");
         }
 
-        VkMemoryRequirements memRequirements;
-        vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+        vkDestroyShaderModule(device, refitShaderModule, nullptr);
 
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = descriptorPool;
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &refitDescriptorSetLayout;
 
-        if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
-            throw std::runtime_error("failed to allocate buffer memory!");
+        if (vkAllocateDescriptorSets(device, &allocInfo, &refitDescriptorSet) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate refit descriptor set!");
         }
 
-        vkBindBufferMemory(device, buffer, bufferMemory, 0);
+        writeRefitDescriptorSet();
     }
 
-    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-        VkCommandBufferAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandPool = commandPool;
-        allocInfo.commandBufferCount = 1;
+    // The refit order follows the tree, it is rebuilt with the buffers it reads
+    void writeRefitDescriptorSet() {
+        //REFIT ORDER BUFFER
+        std::vector<int> refitOrder;
+        bvh.getRefitOrder(refitOrder, refitLevelOffsets);
 
-        VkCommandBuffer commandBuffer;
-        vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+        VkDeviceSize refitOrderBufferSize = sizeof(int) * refitOrder.size();
+        VkBuffer stagingBuffer;
+        VkDeviceMemory stagingBufferMemory;
+        void* data;
 
-        VkCommandBufferBeginInfo beginInfo{};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        createBuffer(refitOrderBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+        vkMapMemory(device, stagingBufferMemory, 0, refitOrderBufferSize, 0, &data);
+        memcpy(data, refitOrder.data(), refitOrderBufferSize);
+        vkUnmapMemory(device, stagingBufferMemory);
 
-        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+        createBuffer(refitOrderBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, refitOrderBuffer, refitOrderBufferMemory);
+        copyBuffer(stagingBuffer, refitOrderBuffer, refitOrderBufferSize);
 
-        VkBufferCopy copyRegion{};
-        copyRegion.size = size;
-        vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+        vkDestroyBuffer(device, stagingBuffer, nullptr);
+        vkFreeMemory(device, stagingBufferMemory, nullptr);
 
-        vkEndCommandBuffer(commandBuffer);
+        std::array<VkDescriptorBufferInfo, 3> bufferInfos{};
+        bufferInfos[0].buffer = trianglesBuffer;
+        bufferInfos[0].range = trianglesBufferSize;
+        bufferInfos[1].buffer = nodesBuffer;
+        bufferInfos[1].range = nodesBufferSize;
+        bufferInfos[2].buffer = refitOrderBuffer;
+        bufferInfos[2].range = refitOrderBufferSize;
 
-        VkSubmitInfo submitInfo{};
-        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        submitInfo.commandBufferCount = 1;
-        submitInfo.pCommandBuffers = &commandBuffer;
+        std::array<VkWriteDescriptorSet, 3> descriptorWrite{};
+        for (uint32_t i = 0; i < descriptorWrite.size(); i++) {
+            descriptorWrite[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrite[i].dstSet = refitDescriptorSet;
+            descriptorWrite[i].dstBinding = i;
+            descriptorWrite[i].dstArrayElement = 0;
+            descriptorWrite[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorWrite[i].descriptorCount = 1;
+            descriptorWrite[i].pBufferInfo = &bufferInfos[i];
+        }
 
-        vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-        vkQueueWaitIdle(graphicsQueue);
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrite.size()), descriptorWrite.data(), 0, nullptr);
+    }
 
-        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+    std::string gpuDeviceName() {
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        return "GPU " + std::string(properties.deviceName) + " " + std::to_string(properties.vendorID) + ":" + std::to_string(properties.deviceID) + " driver " + std::to_string(properties.driverVersion);
     }
 
-    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-        VkPhysicalDeviceMemoryProperties memProperties;
-        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+    // Feeds the measured costs of the traversal backend into the builder
+    void applyBVHCostProfile() {
+        BVHCostProfile profile;
+        std::string profilePath = EXE_PATH + "/" + BVH_COST_PROFILE_FILE;
+        bool hasProfile = false;
 
-        for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-            if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-                return i;
+        if (bvhCostBackend != "none") {
+            profile.device = bvhCostBackend == "cpu" ? cpuDeviceName() : gpuDeviceName();
+            if (bvhCalibrate) {
+                if (bvhCostBackend == "cpu") {
+                    measureCPUCosts(profile);
+                }
+                else {
+                    measureGPUCosts(profile);
+                }
+                profile.maxLeafSize = chooseMaxLeafSize(triangles, bvhSettings, profile.traversalCost);
+                saveCostProfile(profilePath, profile);
+                hasProfile = true;
+                std::cout << "Calibrated " << profile.device << ": box test " << profile.boxTestNs << " ns, triangle test " << profile.triangleTestNs << " ns, " << profile.woopTriangleTestNs << " ns on Woop records" << std::endl;
+            }
+            else {
+                hasProfile = loadCostProfile(profilePath, profile.device, profile);
             }
         }
 
-        throw std::runtime_error("failed to find suitable memory type!");
-    }
-
-    void createCommandBuffers() {
-        commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+        if (hasProfile) {
+            bvhSettings.traversalCost = profile.traversalCost;
+            bvhSettings.maxLeafSize = profile.maxLeafSize;
+        }
+        if (bvhTraversalCost >= 0.0f) {
+            bvhSettings.traversalCost = bvhTraversalCost;
+        }
+        if (bvhMaxLeafSize >= 0) {
+            bvhSettings.maxLeafSize = bvhMaxLeafSize;
+        }
 
-        VkCommandBufferAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.commandPool = commandPool;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
+        if (hasProfile || bvhTraversalCost >= 0.0f || bvhMaxLeafSize >= 0) {
+            std::cout << "BVH cost model" << (hasProfile ? " of " + profile.device : std::string()) << ": traversal cost " << bvhSettings.traversalCost << ", max leaf size " << bvhSettings.maxLeafSize << std::endl;
+        }
 
-        if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
-            throw std::runtime_error("failed to allocate command buffers!");
+        if (bvhTriangleBenchmark) {
+            benchmarkTriangleTests();
         }
     }
 
-    void createComputeCommandBuffers() {
-        computeCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
-
-        VkCommandBufferAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        allocInfo.commandPool = commandPool;
-        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocInfo.commandBufferCount = (uint32_t)computeCommandBuffers.size();
+    // Compares the leaf test on the triangle positions, which sets up the
+    // edges and normal on every test, with the test on the Woop records. The
+    // profiles are measured again and not saved.
+    void benchmarkTriangleTests() {
+        std::array<BVHCostProfile, 2> profiles;
+        profiles[0].device = cpuDeviceName();
+        measureCPUCosts(profiles[0]);
+        profiles[1].device = gpuDeviceName();
+        measureGPUCosts(profiles[1]);
 
-        if (vkAllocateCommandBuffers(device, &allocInfo, computeCommandBuffers.data()) != VK_SUCCESS) {
-            throw std::runtime_error("failed to allocate compute command buffers!");
+        std::cout << "Triangle test benchmark:" << std::endl;
+        for (const BVHCostProfile& profile : profiles) {
+            std::cout << "  " << profile.device << ": positions " << profile.triangleTestNs << " ns, Woop records " << profile.woopTriangleTestNs << " ns ("
+                << profile.triangleTestNs / std::max(profile.woopTriangleTestNs, 1e-9) << "x)" << std::endl;
         }
     }
 
-    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
-        VkCommandBufferBeginInfo beginInfo{};
-        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-
-        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
-            throw std::runtime_error("failed to begin recording command buffer!");
+    // Times calibrate.comp over the first triangles of the model and their
+    // boxes with timestamp queries. The second of two runs is kept.
+    void measureGPUCosts(BVHCostProfile& pProfile) {
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        if (!properties.limits.timestampComputeAndGraphics) {
+            throw std::runtime_error("GPU timestamps are not supported, calibrate with --bvh-cost-backend cpu!");
+        }
+        if (triangles.empty()) {
+            throw std::runtime_error("no triangles to calibrate the BVH costs with!");
+        }
+
+        int count = std::min((int)triangles.size(), GPU_CALIBRATION_PRIMITIVES);
+        std::vector<TriangleIntersection> records(count);
+        std::vector<WoopTriangle> woopRecords(count);
+        std::vector<Node> boxes(count);
+        BoundingBox sceneBounds;
+        for (int i = 0; i < count; i++) {
+            records[i] = TriangleIntersection{ triangles[i].posA, triangles[i].posB, triangles[i].posC };
+            woopRecords[i] = WoopTriangle::fromPositions(triangles[i].posA, triangles[i].posB, triangles[i].posC);
+            boxes[i] = Node{ {}, i, 1, 0 };
+            boxes[i].bounds.growToInclude(&triangles[i]);
+            sceneBounds.growToInclude(boxes[i].bounds);
+        }
+
+        // Buffers
+        std::array<VkBuffer, 4> buffers{};
+        std::array<VkDeviceMemory, 4> buffersMemory{};
+        std::array<VkDeviceSize, 4> bufferSizes = { sizeof(TriangleIntersection) * count, sizeof(Node) * count, sizeof(WoopTriangle) * count, sizeof(uint32_t) * GPU_CALIBRATION_RAYS };
+        std::array<const void*, 3> bufferData = { records.data(), boxes.data(), woopRecords.data() };
+
+        for (size_t i = 0; i < buffers.size(); i++) {
+            createBuffer(bufferSizes[i], VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffers[i], buffersMemory[i]);
+            if (i >= bufferData.size()) continue;
+
+            VkBuffer stagingBuffer;
+            VkDeviceMemory stagingBufferMemory;
+            void* data;
+            createBuffer(bufferSizes[i], VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+            vkMapMemory(device, stagingBufferMemory, 0, bufferSizes[i], 0, &data);
+            memcpy(data, bufferData[i], (size_t)bufferSizes[i]);
+            vkUnmapMemory(device, stagingBufferMemory);
+            copyBuffer(stagingBuffer, buffers[i], bufferSizes[i]);
+            vkDestroyBuffer(device, stagingBuffer, nullptr);
+            vkFreeMemory(device, stagingBufferMemory, nullptr);
+        }
+
+        // Descriptors
+        std::array<VkDescriptorSetLayoutBinding, 4> layoutBindings{};
+        for (uint32_t i = 0; i < layoutBindings.size(); i++) {
+            layoutBindings[i].binding = i;
+            layoutBindings[i].descriptorCount = 1;
+            layoutBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            layoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
         }
 
-        transitionImageLayout(storageImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+        VkDescriptorSetLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = static_cast<uint32_t>(layoutBindings.size());
+        layoutInfo.pBindings = layoutBindings.data();
 
-        VkRenderPassBeginInfo renderPassInfo{};
-        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-        renderPassInfo.renderPass = renderPass;
-        renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
-        renderPassInfo.renderArea.offset = { 0, 0 };
-        renderPassInfo.renderArea.extent = swapChainExtent;
+        VkDescriptorSetLayout calibrationSetLayout;
+        if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &calibrationSetLayout) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create calibration descriptor set layout!");
+        }
 
-        VkClearValue clearColor = { {{0.0f, 0.0f, 0.0f, 1.0f}} };
-        renderPassInfo.clearValueCount = 1;
-        renderPassInfo.pClearValues = &clearColor;
+        VkDescriptorPoolSize poolSize{};
+        poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        poolSize.descriptorCount = static_cast<uint32_t>(layoutBindings.size());
 
-        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        VkDescriptorPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.poolSizeCount = 1;
+        poolInfo.pPoolSizes = &poolSize;
+        poolInfo.maxSets = 1;
 
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+        VkDescriptorPool calibrationPool;
+        if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &calibrationPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create calibration descriptor pool!");
+        }
+
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = calibrationPool;
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &calibrationSetLayout;
+
+        VkDescriptorSet calibrationSet;
+        if (vkAllocateDescriptorSets(device, &allocInfo, &calibrationSet) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate calibration descriptor set!");
+        }
+
+        std::array<VkDescriptorBufferInfo, 4> bufferInfos{};
+        std::array<VkWriteDescriptorSet, 4> descriptorWrite{};
+        for (uint32_t i = 0; i < descriptorWrite.size(); i++) {
+            bufferInfos[i].buffer = buffers[i];
+            bufferInfos[i].range = bufferSizes[i];
+
+            descriptorWrite[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrite[i].dstSet = calibrationSet;
+            descriptorWrite[i].dstBinding = i;
+            descriptorWrite[i].dstArrayElement = 0;
+            descriptorWrite[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorWrite[i].descriptorCount = 1;
+            descriptorWrite[i].pBufferInfo = &bufferInfos[i];
+        }
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrite.size()), descriptorWrite.data(), 0, nullptr);
+
+        // Pipeline
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = sizeof(CalibrationConstants);
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &calibrationSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+        VkPipelineLayout calibrationPipelineLayout;
+        if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &calibrationPipelineLayout) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create calibration pipeline layout!");
+        }
+
+        auto calibrationShaderCode = readFile("../VulkanTest/calibrate.spv");
+        VkShaderModule calibrationShaderModule = createShaderModule(calibrationShaderCode);
+
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.layout = calibrationPipelineLayout;
+        pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineInfo.stage.module = calibrationShaderModule;
+        pipelineInfo.stage.pName = "main";
+
+        VkPipeline calibrationPipeline;
+        if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &calibrationPipeline) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create calibration pipeline!");
+        }
+        vkDestroyShaderModule(device, calibrationShaderModule, nullptr);
+
+        // Timestamps before the box dispatch and after each of the three dispatches
+        VkQueryPoolCreateInfo queryPoolInfo{};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = 4;
+
+        VkQueryPool queryPool;
+        if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &queryPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create calibration query pool!");
+        }
+
+        std::array<uint64_t, 4> timestamps{};
+        for (int run = 0; run < 2; run++) {
+            VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+            vkCmdResetQueryPool(commandBuffer, queryPool, 0, 4);
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, calibrationPipeline);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, calibrationPipelineLayout, 0, 1, &calibrationSet, 0, nullptr);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 0);
+
+            for (int32_t mode = 0; mode < 3; mode++) {
+                CalibrationConstants constants{ mode, count, { 0, 0 }, glm::vec4(sceneBounds.boundsMin, 0.0f), glm::vec4(sceneBounds.boundsMax, 0.0f) };
+                vkCmdPushConstants(commandBuffer, calibrationPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+                vkCmdDispatch(commandBuffer, GPU_CALIBRATION_RAYS / 64, 1, 1);
+                vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, mode + 1);
+            }
+            endSingleTimeCommands(commandBuffer);
+
+            if (vkGetQueryPoolResults(device, queryPool, 0, 4, sizeof(timestamps), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+                throw std::runtime_error("failed to read calibration timestamps!");
+            }
+        }
+
+        double tests = (double)GPU_CALIBRATION_RAYS * count;
+        pProfile.boxTestNs = (timestamps[1] - timestamps[0]) * properties.limits.timestampPeriod / tests;
+        pProfile.triangleTestNs = (timestamps[2] - timestamps[1]) * properties.limits.timestampPeriod / tests;
+        pProfile.woopTriangleTestNs = (timestamps[3] - timestamps[2]) * properties.limits.timestampPeriod / tests;
+        pProfile.traversalCost = traversalCostFromTimings(pProfile.boxTestNs, pProfile.triangleTestNs);
+
+        vkDestroyQueryPool(device, queryPool, nullptr);
+        vkDestroyPipeline(device, calibrationPipeline, nullptr);
+        vkDestroyPipelineLayout(device, calibrationPipelineLayout, nullptr);
+        vkDestroyDescriptorPool(device, calibrationPool, nullptr);
+        vkDestroyDescriptorSetLayout(device, calibrationSetLayout, nullptr);
+        for (size_t i = 0; i < buffers.size(); i++) {
+            vkDestroyBuffer(device, buffers[i], nullptr);
+            vkFreeMemory(device, buffersMemory[i], nullptr);
+        }
+    }
+
+    // Builds a binary LBVH with gpubuild.comp. Only the intersection stream is
+    // uploaded, the shader writes it sorted and the nodes straight into
+    // trianglesBuffer and nodesBuffer. The nodes and the triangle order
+    // are read back so the CPU side (stats, refits, edits) keeps the same tree.
+    void buildBVHOnGPU() {
+        auto startTime = std::chrono::high_resolution_clock::now();
+
+        VkPhysicalDeviceProperties properties{};
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        if (triangles.empty()) {
+            throw std::runtime_error("no triangles to build the BVH from!");
+        }
+
+        int count = static_cast<int>(triangles.size());
+        int nodeCount = 2 * count - 1;
+        int blockCount = (count + GPU_BUILD_GROUP_SIZE - 1) / GPU_BUILD_GROUP_SIZE;
+        int nodeGroups = (nodeCount + GPU_BUILD_GROUP_SIZE - 1) / GPU_BUILD_GROUP_SIZE;
+        if (static_cast<uint32_t>(nodeGroups) > properties.limits.maxComputeWorkGroupCount[0]) {
+            throw std::runtime_error("too many triangles for the GPU BVH builder!");
+        }
+
+        if (bvhSettings.width != 2 || bvhSettings.quantized || bvhSettings.childBounds || bvhSettings.treeletLeaves > 0 || bvhSettings.layout != BVHNodeLayout::BuildOrder || bvhPreview || bvhLazy) {
+            std::cout << "--bvh-gpu builds a binary LBVH in build order, the other BVH options are ignored" << std::endl;
+        }
+
+        // Buffers. The scratch buffer holds the centroid bounds, both halves of
+        // the codes and indices, the digit offsets, the internal node slots and
+        // the arrival counters, see gpubuild.comp.
+        triangleStreams.update(triangles);
+        VkDeviceSize triBufferSize = sizeof(TriangleIntersection) * count;
+        VkDeviceSize nodesDataSize = sizeof(Node) * nodeCount;
+        VkDeviceSize scratchSize = sizeof(uint32_t) * (GPU_BUILD_HEADER_SIZE + 6 * static_cast<VkDeviceSize>(count) + 16 * static_cast<VkDeviceSize>(blockCount));
+        trianglesBufferSize = triBufferSize + static_cast<VkDeviceSize>(triBufferSize * SCENE_EDIT_HEADROOM);
+        nodesBufferSize = nodesDataSize + static_cast<VkDeviceSize>(nodesDataSize * SCENE_EDIT_HEADROOM);
+
+        VkBuffer inputBuffer;
+        VkDeviceMemory inputBufferMemory;
+        VkBuffer scratchBuffer;
+        VkDeviceMemory scratchBufferMemory;
+        createBuffer(triBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, inputBuffer, inputBufferMemory);
+        createBuffer(trianglesBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, trianglesBuffer, trianglesBufferMemory);
+        createBuffer(nodesBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, nodesBuffer, nodesBufferMemory);
+        createBuffer(scratchSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, scratchBuffer, scratchBufferMemory);
+
+        VkBuffer stagingBuffer;
+        VkDeviceMemory stagingBufferMemory;
+        void* data;
+        createBuffer(triBufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+        vkMapMemory(device, stagingBufferMemory, 0, triBufferSize, 0, &data);
+        memcpy(data, triangleStreams.intersection.data(), triBufferSize);
+        vkUnmapMemory(device, stagingBufferMemory);
+        copyBuffer(stagingBuffer, inputBuffer, triBufferSize);
+        vkDestroyBuffer(device, stagingBuffer, nullptr);
+        vkFreeMemory(device, stagingBufferMemory, nullptr);
+
+        // Descriptors
+        std::array<VkBuffer, 4> buffers = { inputBuffer, trianglesBuffer, nodesBuffer, scratchBuffer };
+        std::array<VkDeviceSize, 4> bufferSizes = { triBufferSize, trianglesBufferSize, nodesBufferSize, scratchSize };
+
+        std::array<VkDescriptorSetLayoutBinding, 4> layoutBindings{};
+        for (uint32_t i = 0; i < layoutBindings.size(); i++) {
+            layoutBindings[i].binding = i;
+            layoutBindings[i].descriptorCount = 1;
+            layoutBindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            layoutBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        }
+
+        VkDescriptorSetLayoutCreateInfo layoutInfo{};
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.bindingCount = static_cast<uint32_t>(layoutBindings.size());
+        layoutInfo.pBindings = layoutBindings.data();
+
+        VkDescriptorSetLayout buildSetLayout;
+        if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &buildSetLayout) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create GPU build descriptor set layout!");
+        }
+
+        VkDescriptorPoolSize poolSize{};
+        poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        poolSize.descriptorCount = static_cast<uint32_t>(layoutBindings.size());
+
+        VkDescriptorPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        poolInfo.poolSizeCount = 1;
+        poolInfo.pPoolSizes = &poolSize;
+        poolInfo.maxSets = 1;
+
+        VkDescriptorPool buildPool;
+        if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &buildPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create GPU build descriptor pool!");
+        }
+
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = buildPool;
+        allocInfo.descriptorSetCount = 1;
+        allocInfo.pSetLayouts = &buildSetLayout;
+
+        VkDescriptorSet buildSet;
+        if (vkAllocateDescriptorSets(device, &allocInfo, &buildSet) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate GPU build descriptor set!");
+        }
+
+        std::array<VkDescriptorBufferInfo, 4> bufferInfos{};
+        std::array<VkWriteDescriptorSet, 4> descriptorWrite{};
+        for (uint32_t i = 0; i < descriptorWrite.size(); i++) {
+            bufferInfos[i].buffer = buffers[i];
+            bufferInfos[i].range = bufferSizes[i];
+
+            descriptorWrite[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrite[i].dstSet = buildSet;
+            descriptorWrite[i].dstBinding = i;
+            descriptorWrite[i].dstArrayElement = 0;
+            descriptorWrite[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptorWrite[i].descriptorCount = 1;
+            descriptorWrite[i].pBufferInfo = &bufferInfos[i];
+        }
+        vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrite.size()), descriptorWrite.data(), 0, nullptr);
+
+        // Pipeline
+        VkPushConstantRange pushConstantRange{};
+        pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pushConstantRange.offset = 0;
+        pushConstantRange.size = sizeof(GPUBuildConstants);
+
+        VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+        pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pipelineLayoutInfo.setLayoutCount = 1;
+        pipelineLayoutInfo.pSetLayouts = &buildSetLayout;
+        pipelineLayoutInfo.pushConstantRangeCount = 1;
+        pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+        VkPipelineLayout buildPipelineLayout;
+        if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &buildPipelineLayout) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create GPU build pipeline layout!");
+        }
+
+        auto buildShaderCode = readFile("../VulkanTest/gpubuild.spv");
+        VkShaderModule buildShaderModule = createShaderModule(buildShaderCode);
+
+        VkComputePipelineCreateInfo pipelineInfo{};
+        pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+        pipelineInfo.layout = buildPipelineLayout;
+        pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        pipelineInfo.stage.module = buildShaderModule;
+        pipelineInfo.stage.pName = "main";
+
+        VkPipeline buildPipeline;
+        if (vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &buildPipeline) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create GPU build pipeline!");
+        }
+        vkDestroyShaderModule(device, buildShaderModule, nullptr);
+
+        // Timestamps around the build dispatches, when the queue has them
+        VkQueryPool queryPool = VK_NULL_HANDLE;
+        if (properties.limits.timestampComputeAndGraphics) {
+            VkQueryPoolCreateInfo queryPoolInfo{};
+            queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+            queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+            queryPoolInfo.queryCount = 2;
+
+            if (vkCreateQueryPool(device, &queryPoolInfo, nullptr, &queryPool) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create GPU build query pool!");
+            }
+        }
+
+        // Build
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        if (queryPool != VK_NULL_HANDLE) {
+            vkCmdResetQueryPool(commandBuffer, queryPool, 0, 2);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPool, 0);
+        }
+
+        // Centroid bounds start empty as ordered uints
+        vkCmdFillBuffer(commandBuffer, scratchBuffer, 0, 3 * sizeof(uint32_t), 0xFFFFFFFF);
+        vkCmdFillBuffer(commandBuffer, scratchBuffer, 3 * sizeof(uint32_t), 3 * sizeof(uint32_t), 0);
+
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, buildPipeline);
+        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, buildPipelineLayout, 0, 1, &buildSet, 0, nullptr);
+
+        // Every stage reads what the previous one wrote
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        auto dispatchStage = [&](GPUBuildStage pStage, int pPass, int pGroups) {
+            GPUBuildConstants constants{ pStage, count, pPass, blockCount, bvhSettings.maxDepth };
+            vkCmdPushConstants(commandBuffer, buildPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+            vkCmdDispatch(commandBuffer, pGroups, 1, 1);
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        };
+
+        dispatchStage(GPU_BUILD_CENTROID_BOUNDS, 0, blockCount);
+        dispatchStage(GPU_BUILD_MORTON_CODES, 0, blockCount);
+        for (int pass = 0; pass < GPU_BUILD_RADIX_PASSES; pass++) {
+            dispatchStage(GPU_BUILD_COUNT_DIGITS, pass, blockCount);
+            dispatchStage(GPU_BUILD_SCAN_DIGITS, pass, 1);
+            dispatchStage(GPU_BUILD_SCATTER_DIGITS, pass, blockCount);
+        }
+        dispatchStage(GPU_BUILD_HIERARCHY, 0, blockCount);
+        dispatchStage(GPU_BUILD_FIT_BOUNDS, 0, nodeGroups);
+        dispatchStage(GPU_BUILD_COLLAPSE, 0, nodeGroups);
+
+        if (queryPool != VK_NULL_HANDLE) {
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPool, 1);
+        }
+
+        // Read back the nodes and the sorted triangle indices
+        VkDeviceSize orderSize = sizeof(uint32_t) * count;
+        createBuffer(nodesDataSize + orderSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        std::array<VkBufferCopy, 2> copyRegions{};
+        copyRegions[0].size = nodesDataSize;
+        copyRegions[1].srcOffset = sizeof(uint32_t) * (GPU_BUILD_HEADER_SIZE + 2 * static_cast<VkDeviceSize>(count));
+        copyRegions[1].dstOffset = nodesDataSize;
+        copyRegions[1].size = orderSize;
+        vkCmdCopyBuffer(commandBuffer, nodesBuffer, stagingBuffer, 1, &copyRegions[0]);
+        vkCmdCopyBuffer(commandBuffer, scratchBuffer, stagingBuffer, 1, &copyRegions[1]);
+        endSingleTimeCommands(commandBuffer);
+
+        std::vector<uint32_t> order(count);
+        bvh.nodes.resize(nodeCount);
+        vkMapMemory(device, stagingBufferMemory, 0, nodesDataSize + orderSize, 0, &data);
+        memcpy(bvh.nodes.data(), data, nodesDataSize);
+        memcpy(order.data(), static_cast<char*>(data) + nodesDataSize, orderSize);
+        vkUnmapMemory(device, stagingBufferMemory);
+
+        std::vector<Triangle> sortedTriangles(count);
+        for (int i = 0; i < count; i++) {
+            sortedTriangles[i] = triangles[order[i]];
+        }
+        triangles.swap(sortedTriangles);
+
+        // Drop the slots collapse emptied below maxDepth and put the compacted
+        // tree back, so the stats, refits and edits see the nodes the shader
+        // traverses, as for the CPU LBVH
+        bvh.compactNodes();
+        vkDestroyBuffer(device, stagingBuffer, nullptr);
+        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        nodesDataSize = sizeof(Node) * bvh.nodes.size();
+        createBuffer(nodesDataSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+        vkMapMemory(device, stagingBufferMemory, 0, nodesDataSize, 0, &data);
+        memcpy(data, bvh.nodes.data(), nodesDataSize);
+        vkUnmapMemory(device, stagingBufferMemory);
+        copyBuffer(stagingBuffer, nodesBuffer, nodesDataSize);
+
+        bvh.settings.builder = BVHBuilderType::Linear;
+        bvh.settings.mortonBits = 30;
+        bvh.stats.buildTimeMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+        bvh.stats.sahCost = bvh.computeSAHCost();
+
+        if (queryPool != VK_NULL_HANDLE) {
+            std::array<uint64_t, 2> timestamps{};
+            if (vkGetQueryPoolResults(device, queryPool, 0, 2, sizeof(timestamps), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+                throw std::runtime_error("failed to read GPU build timestamps!");
+            }
+            std::cout << "GPU BVH build dispatches took " << (timestamps[1] - timestamps[0]) * properties.limits.timestampPeriod / 1e6 << " ms" << std::endl;
+            vkDestroyQueryPool(device, queryPool, nullptr);
+        }
+
+        vkDestroyBuffer(device, stagingBuffer, nullptr);
+        vkFreeMemory(device, stagingBufferMemory, nullptr);
+        vkDestroyPipeline(device, buildPipeline, nullptr);
+        vkDestroyPipelineLayout(device, buildPipelineLayout, nullptr);
+        vkDestroyDescriptorPool(device, buildPool, nullptr);
+        vkDestroyDescriptorSetLayout(device, buildSetLayout, nullptr);
+        vkDestroyBuffer(device, inputBuffer, nullptr);
+        vkFreeMemory(device, inputBufferMemory, nullptr);
+        vkDestroyBuffer(device, scratchBuffer, nullptr);
+        vkFreeMemory(device, scratchBufferMemory, nullptr);
+    }
+
+    void createGraphicsDescriptorSets() {
+        std::vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, graphicsDescriptorSetLayout);
+        VkDescriptorSetAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        allocInfo.descriptorPool = descriptorPool;
+        allocInfo.descriptorSetCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+        allocInfo.pSetLayouts = layouts.data();
+
+        graphicsDescriptorSets.resize(MAX_FRAMES_IN_FLIGHT);
+        if (vkAllocateDescriptorSets(device, &allocInfo, graphicsDescriptorSets.data()) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate graphics descriptor sets!");
+        }
+
+        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            VkDescriptorImageInfo sampledImageInfo{};
+            sampledImageInfo.sampler = storageImageSampler;
+            sampledImageInfo.imageView = storageImageView; 
+            sampledImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+            VkWriteDescriptorSet descriptorWrite{};
+            descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptorWrite.dstSet = graphicsDescriptorSets[i];
+            descriptorWrite.dstBinding = 0;
+            descriptorWrite.dstArrayElement = 0;
+            descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            descriptorWrite.descriptorCount = 1;
+            descriptorWrite.pImageInfo = &sampledImageInfo;
+
+            vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
+        }
+    }
+
+
+    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+        VkBufferCreateInfo bufferInfo{};
+        bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        bufferInfo.size = size;
+        bufferInfo.usage = usage;
+        bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+        if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create buffer!");
+        }
+
+        VkMemoryRequirements memRequirements;
+        vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
+
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = memRequirements.size;
+        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+
+        if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate buffer memory!");
+        }
+
+        vkBindBufferMemory(device, buffer, bufferMemory, 0);
+    }
+
+    void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandPool = commandPool;
+        allocInfo.commandBufferCount = 1;
+
+        VkCommandBuffer commandBuffer;
+        vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+        vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+        VkBufferCopy copyRegion{};
+        copyRegion.size = size;
+        vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+
+        vkEndCommandBuffer(commandBuffer);
+
+        VkSubmitInfo submitInfo{};
+        submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = &commandBuffer;
+
+        vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+        vkQueueWaitIdle(graphicsQueue);
+
+        vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+    }
+
+    void uploadBufferRanges(VkBuffer pBuffer, const void* pData, VkDeviceSize pElementSize, const std::vector<BVHRange>& pRanges) {
+        if (pRanges.empty()) {
+            return;
+        }
+
+        VkDeviceSize stagingSize = 0;
+        for (const BVHRange& range : pRanges) {
+            stagingSize += pElementSize * range.count;
+        }
+
+        VkBuffer stagingBuffer;
+        VkDeviceMemory stagingBufferMemory;
+        createBuffer(stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+
+        // The ranges are packed in the staging buffer and copied to their place with one copy each
+        void* data;
+        vkMapMemory(device, stagingBufferMemory, 0, stagingSize, 0, &data);
+        std::vector<VkBufferCopy> copyRegions;
+        VkDeviceSize stagingOffset = 0;
+        for (const BVHRange& range : pRanges) {
+            VkBufferCopy copyRegion{};
+            copyRegion.srcOffset = stagingOffset;
+            copyRegion.dstOffset = pElementSize * range.first;
+            copyRegion.size = pElementSize * range.count;
+            memcpy(static_cast<char*>(data) + copyRegion.srcOffset, static_cast<const char*>(pData) + copyRegion.dstOffset, copyRegion.size);
+            copyRegions.push_back(copyRegion);
+            stagingOffset += copyRegion.size;
+        }
+        vkUnmapMemory(device, stagingBufferMemory);
+
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        vkCmdCopyBuffer(commandBuffer, stagingBuffer, pBuffer, static_cast<uint32_t>(copyRegions.size()), copyRegions.data());
+        endSingleTimeCommands(commandBuffer);
+
+        vkDestroyBuffer(device, stagingBuffer, nullptr);
+        vkFreeMemory(device, stagingBufferMemory, nullptr);
+    }
+
+    // Converts the triangles of pRanges to both GPU streams and uploads them.
+    // Compressed, their corners are snapped first. Returns true if a block
+    // outgrew its steps and every triangle was snapped, then all of them are
+    // uploaded and the BVH needs a full refit.
+    bool uploadTriangleRanges(const std::vector<BVHRange>& pRanges) {
+        bool resnapped = false;
+        for (const BVHRange& range : pRanges) {
+            resnapped = triangleStreams.update(triangles, range.first, range.count) || resnapped;
+        }
+        std::vector<BVHRange> ranges = resnapped ? std::vector<BVHRange>{ BVHRange{ 0, static_cast<int>(triangles.size()) } } : pRanges;
+
+        if (triangleStreams.compressed) {
+            uploadBufferRanges(trianglesBuffer, triangleStreams.intersectionData(), sizeof(uint32_t) * COMPRESSED_BLOCK_WORDS, blockRanges(ranges));
+        }
+        else {
+            uploadBufferRanges(trianglesBuffer, triangleStreams.intersectionData(), triangleStreams.intersectionSize(1), ranges);
+        }
+
+        if (triangleStreams.indexed) {
+            uploadBufferRanges(triangleShadingBuffer, triangleStreams.vertices.data(), sizeof(Vertex), vertexRanges(ranges));
+        }
+        else if (triangleStreams.compressed) {
+            uploadBufferRanges(triangleShadingBuffer, triangleStreams.compressedShading.data(), sizeof(CompressedShading), ranges);
+        }
+        else {
+            uploadBufferRanges(triangleShadingBuffer, triangleStreams.shading.data(), sizeof(TriangleShading), ranges);
+        }
+        return resnapped;
+    }
+
+    // The compressed blocks holding the triangles of pRanges, as runs of blocks
+    std::vector<BVHRange> blockRanges(const std::vector<BVHRange>& pRanges) const {
+        std::vector<BVHRange> ranges;
+        for (const BVHRange& range : pRanges) {
+            if (range.count <= 0) continue;
+            int first = range.first / COMPRESSED_BLOCK_SIZE;
+            int end = (range.first + range.count - 1) / COMPRESSED_BLOCK_SIZE + 1;
+            ranges.push_back(BVHRange{ first, end - first });
+        }
+        std::sort(ranges.begin(), ranges.end(), [](const BVHRange& pA, const BVHRange& pB) { return pA.first < pB.first; });
+
+        std::vector<BVHRange> merged;
+        for (const BVHRange& range : ranges) {
+            if (!merged.empty() && merged.back().first + merged.back().count >= range.first) {
+                merged.back().count = std::max(merged.back().count, range.first + range.count - merged.back().first);
+            }
+            else {
+                merged.push_back(range);
+            }
+        }
+        return merged;
+    }
+
+    // The vertices the triangles of pRanges use, as runs of the vertex table
+    std::vector<BVHRange> vertexRanges(const std::vector<BVHRange>& pRanges) const {
+        std::vector<uint32_t> used;
+        for (const BVHRange& range : pRanges) {
+            for (int i = range.first; i < range.first + range.count; i++) {
+                used.insert(used.end(), triangles[i].vertexIndices, triangles[i].vertexIndices + 3);
+            }
+        }
+        std::sort(used.begin(), used.end());
+        used.erase(std::unique(used.begin(), used.end()), used.end());
+
+        std::vector<BVHRange> ranges;
+        for (uint32_t vertex : used) {
+            if (!ranges.empty() && ranges.back().first + ranges.back().count == static_cast<int>(vertex)) {
+                ranges.back().count++;
+            }
+            else {
+                ranges.push_back(BVHRange{ static_cast<int>(vertex), 1 });
+            }
+        }
+        return ranges;
+    }
+
+    // Call after moving the vertices of the triangles of pMoved in triangles.
+    // Uploads them and refits the BVH on the GPU or on the CPU, only the CPU
+    // refit can tell when a rebuild is due.
+    void refitBVH(const std::vector<BVHRange>& pMoved, bool pOnGpu) {
+        if (!instancedBVH.instances.empty()) {
+            throw std::runtime_error("instanced meshes are moved with moveInstance, not refitted!");
+        }
+        if (finalBVHThread.joinable()) {
+            throw std::runtime_error("the scene cannot be edited before the final BVH is swapped in!");
+        }
+
+        vkDeviceWaitIdle(device);
+
+        // Both refits below recompute every bound, so the corners snapped
+        // again when a compressed block outgrew its steps are covered too
+        uploadTriangleRanges(pMoved);
+
+        // Inserted and removed meshes change the levels the GPU refit walks
+        if (pOnGpu && refitPipeline != VK_NULL_HANDLE && !refitOrderStale) {
+            VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, refitPipeline);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, refitPipelineLayout, 0, 1, &refitDescriptorSet, 0, nullptr);
+
+            for (size_t level = 0; level + 1 < refitLevelOffsets.size(); level++) {
+                std::array<int32_t, 2> levelRange = { refitLevelOffsets[level], refitLevelOffsets[level + 1] - refitLevelOffsets[level] };
+                vkCmdPushConstants(commandBuffer, refitPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(levelRange), levelRange.data());
+                vkCmdDispatch(commandBuffer, (levelRange[1] + 63) / 64, 1, 1);
+
+                // The next level reads the bounds written by this one
+                VkMemoryBarrier barrier{};
+                barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+                barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+                vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+            }
+
+            endSingleTimeCommands(commandBuffer);
+            refitOnGpuOnly = true;
+        }
+        else {
+            bvh.refit(triangles);
+            refitOnGpuOnly = false;
+
+            if (!bvh.quantizedNodes.empty()) {
+                std::vector<BVHRange> ranges = bvh.refitWideNodes;
+                int stride = QUANTIZED_HEADER_SIZE + bvh.wideWidth() * QUANTIZED_CHILD_SIZE;
+                for (BVHRange& range : ranges) {
+                    range = BVHRange{ range.first * stride, range.count * stride };
+                }
+                uploadBufferRanges(nodesBuffer, bvh.quantizedNodes.data(), sizeof(uint32_t), ranges);
+            }
+            else if (!bvh.wideNodes.empty()) {
+                std::vector<BVHRange> ranges = bvh.refitWideNodes;
+                for (BVHRange& range : ranges) {
+                    range = BVHRange{ range.first * bvh.wideWidth(), range.count * bvh.wideWidth() };
+                }
+                uploadBufferRanges(nodesBuffer, bvh.wideNodes.data(), sizeof(WideChild), ranges);
+            }
+            else {
+                uploadBufferRanges(nodesBuffer, bvh.nodes.data(), sizeof(Node), bvh.refitNodes);
+            }
+
+            if (bvh.needsRebuild() && !rebuildReported) {
+                std::cout << "BVH SAH cost grew from " << bvh.stats.sahCost << " to " << bvh.stats.refitSahCost << " after refitting, a rebuild is recommended" << std::endl;
+                rebuildReported = true;
+            }
+        }
+
+        worldCamera.frames.x = 0;
+    }
+
+    // Moves the mesh of --bvh-refit-animate up and down and refits the BVH
+    // around it. The first GPU refit is checked against the CPU one.
+    void animateRefit() {
+        if (animatedRanges.empty()) {
+            if (!instancedBVH.instances.empty()) {
+                throw std::runtime_error("--bvh-refit-animate cannot move the meshes of --bvh-instances!");
+            }
+
+            // Each mesh has its own entry of the material table, its triangles
+            // are the ones using it wherever the build moved them
+            BoundingBox meshBounds;
+            for (int i = 0; i < static_cast<int>(triangles.size()); i++) {
+                if (triangles[i].materialIndex != bvhRefitAnimateMesh) {
+                    continue;
+                }
+                if (!animatedRanges.empty() && animatedRanges.back().first + animatedRanges.back().count == i) {
+                    animatedRanges.back().count++;
+                }
+                else {
+                    animatedRanges.push_back(BVHRange{ i, 1 });
+                }
+                animatedRest.push_back(triangles[i]);
+                meshBounds.growToInclude(glm::vec3(triangles[i].min), glm::vec3(triangles[i].max));
+            }
+            if (animatedRanges.empty()) {
+                throw std::runtime_error("--bvh-refit-animate names a mesh without triangles!");
+            }
+
+            glm::vec3 extent = meshBounds.boundsMax - meshBounds.boundsMin;
+            animationAmplitude = 0.25f * std::max(extent.x, std::max(extent.y, extent.z));
+            std::cout << "Animating mesh " << bvhRefitAnimateMesh << ", " << animatedRest.size() << " triangles in " << animatedRanges.size() << " runs" << std::endl;
+        }
+
+        glm::vec4 offset(0.0f, 0.0f, animationAmplitude * static_cast<float>(std::sin(glfwGetTime())), 0.0f);
+        size_t rest = 0;
+        for (const BVHRange& range : animatedRanges) {
+            for (int i = range.first; i < range.first + range.count; i++) {
+                const Triangle& tri = animatedRest[rest++];
+                triangles[i].posA = tri.posA + offset;
+                triangles[i].posB = tri.posB + offset;
+                triangles[i].posC = tri.posC + offset;
+                triangles[i].min = tri.min + offset;
+                triangles[i].max = tri.max + offset;
+            }
+        }
+
+        bool compare = animatedFrames == 0 && !bvhRefitOnCpu && refitPipeline != VK_NULL_HANDLE && !refitOrderStale;
+        refitBVH(animatedRanges, !bvhRefitOnCpu);
+        if (compare) {
+            compareRefits();
+        }
+
+        if (++animatedFrames % 500 == 0 && !refitOnGpuOnly) {
+            std::cout << "BVH refitted in " << bvh.stats.refitTimeMs << " ms, SAH cost: " << bvh.stats.refitSahCost << std::endl;
+        }
+    }
+
+    // Reads back the nodes refit.comp wrote and compares their bounds with a
+    // CPU refit over the same positions, which also brings bvh.nodes up to date
+    void compareRefits() {
+        VkDeviceSize nodesDataSize = sizeof(Node) * bvh.nodes.size();
+        VkBuffer stagingBuffer;
+        VkDeviceMemory stagingBufferMemory;
+        createBuffer(nodesDataSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        VkBufferCopy copyRegion{};
+        copyRegion.size = nodesDataSize;
+        vkCmdCopyBuffer(commandBuffer, nodesBuffer, stagingBuffer, 1, &copyRegion);
+        endSingleTimeCommands(commandBuffer);
+
+        std::vector<Node> gpuNodes(bvh.nodes.size());
+        void* data;
+        vkMapMemory(device, stagingBufferMemory, 0, nodesDataSize, 0, &data);
+        memcpy(gpuNodes.data(), data, nodesDataSize);
+        vkUnmapMemory(device, stagingBufferMemory);
+        vkDestroyBuffer(device, stagingBuffer, nullptr);
+        vkFreeMemory(device, stagingBufferMemory, nullptr);
+
+        bvh.refit(triangles);
+        refitOnGpuOnly = false;
+
+        int mismatches = 0;
+        float maxDifference = 0.0f;
+        for (size_t i = 0; i < bvh.nodes.size(); i++) {
+            glm::vec3 differences = glm::max(glm::abs(gpuNodes[i].bounds.boundsMin - bvh.nodes[i].bounds.boundsMin), glm::abs(gpuNodes[i].bounds.boundsMax - bvh.nodes[i].bounds.boundsMax));
+            float difference = std::max(differences.x, std::max(differences.y, differences.z));
+            if (difference > 0.0f) {
+                mismatches++;
+                maxDifference = std::max(maxDifference, difference);
+            }
+        }
+        std::cout << "GPU refit against CPU refit: " << mismatches << " of " << bvh.nodes.size() << " node bounds differ, by at most " << maxDifference << std::endl;
+    }
+
+    // Adds the triangles to the scene without a rebuild. Returns the handle to
+    // pass to removeMesh.
+    BVHRange insertMesh(const std::vector<Triangle>& pTriangles) {
+        if (!instancedBVH.instances.empty()) {
+            throw std::runtime_error("meshes cannot be inserted into an instanced scene!");
+        }
+        if (triangleStreams.indexed) {
+            throw std::runtime_error("meshes cannot be inserted into an indexed scene, the vertex table is fixed!");
+        }
+        if (finalBVHThread.joinable()) {
+            throw std::runtime_error("the scene cannot be edited before the final BVH is swapped in!");
+        }
+
+        vkDeviceWaitIdle(device);
+        if (refitOnGpuOnly) {
+            bvh.refit(triangles);
+            refitOnGpuOnly = false;
+        }
+
+        // The buffers keep SCENE_EDIT_HEADROOM spare, past it the scene needs a rebuild
+        VkDeviceSize maxTriangles = triangleStreams.compressed
+            ? trianglesBufferSize / (sizeof(uint32_t) * COMPRESSED_BLOCK_WORDS) * COMPRESSED_BLOCK_SIZE
+            : trianglesBufferSize / triangleStreams.intersectionSize(1);
+        maxTriangles = std::min(maxTriangles, triangleShadingBufferSize / (triangleStreams.compressed ? sizeof(CompressedShading) : sizeof(TriangleShading)));
+        BVHRange mesh = bvh.insertTriangles(triangles, pTriangles, static_cast<int>(nodesBufferSize / sizeof(Node)), static_cast<int>(maxTriangles));
+
+        // Compressed, the inserted corners only reach the steps of their blocks
+        // now, and all corners move if one of the blocks outgrew its steps. The
+        // refit fits the bounds to them.
+        uploadTriangleRanges(bvh.editedTriangles);
+        uploadBufferRanges(nodesBuffer, bvh.nodes.data(), sizeof(Node), bvh.editedNodes);
+        if (triangleStreams.compressed) {
+            bvh.refit(triangles);
+            uploadBufferRanges(nodesBuffer, bvh.nodes.data(), sizeof(Node), bvh.refitNodes);
+        }
+        refitOrderStale = true;
+
+        std::cout << "Inserted " << mesh.count << " triangles into the BVH in " << bvh.stats.editTimeMs << " ms, " << bvh.editedNodes.size() << " node ranges uploaded" << std::endl;
+        worldCamera.frames.x = 0;
+        return mesh;
+    }
+
+    void removeMesh(const BVHRange& pMesh) {
+        if (finalBVHThread.joinable()) {
+            throw std::runtime_error("the scene cannot be edited before the final BVH is swapped in!");
+        }
+        vkDeviceWaitIdle(device);
+        if (refitOnGpuOnly) {
+            bvh.refit(triangles);
+            refitOnGpuOnly = false;
+        }
+
+        bvh.removeTriangles(pMesh);
+        uploadBufferRanges(nodesBuffer, bvh.nodes.data(), sizeof(Node), bvh.editedNodes);
+        refitOrderStale = true;
+
+        std::cout << "Removed " << pMesh.count << " triangles from the BVH in " << bvh.stats.editTimeMs << " ms, " << bvh.editedNodes.size() << " node ranges uploaded" << std::endl;
+        worldCamera.frames.x = 0;
+    }
+
+    // --bvh-edit-demo: inserts a copy of a mesh shifted by half the scene and
+    // removes it again, comparing the edited BVH with a full build each time
+    void runEditDemo() {
+        BoundingBox sceneBounds = bvh.nodes[0].bounds;
+        glm::vec4 offset(0.5f * (sceneBounds.boundsMax.x - sceneBounds.boundsMin.x), 0.0f, 0.0f, 0.0f);
+
+        // Each mesh has its own entry of the material table
+        std::vector<Triangle> copy;
+        for (const Triangle& tri : triangles) {
+            if (tri.materialIndex != bvhEditDemoMesh) {
+                continue;
+            }
+            Triangle moved = tri;
+            moved.posA += offset;
+            moved.posB += offset;
+            moved.posC += offset;
+            moved.min += offset;
+            moved.max += offset;
+            copy.push_back(moved);
+        }
+        if (copy.empty()) {
+            throw std::runtime_error("--bvh-edit-demo names a mesh without triangles!");
+        }
+
+        BVHRange mesh = insertMesh(copy);
+        compareEditWithRebuild("after the insert");
+        removeMesh(mesh);
+        compareEditWithRebuild("after the removal");
+    }
+
+    void compareEditWithRebuild(const char* pLabel) {
+        // The triangles still referenced by a leaf, removed ones stay in place
+        std::vector<Triangle> live;
+        std::vector<int> nodeStack = { 0 };
+        while (!nodeStack.empty()) {
+            const Node& node = bvh.nodes[nodeStack.back()];
+            nodeStack.pop_back();
+            if (node.childIndex != 0) {
+                nodeStack.push_back(node.childIndex);
+                nodeStack.push_back(node.childIndex + 1);
+                continue;
+            }
+            live.insert(live.end(), triangles.begin() + node.triangleIndex, triangles.begin() + node.triangleIndex + node.triangleCount);
+        }
+
+        BVH rebuilt;
+        rebuilt.settings = bvh.settings;
+        rebuilt.build(live);
+
+        // Random rays from inside the scene must find the same closest hits
+        const int rayCount = 4096;
+        BoundingBox sceneBounds = bvh.nodes[0].bounds;
+        std::mt19937 rng(1);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        int mismatches = 0;
+        for (int i = 0; i < rayCount; i++) {
+            glm::vec3 origin = sceneBounds.boundsMin + glm::vec3(unit(rng), unit(rng), unit(rng)) * (sceneBounds.boundsMax - sceneBounds.boundsMin);
+            glm::vec3 dir = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f);
+            float editedDst, rebuiltDst;
+            int editedTriangle, rebuiltTriangle;
+            bool editedHit = bvh.intersectLazy(triangles, origin, dir, editedDst, editedTriangle);
+            bool rebuiltHit = rebuilt.intersectLazy(live, origin, dir, rebuiltDst, rebuiltTriangle);
+            if (editedHit != rebuiltHit || (editedHit && std::abs(editedDst - rebuiltDst) > 1e-4f * std::max(1.0f, rebuiltDst))) {
+                mismatches++;
+            }
+        }
+
+        std::cout << "Edited BVH " << pLabel << ": SAH cost " << bvh.computeSAHCost() << " against " << rebuilt.computeSAHCost() << " for a full build of the " << live.size() << " triangles, "
+            << mismatches << " of " << rayCount << " rays hit differently" << std::endl;
+    }
+
+    // Places instance pInstance of the --bvh-instances grid at pTransform. Only
+    // the top level BVH is rebuilt, the meshes keep their nodes. Like the
+    // materials, the upload is left to the next compute command buffer.
+    void moveInstance(int pInstance, const glm::mat4& pTransform) {
+        if (pInstance < 0 || pInstance >= static_cast<int>(instancedBVH.instances.size())) {
+            throw std::runtime_error("instance index out of range!");
+        }
+
+        instancedBVH.setTransform(pInstance, pTransform);
+        instancedBVH.buildTopLevel();
+
+        topLevelDirty = true;
+        worldCamera.frames.x = 0;
+    }
+
+    void recordInstanceUpdates(VkCommandBuffer commandBuffer) {
+        if (!topLevelDirty) {
+            return;
+        }
+
+        // The dispatches submitted before still read the top level
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        // buildTopLevel stores the instances in the order of the new leaves, so
+        // every record may have moved and the whole array goes up with the
+        // nodes. vkCmdUpdateBuffer takes at most 65536 bytes at a time.
+        const char* topLevel = reinterpret_cast<const char*>(instancedBVH.nodes.data());
+        VkDeviceSize topLevelBytes = sizeof(Node) * instancedBVH.topLevelSize();
+        for (VkDeviceSize offset = 0; offset < topLevelBytes; offset += 65536) {
+            vkCmdUpdateBuffer(commandBuffer, nodesBuffer, offset, std::min<VkDeviceSize>(65536, topLevelBytes - offset), topLevel + offset);
+        }
+        const char* instanceRecords = reinterpret_cast<const char*>(instancedBVH.instances.data());
+        VkDeviceSize instanceBytes = sizeof(Instance) * instancedBVH.instances.size();
+        for (VkDeviceSize offset = 0; offset < instanceBytes; offset += 65536) {
+            vkCmdUpdateBuffer(commandBuffer, instancesBuffer, offset, std::min<VkDeviceSize>(65536, instanceBytes - offset), instanceRecords + offset);
+        }
+
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        topLevelDirty = false;
+    }
+
+    // Moves the instance of --bvh-instance-animate up and down by a quarter of
+    // the size of its mesh
+    void animateInstance() {
+        if (animatedInstanceFrames == 0) {
+            if (bvhInstanceAnimate >= static_cast<int>(instancedBVH.instances.size())) {
+                throw std::runtime_error("--bvh-instance-animate names an instance outside of the --bvh-instances grid!");
+            }
+            animatedInstanceRest = instancedBVH.transform(bvhInstanceAnimate);
+
+            // Every copy of the grid instances the meshes in order
+            BoundingBox meshBounds = instancedBVH.meshBounds(bvhInstanceAnimate % static_cast<int>(meshes.size()));
+            glm::vec3 extent = meshBounds.boundsMax - meshBounds.boundsMin;
+            instanceAmplitude = 0.25f * std::max(extent.x, std::max(extent.y, extent.z));
+        }
+
+        glm::vec3 offset(0.0f, 0.0f, instanceAmplitude * static_cast<float>(std::sin(glfwGetTime())));
+        moveInstance(bvhInstanceAnimate, glm::translate(glm::mat4(1.0f), offset) * animatedInstanceRest);
+
+        if (++animatedInstanceFrames % 500 == 0) {
+            std::cout << "Top level BVH rebuilt in " << instancedBVH.topLevelStats.buildTimeMs << " ms, SAH cost: " << instancedBVH.topLevelStats.sahCost << std::endl;
+        }
+    }
+
+    // Replaces entry pIndex of the material table. Only the edited entries are
+    // uploaded, from the next compute command buffer, so the frames in flight
+    // are not waited for.
+    void setMaterial(int pIndex, const Material& pMaterial) {
+        if (pIndex < 0 || pIndex >= static_cast<int>(materialTable.size())) {
+            throw std::runtime_error("material index out of range!");
+        }
+
+        materialTable[pIndex] = pMaterial;
+        if (std::find(dirtyMaterials.begin(), dirtyMaterials.end(), pIndex) == dirtyMaterials.end()) {
+            dirtyMaterials.push_back(pIndex);
+        }
+        worldCamera.frames.x = 0;
+    }
+
+    // Swaps the material of highlightMaterial for a glowing one and back
+    void toggleHighlight() {
+        if (highlightMaterial >= static_cast<int>(materialTable.size())) {
+            throw std::runtime_error("--highlight-material is outside of the material table!");
+        }
+
+        if (!materialHighlighted) {
+            highlightedOriginal = materialTable[highlightMaterial];
+            Material glowing = highlightedOriginal;
+            glowing.emissionColor = glm::vec4(1.0f, 0.3f, 0.1f, 0.0f);
+            glowing.emissionStrength = 4.0f;
+            setMaterial(highlightMaterial, glowing);
+        }
+        else {
+            setMaterial(highlightMaterial, highlightedOriginal);
+        }
+        materialHighlighted = !materialHighlighted;
+    }
+
+    void recordMaterialUpdates(VkCommandBuffer commandBuffer) {
+        if (dirtyMaterials.empty()) {
+            return;
+        }
+
+        // The dispatches submitted before still read the table
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        for (int index : dirtyMaterials) {
+            vkCmdUpdateBuffer(commandBuffer, materialsBuffer, sizeof(Material) * index, sizeof(Material), &materialTable[index]);
+        }
+
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+        dirtyMaterials.clear();
+    }
+
+    uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
+        VkPhysicalDeviceMemoryProperties memProperties;
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+
+        for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+            if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+                return i;
+            }
+        }
+
+        throw std::runtime_error("failed to find suitable memory type!");
+    }
+
+    void createCommandBuffers() {
+        commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
+
+        if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate command buffers!");
+        }
+    }
+
+    void createComputeCommandBuffers() {
+        computeCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = (uint32_t)computeCommandBuffers.size();
+
+        if (vkAllocateCommandBuffers(device, &allocInfo, computeCommandBuffers.data()) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate compute command buffers!");
+        }
+    }
+
+    void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex) {
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin recording command buffer!");
+        }
+
+        transitionImageLayout(storageImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+        VkRenderPassBeginInfo renderPassInfo{};
+        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        renderPassInfo.renderPass = renderPass;
+        renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+        renderPassInfo.renderArea.offset = { 0, 0 };
+        renderPassInfo.renderArea.extent = swapChainExtent;
+
+        VkClearValue clearColor = { {{0.0f, 0.0f, 0.0f, 1.0f}} };
+        renderPassInfo.clearValueCount = 1;
+        renderPassInfo.pClearValues = &clearColor;
+
+        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
         vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &graphicsDescriptorSets[currentFrame], 0, nullptr);
 
         VkViewport viewport{};
@@ -1469,6 +3054,8 @@ private:
         }
 
         transitionImageLayout(storageImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+        recordMaterialUpdates(commandBuffer);
+        recordInstanceUpdates(commandBuffer);
 
         vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipeline);
         vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, computePipelineLayout, 0, 1, &computeDescriptorSets[currentFrame], 0, nullptr);
@@ -1525,6 +3112,10 @@ private:
         // Compute submission        
         vkWaitForFences(device, 1, &computeInFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
 
+        if (finalBVHReady) {
+            swapFinalBVH();
+        }
+
         updateUniformBuffer(currentFrame);
 
         vkResetFences(device, 1, &computeInFlightFences[currentFrame]);
@@ -1803,6 +3394,17 @@ private:
             }
         }
 
+        // Corners with the same position and normal share one vertex
+        std::unordered_map<uint64_t, uint32_t> vertexIds;
+        auto vertexIndex = [&](const tinyobj::index_t& pIndex, const glm::vec4& pPosition, const glm::vec4& pNormal) {
+            uint64_t key = static_cast<uint64_t>(static_cast<uint32_t>(pIndex.vertex_index)) << 32 | static_cast<uint32_t>(pIndex.normal_index);
+            auto [it, inserted] = vertexIds.try_emplace(key, static_cast<uint32_t>(triangleStreams.vertices.size()));
+            if (inserted) {
+                triangleStreams.vertices.push_back(Vertex{ pPosition, pNormal });
+            }
+            return it->second;
+        };
+
         for (const auto& shape : shapes) {
             unsigned int count = 0;
             Triangle tri{};
@@ -1810,6 +3412,7 @@ private:
             MeshInfo shapeMesh{};
 
             shapeMesh.info.x = triangles.size();
+            int materialIndex = static_cast<int>(materialTable.size());
             std::map<std::string, int>::iterator it = materialsNames.find(shape.name);
 
             if (it != materialsNames.end()) {
@@ -1829,6 +3432,7 @@ private:
                 shapeMesh.material.smoothness = material.shininess / 1000.0f;
                 shapeMesh.material.specularProbability = (material.ior - 1.0f) / 5.0f;
             }
+            materialTable.push_back(shapeMesh.material);
 
             for (const auto& index : shape.mesh.indices) {
                 switch (count % 3) {
@@ -1840,6 +3444,7 @@ private:
                     tri.normalA = {attrib.normals[3 * index.normal_index + 0],
                                    attrib.normals[3 * index.normal_index + 1],
                                    attrib.normals[3 * index.normal_index + 2], 0};
+                    tri.vertexIndices[0] = vertexIndex(index, tri.posA, tri.normalA);
                     
                     break;
                 case 1:
@@ -1849,6 +3454,7 @@ private:
                     tri.normalB = {attrib.normals[3 * index.normal_index + 0],
                                    attrib.normals[3 * index.normal_index + 1],
                                    attrib.normals[3 * index.normal_index + 2], 0};
+                    tri.vertexIndices[1] = vertexIndex(index, tri.posB, tri.normalB);
                     
                     break;
                 case 2:
@@ -1858,7 +3464,8 @@ private:
                     tri.normalC = {attrib.normals[3 * index.normal_index + 0],
                                    attrib.normals[3 * index.normal_index + 1],
                                    attrib.normals[3 * index.normal_index + 2], 0};
-                    tri.material = shapeMesh.material;
+                    tri.vertexIndices[2] = vertexIndex(index, tri.posC, tri.normalC);
+                    tri.materialIndex = materialIndex;
                     tri.min = glm::min(tri.posA, glm::min(tri.posB, tri.posC));
                     tri.max = glm::max(tri.posA, glm::max(tri.posB, tri.posC));
                     shapeMesh.addTriangle(&tri);
@@ -1872,7 +3479,7 @@ private:
             
         }
 
-        std::cout << "Model loaded with: " << triangles.size() << " triangles." << std::endl;
+        std::cout << "Model loaded with: " << triangles.size() << " triangles, " << triangleStreams.vertices.size() << " unique vertices." << std::endl;
 
         for (auto& mesh : meshes) {
             std::cout << "Mesh loaded with: " << mesh.info.y << " triangles." << std::endl;
@@ -1881,120 +3488,387 @@ private:
 
     }
 
-    void createBVH() {
-        BoundingBox bounds;
+    void createInstancedBVH() {
+        instancedBVH.settings = bvhSettings;
+        if (bvhSettings.width > 2 || bvhSettings.quantized || bvhSettings.childBounds) {
+            std::cout << "Instancing uses the binary node layout, ignoring --bvh-width, --bvh-quantized and --bvh-child-bounds" << std::endl;
+        }
 
-        for (const auto& tri : triangles) {
-            bounds.growToInclude(&tri);
+        int numMeshes = static_cast<int>(meshes.size());
+        instancedBVH.buildBottomLevels(triangles, meshes, bvhInstances * numMeshes);
+
+        BoundingBox modelBounds;
+        for (int mesh = 0; mesh < numMeshes; mesh++) {
+            modelBounds.growToInclude(instancedBVH.meshBounds(mesh));
         }
+        glm::vec3 spacing = (modelBounds.boundsMax - modelBounds.boundsMin) * 1.25f;
 
-        Node* root = new Node{ bounds, 0, (int)triangles.size(), MAX_DEPTH > 0 ? 1 : 0 };
+        // Square grid on the xz plane, every copy instances each mesh of the model
+        int gridSize = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(bvhInstances))));
+        for (int copy = 0; copy < bvhInstances; copy++) {
+            glm::vec3 offset = glm::vec3(copy % gridSize, 0.0f, copy / gridSize) * spacing;
+            for (int mesh = 0; mesh < numMeshes; mesh++) {
+                instancedBVH.addInstance(mesh, glm::translate(glm::mat4(1.0f), offset));
+            }
+        }
+        instancedBVH.buildTopLevel();
 
-        allNodes.push_back(root);
-        split(root);
+        std::cout << "Instanced " << numMeshes << " meshes " << bvhInstances << " times: " << instancedBVH.nodes.size() - instancedBVH.topLevelSize() << " mesh nodes, top level built in " << instancedBVH.topLevelStats.buildTimeMs << " ms over " << instancedBVH.instances.size() << " instances, SAH cost: " << instancedBVH.topLevelStats.sahCost << std::endl;
     }
 
-    void split(Node* pParent, int pDepth = 0) {
-        if (pDepth == MAX_DEPTH || pParent->triangleCount <= 1) return;
+    void createBVH() {
+        // gpubuild.comp writes the sorted positions straight into trianglesBuffer
+        bool gpuBuild = bvhGpuBuild && bvhInstances == 0;
+        if ((bvhWoopTriangles || bvhIndexedTriangles || bvhCompressedTriangles) && gpuBuild) {
+            std::cout << "--bvh-woop, --bvh-indexed and --bvh-compressed are not available with --bvh-gpu, the triangles keep their positions" << std::endl;
+        }
+        else if (bvhIndexedTriangles && (bvhWoopTriangles || bvhCompressedTriangles)) {
+            std::cout << "--bvh-woop and --bvh-compressed are ignored with --bvh-indexed, the triangles are read through their indices" << std::endl;
+        }
+        else if (bvhWoopTriangles && bvhCompressedTriangles) {
+            std::cout << "--bvh-woop is ignored with --bvh-compressed, the triangles are read from the compressed blocks" << std::endl;
+        }
+        triangleStreams.indexed = bvhIndexedTriangles && !gpuBuild;
+        triangleStreams.compressed = bvhCompressedTriangles && !gpuBuild && !triangleStreams.indexed;
+        triangleStreams.woop = bvhWoopTriangles && !gpuBuild && !triangleStreams.indexed && !triangleStreams.compressed;
+        finalTriangleStreams.indexed = triangleStreams.indexed;
+        finalTriangleStreams.compressed = triangleStreams.compressed;
+        finalTriangleStreams.woop = triangleStreams.woop;
+        if (!triangleStreams.indexed) {
+            triangleStreams.vertices.clear();
+            triangleStreams.vertices.shrink_to_fit();
+        }
+
+        if (bvhInstances > 0) {
+            if (bvhStatsEnabled) {
+                std::cout << "--bvh-stats is not available with --bvh-instances" << std::endl;
+            }
+            if (bvhGpuBuild) {
+                std::cout << "--bvh-gpu is not available with --bvh-instances, building on the CPU" << std::endl;
+                bvhGpuBuild = false;
+            }
+            createInstancedBVH();
 
-        glm::vec3 info = chooseSplit(pParent); //cost, pos, axis;
-        if (info.x >= nodeCost(pParent->bounds.boundsMax - pParent->bounds.boundsMin, pParent->triangleCount))
+            // As below, the compressed corners move to where the blocks
+            // decode them, here in the mesh order of the bottom levels
+            if (triangleStreams.compressed) {
+                triangleStreams.update(triangles);
+                instancedBVH.refitBottomLevels(triangles);
+            }
             return;
+        }
 
-        pParent->childIndex = allNodes.size();
-        Node* childA = new Node();
-        Node* childB = new Node();
-        childA->triangleIndex = pParent->triangleIndex;
-        childB->triangleIndex = pParent->triangleIndex;
-        allNodes.push_back(childA);
-        allNodes.push_back(childB);
+        bvh.settings = bvhSettings;
+        if (bvhGpuBuild) {
+            buildBVHOnGPU();
+        }
+        else if (bvhPreview || bvhLazy) {
+            startFinalBVHBuild();
+
+            // Only the builder differs, the shader reads both trees the same way
+            bvh.settings.builder = BVHBuilderType::Linear;
+            bvh.settings.treeletLeaves = 0;
+            bvh.settings.layout = BVHNodeLayout::BuildOrder;
+            bvh.build(triangles);
+        }
+        else {
+            bvh.build(triangles);
+        }
 
-        int currentIndex = pParent->triangleIndex;
-        int endIndex = pParent->triangleIndex + pParent->triangleCount;
+        // Compressed now so the summary can report the error, the blocks
+        // follow the leaf order. The update moves the corners to where the
+        // blocks decode them and the bounds are refitted around them.
+        if (triangleStreams.compressed) {
+            triangleStreams.update(triangles);
+            bvh.refit(triangles);
+        }
+        printBVHSummary();
+    }
 
-        for (int i = currentIndex; i < endIndex; i++) {
-            Triangle& tri = triangles[i];
-            glm::vec3 triCenter = (tri.posA + tri.posB + tri.posC) / 3.0f;
+    void printBVHSummary() {
+        const char* builderNames[] = { "binned SAH", "SBVH", "LBVH" };
+        if (bvhGpuBuild) {
+            std::cout << "LBVH built on the GPU in " << bvh.stats.buildTimeMs << " ms with " << bvh.nodes.size() << " nodes, SAH cost: " << bvh.stats.sahCost << std::endl;
+        }
+        else {
+            std::cout << builderNames[(int)bvh.settings.builder] << " BVH built in " << bvh.stats.buildTimeMs << " ms on " << bvh.stats.numThreads << " threads with " << bvh.nodes.size() << " nodes, SAH cost: " << bvh.stats.sahCost << std::endl;
+        }
 
-            bool inA = triCenter[info.z] < info.y;
-            Node* child = inA ? childA : childB;
-            child->bounds.growToInclude(&tri);
-            child->triangleCount++;
+        if (!bvh.wideNodes.empty()) {
+            std::cout << "Collapsed to BVH" << bvh.wideWidth() << " with " << bvh.wideNodes.size() / bvh.wideWidth() << " nodes, depth " << bvh.stats.wideDepth << ", traversal stack " << bvh.wideStackSize() << std::endl;
+        }
 
-            if (inA) {
-                int swapIndex = child->triangleIndex + child->triangleCount - 1;
-                std::swap(triangles[i], triangles[swapIndex]);
-                childB->triangleIndex++;
-            }
+        std::cout << "Node memory: binary " << sizeof(Node) * bvh.nodes.size() / 1024 << " KB";
+        if (!bvh.wideNodes.empty()) {
+            std::cout << ", BVH" << bvh.wideWidth() << " " << sizeof(WideChild) * bvh.wideNodes.size() / 1024 << " KB";
         }
+        if (!bvh.quantizedNodes.empty()) {
+            std::cout << ", quantized BVH" << bvh.wideWidth() << " " << sizeof(uint32_t) * bvh.quantizedNodes.size() / 1024 << " KB";
+        }
+        std::cout << std::endl;
 
-        // Handle case where a child node has zero triangles
-        if (childA->triangleCount == 0) {
-            childA->bounds.boundsMin = glm::vec3(0.0f);
-            childA->bounds.boundsMax = glm::vec3(0.0f);
+        if (triangleStreams.compressed) {
+            const CompressionError& error = triangleStreams.compressedError;
+            std::cout << "Compressed triangles: " << (double)(triangleStreams.intersectionSize(triangles.size()) + triangleStreams.shadingSize()) / std::max<size_t>(triangles.size(), 1)
+                << " B per triangle instead of " << sizeof(TriangleIntersection) + sizeof(TriangleShading) << " B, normal error up to " << error.maxNormalAngle << " degrees, position error up to "
+                << error.maxPositionError << " (mean " << error.meanPositionError << ", " << error.maxPositionError / std::max(error.sceneExtent, 1e-30f) * 100.0f << "% of the scene extent, block steps from "
+                << error.minBlockStep << " to " << error.maxBlockStep << ")" << std::endl;
         }
-        if (childB->triangleCount == 0) {
-            childB->bounds.boundsMin = glm::vec3(0.0f);
-            childB->bounds.boundsMax = glm::vec3(0.0f);
+
+        if (bvh.stats.lazySubtrees > 0) {
+            std::cout << "Lazy BVH left " << bvh.stats.lazySubtrees << " subtrees of up to " << bvh.settings.lazySubtreeSize << " triangles unbuilt, " << bvh.stats.lazyRays << " sampled rays (" << bvh.stats.lazyRayHits
+                << " hits) built " << bvh.stats.lazyExpandedSubtrees << " of them in " << bvh.stats.lazyRayTimeMs << " ms, completeLazy built the rest in " << bvh.stats.lazyCompleteTimeMs << " ms" << std::endl;
         }
 
-        split(childA, pDepth + 1);
-        split(childB, pDepth + 1);
-    }
+        if (bvh.stats.treeletTimeMs > 0.0) {
+            std::cout << "Treelet optimization took " << bvh.stats.treeletTimeMs << " ms, SAH cost before: " << bvh.stats.unoptimizedSahCost << std::endl;
+        }
 
-    float evaluateSplit(Node* pNode, int pAxis, float pPos) {
-        BoundingBox boxA{};
-        BoundingBox boxB{};
+        PROCESS_MEMORY_COUNTERS memoryCounters{};
+        GetProcessMemoryInfo(GetCurrentProcess(), &memoryCounters, sizeof(memoryCounters));
+        if (bvh.stats.duplicatedReferences > 0) {
+            std::cout << "Spatial splits duplicated " << bvh.stats.duplicatedReferences << " triangle references." << std::endl;
+        }
+
+        std::cout << "BVH peak build memory: " << bvh.stats.peakMemoryBytes / (1024.0 * 1024.0) << " MB, process peak working set: " << memoryCounters.PeakWorkingSetSize / (1024.0 * 1024.0) << " MB" << std::endl;
+
+        if (bvhStatsEnabled) {
+            printBVHStats();
+        }
+        if (bvhLayoutBenchmark) {
+            benchmarkBVHLayouts();
+        }
+    }
 
-        int numInA = 0;
-        int numInB = 0;
+    // Builds the tree of bvhSettings on a background thread and stages its
+    // buffers there too, the render loop swaps it in with swapFinalBVH
+    void startFinalBVHBuild() {
+        finalTriangles = triangles;
+        finalTriangleStreams.vertices = triangleStreams.vertices;
+        finalBVH.settings = bvhSettings;
 
-        for (int i = pNode->triangleIndex; i < pNode->triangleIndex + pNode->triangleCount; i++) {
-            Triangle tri = triangles[i];
-            glm::vec3 triCenter = (tri.posA + tri.posB + tri.posC) / 3.0f;
+        finalBVHThread = std::thread([this]() {
+            try {
+                if (bvhLazy) {
+                    // CPU rays use the tree while its subtrees are built on
+                    // demand, the shader needs every one of them
+                    finalBVH.settings.builder = BVHBuilderType::BinnedSAH;
+                    finalBVH.buildLazy(finalTriangles);
+                    finalBVH.castLazyRays(finalTriangles, bvhStatsRays);
+                    finalBVH.completeLazy(finalTriangles);
+                }
+                else {
+                    finalBVH.build(finalTriangles);
+                }
+                finalTriangleStreams.update(finalTriangles);
+                if (finalTriangleStreams.compressed) {
+                    finalBVH.refit(finalTriangles);
+                }
 
-            if (triCenter[pAxis] < pPos) {
-                boxA.growToInclude(&tri);
-                numInA++;
+                const void* nodesData;
+                VkDeviceSize nodesDataSize;
+                getNodeData(finalBVH, nodesData, nodesDataSize);
+                std::array<const void*, 3> stagingData = { finalTriangleStreams.intersectionData(), finalTriangleStreams.shadingData(), nodesData };
+                std::array<VkDeviceSize, 3> stagingSizes = { finalTriangleStreams.intersectionSize(finalTriangles.size()), finalTriangleStreams.shadingSize(), nodesDataSize };
+
+                for (size_t i = 0; i < finalStagingBuffers.size(); i++) {
+                    void* data;
+                    createBuffer(stagingSizes[i], VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, finalStagingBuffers[i], finalStagingMemory[i]);
+                    vkMapMemory(device, finalStagingMemory[i], 0, stagingSizes[i], 0, &data);
+                    memcpy(data, stagingData[i], (size_t)stagingSizes[i]);
+                    vkUnmapMemory(device, finalStagingMemory[i]);
+                }
             }
-            else {
-                boxB.growToInclude(&tri);
-                numInB++;
+            catch (...) {
+                finalBVHError = std::current_exception();
             }
+            finalBVHReady = true;
+        });
+    }
+
+    // Called at the start of a frame once the final BVH is ready. Only waits
+    // for the frames in flight and the copy from the staging buffers.
+    void swapFinalBVH() {
+        finalBVHThread.join();
+        finalBVHReady = false;
+        if (finalBVHError) {
+            std::rethrow_exception(finalBVHError);
         }
 
-        return nodeCost(boxA.boundsMax - boxA.boundsMin, numInA) + nodeCost(boxB.boundsMax - boxB.boundsMin, numInB);
-    }
+        vkDeviceWaitIdle(device);
 
-    glm::vec3 chooseSplit(Node* pNode) {
-        const int numTestsPerAxis = 5;
-        float bestCost = std::numeric_limits<float>::max();
-        float bestPos = 0;
-        int bestAxis = 0;
+        bvh = std::move(finalBVH);
+        triangles = std::move(finalTriangles);
+        triangleStreams = std::move(finalTriangleStreams);
 
-        for (int axis = 0; axis < 3; axis++) {
-            float boundsStart = pNode->bounds.boundsMin[axis];
-            float boundsEnd = pNode->bounds.boundsMax[axis];
+        vkDestroyBuffer(device, trianglesBuffer, nullptr);
+        vkFreeMemory(device, trianglesBufferMemory, nullptr);
+        vkDestroyBuffer(device, triangleShadingBuffer, nullptr);
+        vkFreeMemory(device, triangleShadingBufferMemory, nullptr);
+        vkDestroyBuffer(device, nodesBuffer, nullptr);
+        vkFreeMemory(device, nodesBufferMemory, nullptr);
 
-            for (int i = 0; i < numTestsPerAxis; i++) {
-                float splitT = (i + 1) / (numTestsPerAxis + 1.0f);
-                float pos = boundsStart + (boundsEnd - boundsStart) * splitT;
-                float cost = evaluateSplit(pNode, axis, pos);
+        // Same capacities as createUniformBuffers gives them
+        VkDeviceSize triangleDataSize = triangleStreams.intersectionSize(triangles.size());
+        VkDeviceSize shadingDataSize = triangleStreams.shadingSize();
+        trianglesBufferSize = triangleDataSize + static_cast<VkDeviceSize>(triangleDataSize * SCENE_EDIT_HEADROOM);
+        triangleShadingBufferSize = shadingDataSize + static_cast<VkDeviceSize>(shadingDataSize * SCENE_EDIT_HEADROOM);
 
-                if (cost < bestCost) {
-                    bestCost = cost; 
-                    bestPos = pos;
-                    bestAxis = axis;
-                }
+        const void* nodesData;
+        VkDeviceSize nodesDataSize;
+        getNodeData(bvh, nodesData, nodesDataSize);
+        nodesBufferSize = nodesDataSize;
+        if (bvh.wideNodes.empty()) {
+            nodesBufferSize += static_cast<VkDeviceSize>(nodesDataSize * SCENE_EDIT_HEADROOM);
+        }
+
+        createBuffer(trianglesBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, trianglesBuffer, trianglesBufferMemory);
+        createBuffer(triangleShadingBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, triangleShadingBuffer, triangleShadingBufferMemory);
+        createBuffer(nodesBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, nodesBuffer, nodesBufferMemory);
+
+        VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+        VkBufferCopy copyRegion{};
+        copyRegion.size = triangleDataSize;
+        vkCmdCopyBuffer(commandBuffer, finalStagingBuffers[0], trianglesBuffer, 1, &copyRegion);
+        copyRegion.size = shadingDataSize;
+        vkCmdCopyBuffer(commandBuffer, finalStagingBuffers[1], triangleShadingBuffer, 1, &copyRegion);
+        copyRegion.size = nodesDataSize;
+        vkCmdCopyBuffer(commandBuffer, finalStagingBuffers[2], nodesBuffer, 1, &copyRegion);
+        endSingleTimeCommands(commandBuffer);
+
+        for (size_t i = 0; i < finalStagingBuffers.size(); i++) {
+            vkDestroyBuffer(device, finalStagingBuffers[i], nullptr);
+            vkFreeMemory(device, finalStagingMemory[i], nullptr);
+            finalStagingBuffers[i] = VK_NULL_HANDLE;
+            finalStagingMemory[i] = VK_NULL_HANDLE;
+        }
+
+        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            std::array<VkDescriptorBufferInfo, 3> bufferInfos{};
+            bufferInfos[0].buffer = trianglesBuffer;
+            bufferInfos[0].range = trianglesBufferSize;
+            bufferInfos[1].buffer = nodesBuffer;
+            bufferInfos[1].range = nodesBufferSize;
+            bufferInfos[2].buffer = triangleShadingBuffer;
+            bufferInfos[2].range = triangleShadingBufferSize;
+            std::array<uint32_t, 3> bindings = { 2, 4, 6 };
+
+            std::array<VkWriteDescriptorSet, 3> descriptorWrite{};
+            for (uint32_t j = 0; j < descriptorWrite.size(); j++) {
+                descriptorWrite[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                descriptorWrite[j].dstSet = computeDescriptorSets[i];
+                descriptorWrite[j].dstBinding = bindings[j];
+                descriptorWrite[j].dstArrayElement = 0;
+                descriptorWrite[j].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+                descriptorWrite[j].descriptorCount = 1;
+                descriptorWrite[j].pBufferInfo = &bufferInfos[j];
             }
+            vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrite.size()), descriptorWrite.data(), 0, nullptr);
         }
 
-        return glm::vec3(bestCost, bestPos, bestAxis);
+        // A deeper wide tree needs a larger traversal stack
+        if (bvhSpecializationData() != computeSpecialization) {
+            vkDestroyPipeline(device, computePipeline, nullptr);
+            vkDestroyPipelineLayout(device, computePipelineLayout, nullptr);
+            createComputePipeline();
+        }
+
+        if (refitPipeline != VK_NULL_HANDLE) {
+            vkDestroyBuffer(device, refitOrderBuffer, nullptr);
+            vkFreeMemory(device, refitOrderBufferMemory, nullptr);
+            writeRefitDescriptorSet();
+        }
+        refitOrderStale = false;
+
+        std::cout << "Swapped the preview BVH for the final one:" << std::endl;
+        printBVHSummary();
+        worldCamera.frames.x = 0;
+    }
+
+    void benchmarkBVHLayouts() {
+        std::cout << "BVH layout benchmark, " << bvhStatsRays << " sampled rays on one thread:" << std::endl;
+
+        double baseTimeMs = 0.0;
+        for (int layout = 0; layout < 5; layout++) {
+            BVH layoutBVH = bvh;
+            layoutBVH.settings.numThreads = 1;
+            layoutBVH.reorderNodes(static_cast<BVHNodeLayout>(layout));
+
+            BVHQualityStats quality;
+            layoutBVH.castSampleRays(triangles, bvhStatsRays, quality);
+            if (layout == 0) {
+                baseTimeMs = quality.rayCastTimeMs;
+            }
+
+            double raysPerSecond = quality.rayCastTimeMs > 0.0 ? bvhStatsRays / (quality.rayCastTimeMs / 1000.0) : 0.0;
+            std::cout << "  " << BVH_LAYOUT_NAMES[layout] << ": " << raysPerSecond / 1e6 << " Mrays/s, " << quality.rayCastTimeMs << " ms (" << baseTimeMs / std::max(quality.rayCastTimeMs, 1e-9) << "x build order)" << std::endl;
+        }
     }
 
-    float nodeCost(glm::vec3 pSize, int pNumTriangles) {
-        float halfArea = pSize.x * (pSize.y + pSize.z) + pSize.y * pSize.z;
-        return halfArea * pNumTriangles;
+    void printBVHStats() {
+        BVHQualityStats quality = bvh.computeQualityStats(triangles, bvhStatsRays);
+
+        std::cout << "BVH stats:" << std::endl;
+        std::cout << "  SAH cost " << quality.sahCost << ", " << quality.nodeCount << " nodes, " << quality.leafCount << " leaves, " << triangles.size() << " triangle references" << std::endl;
+
+        // The binary traversal pushes at most one node per level on top of the one it pops
+        int stackNeeded = quality.maxLeafDepth + 1;
+        std::cout << "  Max leaf depth " << quality.maxLeafDepth << " (MAX_DEPTH " << MAX_DEPTH << "), binary traversal stack " << stackNeeded << " of 33";
+        if (!bvh.wideNodes.empty()) {
+            std::cout << ", BVH" << bvh.wideWidth() << " traversal stack " << bvh.wideStackSize();
+        }
+        std::cout << std::endl;
+        if (quality.maxLeafDepth > MAX_DEPTH || stackNeeded > 33) {
+            std::cout << "  WARNING: the tree is deeper than the shader's traversal stack allows" << std::endl;
+        }
+
+        std::cout << "  Leaves per depth:";
+        for (size_t depth = 0; depth < quality.leafDepthHistogram.size(); depth++) {
+            if (quality.leafDepthHistogram[depth] > 0) {
+                std::cout << " " << depth << ":" << quality.leafDepthHistogram[depth];
+            }
+        }
+        std::cout << std::endl;
+
+        std::cout << "  Leaves per triangle count:";
+        for (size_t count = 0; count < quality.leafSizeHistogram.size(); count++) {
+            if (quality.leafSizeHistogram[count] > 0) {
+                std::cout << " " << count << ":" << quality.leafSizeHistogram[count];
+            }
+        }
+        std::cout << std::endl;
+
+        std::cout << "  EPO " << quality.epo << ", sibling overlap " << quality.childOverlap << " root areas, mean " << quality.meanRelativeOverlap * 100.0f << "% of the parent" << std::endl;
+
+        std::cout << "  Memory: nodes " << quality.nodeBytes / 1024 << " KB";
+        if (quality.wideNodeBytes > 0) {
+            std::cout << ", BVH" << bvh.wideWidth() << " nodes " << quality.wideNodeBytes / 1024 << " KB";
+        }
+        if (quality.quantizedNodeBytes > 0) {
+            std::cout << ", quantized nodes " << quality.quantizedNodeBytes / 1024 << " KB";
+        }
+        if (triangleStreams.indexed) {
+            std::cout << ", triangles " << triangleStreams.intersectionSize(triangles.size()) / 1024 << " KB indices and " << triangleStreams.shadingSize() / 1024 << " KB for " << triangleStreams.vertices.size()
+                << " vertices, " << (triangleStreams.intersectionSize(triangles.size()) + triangleStreams.shadingSize()) / std::max<size_t>(triangles.size(), 1) << " B per triangle instead of "
+                << sizeof(TriangleIntersection) + sizeof(TriangleShading) << " B, " << materialTable.size() << " materials" << std::endl;
+        }
+        else if (triangleStreams.compressed) {
+            std::cout << ", triangles " << triangleStreams.intersectionSize(triangles.size()) / 1024 << " KB compressed positions and " << triangleStreams.shadingSize() / 1024 << " KB compressed shading, "
+                << (double)(triangleStreams.intersectionSize(triangles.size()) + triangleStreams.shadingSize()) / std::max<size_t>(triangles.size(), 1) << " B per triangle instead of "
+                << sizeof(TriangleIntersection) + sizeof(TriangleShading) << " B, " << materialTable.size() << " materials" << std::endl;
+        }
+        else {
+            std::cout << ", triangles " << sizeof(TriangleIntersection) * triangles.size() / 1024 << " KB intersection and " << sizeof(TriangleShading) * triangles.size() / 1024 << " KB shading, "
+                << sizeof(TriangleIntersection) << " B per leaf test instead of " << sizeof(Triangle) << " B, " << materialTable.size() << " materials" << std::endl;
+        }
+
+        if (quality.sampledRays > 0) {
+            std::cout << "  " << quality.sampledRays << " sampled rays: " << quality.nodesPerRay << " nodes and " << quality.trianglesPerRay << " triangles per ray in " << quality.rayCastTimeMs << " ms";
+            if (!bvh.wideNodes.empty()) {
+                std::cout << ", BVH" << bvh.wideWidth() << " " << quality.wideNodesPerRay << " nodes and " << quality.wideTrianglesPerRay << " triangles per ray in " << quality.wideRayCastTimeMs << " ms";
+            }
+            std::cout << std::endl;
+        }
     }
 
     static std::vector<char> readFile(const std::string& filename) {
@@ -2023,7 +3897,141 @@ private:
     }
 };
 
-int main() {
+void parseArguments(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--bvh-bins" && hasValue) {
+            bvhSettings.numBins = std::max(2, std::atoi(argv[++i]));
+        }
+        else if (arg == "--bvh-builder" && hasValue) {
+            std::string builder = argv[++i];
+            if (builder == "sah") {
+                bvhSettings.builder = BVHBuilderType::BinnedSAH;
+            }
+            else if (builder == "sbvh") {
+                bvhSettings.builder = BVHBuilderType::SpatialSAH;
+            }
+            else if (builder == "lbvh") {
+                bvhSettings.builder = BVHBuilderType::Linear;
+            }
+            else {
+                throw std::runtime_error("unknown BVH builder: " + builder);
+            }
+        }
+        else if (arg == "--sbvh-budget" && hasValue) {
+            bvhSettings.spatialSplitBudget = std::max(0.0f, (float)std::atof(argv[++i]));
+        }
+        else if (arg == "--bvh-morton-bits" && hasValue) {
+            bvhSettings.mortonBits = std::atoi(argv[++i]) > 30 ? 63 : 30;
+        }
+        else if (arg == "--bvh-treelets" && hasValue) {
+            bvhSettings.treeletLeaves = std::min(8, std::max(0, std::atoi(argv[++i])));
+        }
+        else if (arg == "--bvh-treelet-iterations" && hasValue) {
+            bvhSettings.treeletIterations = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--bvh-width" && hasValue) {
+            int width = std::atoi(argv[++i]);
+            if (width != 2 && width != 4 && width != 8) {
+                throw std::runtime_error("BVH width must be 2, 4 or 8");
+            }
+            bvhSettings.width = width;
+        }
+        else if (arg == "--bvh-quantized") {
+            bvhSettings.quantized = true;
+        }
+        else if (arg == "--bvh-child-bounds") {
+            bvhSettings.childBounds = true;
+        }
+        else if (arg == "--bvh-rebuild-threshold" && hasValue) {
+            bvhSettings.rebuildThreshold = std::max(1.0f, (float)std::atof(argv[++i]));
+        }
+        else if (arg == "--bvh-refit-animate" && hasValue) {
+            bvhRefitAnimateMesh = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--bvh-refit-cpu") {
+            bvhRefitOnCpu = true;
+        }
+        else if (arg == "--bvh-instances" && hasValue) {
+            bvhInstances = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--highlight-material" && hasValue) {
+            highlightMaterial = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--bvh-edit-demo" && hasValue) {
+            bvhEditDemoMesh = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--bvh-instance-animate" && hasValue) {
+            bvhInstanceAnimate = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--bvh-layout" && hasValue) {
+            std::string layout = argv[++i];
+            auto found = std::find(std::begin(BVH_LAYOUT_NAMES), std::end(BVH_LAYOUT_NAMES), layout);
+            if (found == std::end(BVH_LAYOUT_NAMES)) {
+                throw std::runtime_error("unknown BVH layout: " + layout);
+            }
+            bvhSettings.layout = static_cast<BVHNodeLayout>(found - std::begin(BVH_LAYOUT_NAMES));
+        }
+        else if (arg == "--bvh-layout-benchmark") {
+            bvhLayoutBenchmark = true;
+        }
+        else if (arg == "--bvh-stats") {
+            bvhStatsEnabled = true;
+        }
+        else if (arg == "--bvh-stats-rays" && hasValue) {
+            bvhStatsRays = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--bvh-gpu") {
+            bvhGpuBuild = true;
+        }
+        else if (arg == "--bvh-woop") {
+            bvhWoopTriangles = true;
+        }
+        else if (arg == "--bvh-indexed") {
+            bvhIndexedTriangles = true;
+        }
+        else if (arg == "--bvh-compressed") {
+            bvhCompressedTriangles = true;
+        }
+        else if (arg == "--bvh-triangle-benchmark") {
+            bvhTriangleBenchmark = true;
+        }
+        else if (arg == "--bvh-preview") {
+            bvhPreview = true;
+        }
+        else if (arg == "--bvh-lazy") {
+            bvhLazy = true;
+        }
+        else if (arg == "--bvh-lazy-subtree" && hasValue) {
+            bvhSettings.lazySubtreeSize = std::max(1, std::atoi(argv[++i]));
+        }
+        else if (arg == "--bvh-calibrate") {
+            bvhCalibrate = true;
+        }
+        else if (arg == "--bvh-cost-backend" && hasValue) {
+            bvhCostBackend = argv[++i];
+            if (bvhCostBackend != "cpu" && bvhCostBackend != "gpu" && bvhCostBackend != "none") {
+                throw std::runtime_error("BVH cost backend must be cpu, gpu or none");
+            }
+        }
+        else if (arg == "--bvh-traversal-cost" && hasValue) {
+            bvhTraversalCost = std::max(0.0f, (float)std::atof(argv[++i]));
+        }
+        else if (arg == "--bvh-max-leaf" && hasValue) {
+            bvhMaxLeafSize = std::max(0, std::atoi(argv[++i]));
+        }
+        else if (arg == "--bvh-threads" && hasValue) {
+            bvhSettings.numThreads = std::max(0, std::atoi(argv[++i]));
+        }
+        else {
+            std::cerr << "Ignoring unknown argument: " << arg << std::endl;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
     ComputeShaderApplication app;
     wchar_t exePath[MAX_PATH];
     GetModuleFileName(NULL, exePath, MAX_PATH);
@@ -2039,7 +4047,9 @@ int main() {
     std::cout << EXE_PATH << std::endl;
 
     MODEL_PATH = "../VulkanTest/DragonInBox.obj";
+
     try {
+        parseArguments(argc, argv);
         app.run();
     }
     catch (const std::exception& e) {